@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Filename: age_hist.h
+ *
+ * Purpose: histogram of live allocations by age that stat_server keeps up
+ * to date as allocations come and go, so reporting does not have to visit
+ * every live allocation.
+ *
+ * Live allocations younger than the last bin boundary are counted per
+ * creation tick in a timing wheel. As time advances, the ticks that cross a
+ * bin boundary move their whole count to the next bin, so advancing costs
+ * O(number of bins) per tick no matter how many allocations are live.
+ *
+ ******************************************************************************/
+
+#ifndef AGE_HIST_H_INCLUDED
+#define AGE_HIST_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+#define AGE_TICK_US			100000		// wheel resolution, 100ms
+#define AGE_TICKS_PER_SEC	(1000000 / AGE_TICK_US)
+#define NUM_AGE_BINS		5
+
+// bin i holds ages below age_bin_limit[i] ticks, the last bin everything older
+static const uint64_t age_bin_limit[NUM_AGE_BINS - 1] = {
+	1 * AGE_TICKS_PER_SEC,
+	10 * AGE_TICKS_PER_SEC,
+	100 * AGE_TICKS_PER_SEC,
+	1000 * AGE_TICKS_PER_SEC,
+};
+
+#define AGE_WHEEL_TICKS		(1000 * AGE_TICKS_PER_SEC)	// last bin boundary
+
+class age_hist {
+public:
+	uint64_t bins[NUM_AGE_BINS];
+
+	age_hist() : current_tick(0)
+	{
+		memset(bins, 0, sizeof(bins));
+		memset(wheel, 0, sizeof(wheel));
+	}
+
+	void add(uint64_t time_us, uint64_t now_us, uint64_t count = 1)
+	{
+		update(to_tick(time_us), now_us, count);
+	}
+
+	void remove(uint64_t time_us, uint64_t now_us, uint64_t count = 1)
+	{
+		update(to_tick(time_us), now_us, -count);
+	}
+
+	// promote ticks whose age crossed a bin boundary since the last call
+	void advance(uint64_t now_us)
+	{
+		uint64_t now_tick = to_tick(now_us);
+		uint64_t tick;
+
+		while (current_tick < now_tick) {
+			current_tick++;
+
+			for (uint32_t i = 0; i < NUM_AGE_BINS - 1; i++) {
+				if (current_tick < age_bin_limit[i]) {
+					break;
+				}
+				tick = current_tick - age_bin_limit[i];
+				bins[i] 	-= wheel[tick % AGE_WHEEL_TICKS];
+				bins[i + 1] += wheel[tick % AGE_WHEEL_TICKS];
+			}
+
+			// the oldest tick is now only counted in the last bin, its wheel
+			// slot is reused for the new current tick
+			wheel[current_tick % AGE_WHEEL_TICKS] = 0;
+		}
+	}
+
+private:
+	uint64_t current_tick;
+	uint64_t wheel[AGE_WHEEL_TICKS];	// live count by creation tick
+
+	static uint64_t to_tick(uint64_t time_us)
+	{
+		return time_us / AGE_TICK_US;
+	}
+
+	void update(uint64_t tick, uint64_t now_us, uint64_t delta)
+	{
+		uint64_t age;
+		uint32_t bin;
+
+		advance(now_us);
+
+		// stamps from a little in the future count as brand new
+		if (tick > current_tick) {
+			tick = current_tick;
+		}
+
+		age = current_tick - tick;
+		for (bin = 0; bin < NUM_AGE_BINS - 1; bin++) {
+			if (age < age_bin_limit[bin]) {
+				break;
+			}
+		}
+
+		bins[bin] += delta;
+		if (bin < NUM_AGE_BINS - 1) {
+			wheel[tick % AGE_WHEEL_TICKS] += delta;
+		}
+	}
+};
+
+#endif // AGE_HIST_H_INCLUDED
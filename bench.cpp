@@ -0,0 +1,466 @@
+/*******************************************************************************
+ * Filename: bench.cpp
+ *
+ * Purpose: microbenchmark of malloc(), free(), calloc(), realloc(),
+ * posix_memalign() and operator new/delete for measuring what the
+ * shared_client hooks cost. Run it plain for libc, and
+ * with libshared_client.so in LD_PRELOAD for each transport and mode; see
+ * build_bench.sh, which does both.
+ *
+ * Every pattern times batches of calls rather than single calls, so clock
+ * reads stay out of the numbers. Results are one row per pattern, size
+ * distribution, thread count and call, in CSV or JSON lines.
+ *
+ * usage: bench [-l label] [-n calls] [-t max_threads] [-f csv|json] [-H]
+ *
+ ******************************************************************************/
+
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h> // exp2, log2
+#include <time.h>
+#include <unistd.h> // getopt, sysconf
+#include <pthread.h> // pthread_barrier_t
+#include <sched.h> // sched_yield
+
+using namespace std;
+
+#define BATCH					256		// calls timed together
+#define QUEUE_SLOTS				1024	// producer/consumer, power of two
+
+#define CALL_MALLOC				0
+#define CALL_FREE				1
+#define CALL_CALLOC				2
+#define CALL_REALLOC			3
+#define CALL_MEMALIGN			4
+#define CALL_NEW				5
+#define CALL_DELETE				6
+#define NUM_CALLS				7
+
+#define ALIGNMENT				64		// PATTERN_ALIGNED
+
+typedef enum {
+	PATTERN_LIFO,		// free in reverse order of allocation
+	PATTERN_FIFO,		// free in order of allocation
+	PATTERN_CALLOC,		// calloc, then free LIFO
+	PATTERN_REALLOC,	// malloc, realloc to twice the size, free
+	PATTERN_PRODCONS,	// half the threads allocate, the other half free
+	PATTERN_XFREE,		// every thread frees what its neighbor allocated
+	PATTERN_ALIGNED,	// posix_memalign, then free LIFO
+	PATTERN_NEW,		// operator new, then sized operator delete LIFO
+	NUM_PATTERNS
+} PATTERN;
+
+static const char *pattern_names[NUM_PATTERNS] = {
+	"lifo", "fifo", "calloc", "realloc", "prodcons", "xfree", "aligned",
+	"new",
+};
+
+static const char *call_names[NUM_CALLS] = {
+	"malloc", "free", "calloc", "realloc", "memalign", "new", "delete",
+};
+
+typedef struct {
+	const char	*name;
+	size_t		min_size;
+	size_t		max_size;
+	bool		log_uniform;	// else uniform
+} size_dist_t;
+
+static const size_dist_t size_dists[] = {
+	{ "fixed16", 	16, 	16, 	false },
+	{ "fixed256", 	256, 	256, 	false },
+	{ "uniform16-1k", 16, 	1024, 	false },
+	{ "log16-64k", 	16, 	65536, 	true },
+};
+#define NUM_SIZE_DISTS	(sizeof(size_dists) / sizeof(size_dists[0]))
+
+// what one thread measured
+typedef struct {
+	uint64_t	ns[NUM_CALLS];
+	uint64_t	calls[NUM_CALLS];
+} thread_result_t;
+
+// single producer, single consumer handoff of pointers
+typedef struct {
+	atomic<uint64_t> head;
+	char			 pad0[64 - sizeof(atomic<uint64_t>)];
+	atomic<uint64_t> tail;
+	char			 pad1[64 - sizeof(atomic<uint64_t>)];
+	void			 *slots[QUEUE_SLOTS];
+} queue_t;
+
+// shared by the threads of one run
+typedef struct {
+	PATTERN				pattern;
+	const size_dist_t	*dist;
+	uint32_t			num_threads;
+	uint64_t			calls_per_thread;
+	pthread_barrier_t	barrier;
+	vector<queue_t *>	queues;			// PATTERN_PRODCONS, per pair
+	vector<void **>		mailboxes;		// PATTERN_XFREE, per thread
+	vector<thread_result_t> results;
+} run_t;
+
+const char *label = "libc";
+bool 		json = false;
+
+void usage(const char *name);
+void run(PATTERN pattern, const size_dist_t *dist, uint32_t num_threads,
+		 uint64_t calls_per_thread);
+void bench_thread(run_t *r, uint32_t index);
+void make_sizes(const size_dist_t *dist, uint64_t seed, size_t *sizes);
+uint64_t now_ns(void);
+void print_row(const run_t *r, int call, uint64_t calls, uint64_t ns);
+
+int main(int argc, char *argv[])
+{
+	uint64_t calls_per_thread = 200000;
+	uint32_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t num_threads, last_threads;
+	bool 	 header = true;
+	vector<uint32_t> thread_counts;
+	int 	 opt;
+
+	while ((opt = getopt(argc, argv, "l:n:t:f:H")) != -1) {
+		switch (opt) {
+		case 'l':
+			label = optarg;
+			break;
+		case 'n':
+			calls_per_thread = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'f':
+			json = (strcmp(optarg, "json") == 0);
+			break;
+		case 'H':
+			header = false;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+
+	// 1, 2, 4, ... and all cores
+	for (uint32_t n = 1; n < max_threads; n <<= 1) {
+		thread_counts.push_back(n);
+	}
+	thread_counts.push_back(max_threads);
+
+	if (header && !json) {
+		printf("label,pattern,sizes,threads,call,calls,ns_per_call\n");
+	}
+
+	for (int p = 0; p < NUM_PATTERNS; p++) {
+		for (size_t d = 0; d < NUM_SIZE_DISTS; d++) {
+			last_threads = 0;
+			for (size_t t = 0; t < thread_counts.size(); t++) {
+				num_threads = thread_counts[t];
+				if ((p == PATTERN_PRODCONS) || (p == PATTERN_XFREE)) {
+					// even and at least a pair, even on a single core
+					num_threads = max((num_threads + 1) & ~1U, 2U);
+				}
+				if (num_threads == last_threads) {
+					continue;
+				}
+				last_threads = num_threads;
+				run((PATTERN)p, &size_dists[d], num_threads, calls_per_thread);
+			}
+		}
+	}
+
+	return 0;
+}
+
+void usage(const char *name)
+{
+	cerr << "usage: " << name
+		 << " [-l label] [-n calls] [-t max_threads] [-f csv|json] [-H]" << endl;
+	cerr << "  -l  label for the rows, e.g. the transport being measured" << endl;
+	cerr << "  -n  calls per thread and pattern, default 200000" << endl;
+	cerr << "  -t  largest thread count, default all cores" << endl;
+	cerr << "  -f  output format, default csv" << endl;
+	cerr << "  -H  no csv header" << endl;
+}
+
+void run(PATTERN pattern, const size_dist_t *dist, uint32_t num_threads,
+		 uint64_t calls_per_thread)
+{
+	run_t 			r;
+	vector<thread> 	threads;
+	thread_result_t total;
+
+	r.pattern 		   = pattern;
+	r.dist 			   = dist;
+	r.num_threads 	   = num_threads;
+	r.calls_per_thread = calls_per_thread;
+	r.results.resize(num_threads);
+	memset(r.results.data(), 0, num_threads * sizeof(thread_result_t));
+	pthread_barrier_init(&r.barrier, NULL, num_threads);
+	for (uint32_t i = 0; i < num_threads / 2; i++) {
+		r.queues.push_back(new queue_t());
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		r.mailboxes.push_back(new void *[BATCH]);
+	}
+
+	for (uint32_t i = 0; i < num_threads; i++) {
+		threads.push_back(thread(bench_thread, &r, i));
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		threads[i].join();
+	}
+
+	// ns per call, averaged over the threads
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < num_threads; i++) {
+		for (int c = 0; c < NUM_CALLS; c++) {
+			total.ns[c] 	+= r.results[i].ns[c];
+			total.calls[c] 	+= r.results[i].calls[c];
+		}
+	}
+	for (int c = 0; c < NUM_CALLS; c++) {
+		if (total.calls[c] != 0) {
+			print_row(&r, c, total.calls[c], total.ns[c]);
+		}
+	}
+	fflush(stdout);
+
+	pthread_barrier_destroy(&r.barrier);
+	for (size_t i = 0; i < r.queues.size(); i++) {
+		delete r.queues[i];
+	}
+	for (size_t i = 0; i < r.mailboxes.size(); i++) {
+		delete[] r.mailboxes[i];
+	}
+}
+
+void bench_thread(run_t *r, uint32_t index)
+{
+	thread_result_t *result = &r->results[index];
+	size_t 			sizes[BATCH];
+	void 			*ptrs[BATCH];
+	void 			**mailbox;
+	queue_t 		*queue;
+	uint64_t 		t0, t1, t2, t3, head, tail;
+	uint32_t 		batch;
+
+	make_sizes(r->dist, index + 1, sizes);
+	pthread_barrier_wait(&r->barrier);
+
+	for (uint64_t done = 0; done < r->calls_per_thread; done += 2 * BATCH) {
+		switch (r->pattern) {
+		case PATTERN_LIFO:
+		case PATTERN_FIFO:
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				ptrs[batch] = malloc(sizes[batch]);
+			}
+			t1 = now_ns();
+			if (r->pattern == PATTERN_LIFO) {
+				for (batch = BATCH; batch > 0; batch--) {
+					free(ptrs[batch - 1]);
+				}
+			} else {
+				for (batch = 0; batch < BATCH; batch++) {
+					free(ptrs[batch]);
+				}
+			}
+			t2 = now_ns();
+			result->ns[CALL_MALLOC] += t1 - t0;
+			result->ns[CALL_FREE] 	+= t2 - t1;
+			result->calls[CALL_MALLOC] += BATCH;
+			result->calls[CALL_FREE]   += BATCH;
+			break;
+
+		case PATTERN_CALLOC:
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				ptrs[batch] = calloc(1, sizes[batch]);
+			}
+			t1 = now_ns();
+			for (batch = BATCH; batch > 0; batch--) {
+				free(ptrs[batch - 1]);
+			}
+			t2 = now_ns();
+			result->ns[CALL_CALLOC] += t1 - t0;
+			result->ns[CALL_FREE] 	+= t2 - t1;
+			result->calls[CALL_CALLOC] += BATCH;
+			result->calls[CALL_FREE]   += BATCH;
+			break;
+
+		case PATTERN_ALIGNED:
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				if (posix_memalign(&ptrs[batch], ALIGNMENT, sizes[batch]) != 0) {
+					ptrs[batch] = NULL;
+				}
+			}
+			t1 = now_ns();
+			for (batch = BATCH; batch > 0; batch--) {
+				free(ptrs[batch - 1]);
+			}
+			t2 = now_ns();
+			result->ns[CALL_MEMALIGN] += t1 - t0;
+			result->ns[CALL_FREE] 	  += t2 - t1;
+			result->calls[CALL_MEMALIGN] += BATCH;
+			result->calls[CALL_FREE] 	 += BATCH;
+			break;
+
+		case PATTERN_NEW:
+			// called as functions, new expressions could be elided
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				ptrs[batch] = operator new(sizes[batch]);
+			}
+			t1 = now_ns();
+			for (batch = BATCH; batch > 0; batch--) {
+				operator delete(ptrs[batch - 1], sizes[batch - 1]);
+			}
+			t2 = now_ns();
+			result->ns[CALL_NEW] 	+= t1 - t0;
+			result->ns[CALL_DELETE] += t2 - t1;
+			result->calls[CALL_NEW] 	+= BATCH;
+			result->calls[CALL_DELETE] 	+= BATCH;
+			break;
+
+		case PATTERN_REALLOC:
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				ptrs[batch] = malloc(sizes[batch]);
+			}
+			t1 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				ptrs[batch] = realloc(ptrs[batch], 2 * sizes[batch]);
+			}
+			t2 = now_ns();
+			for (batch = BATCH; batch > 0; batch--) {
+				free(ptrs[batch - 1]);
+			}
+			t3 = now_ns();
+			result->ns[CALL_MALLOC]  += t1 - t0;
+			result->ns[CALL_REALLOC] += t2 - t1;
+			result->ns[CALL_FREE] 	 += t3 - t2;
+			result->calls[CALL_MALLOC]  += BATCH;
+			result->calls[CALL_REALLOC] += BATCH;
+			result->calls[CALL_FREE] 	+= BATCH;
+			break;
+
+		case PATTERN_PRODCONS:
+			// even threads produce into their pair's queue, odd ones consume
+			queue = r->queues[index / 2];
+			if (index & 1) {
+				t0 = now_ns();
+				for (batch = 0; batch < 2 * BATCH; batch++) {
+					tail = queue->tail.load(memory_order_relaxed);
+					while (queue->head.load(memory_order_acquire) == tail) {
+						sched_yield();
+					}
+					free(queue->slots[tail & (QUEUE_SLOTS - 1)]);
+					queue->tail.store(tail + 1, memory_order_release);
+				}
+				result->ns[CALL_FREE] += now_ns() - t0;
+				result->calls[CALL_FREE] += 2 * BATCH;
+			} else {
+				t0 = now_ns();
+				for (batch = 0; batch < 2 * BATCH; batch++) {
+					head = queue->head.load(memory_order_relaxed);
+					while (head - queue->tail.load(memory_order_acquire) >=
+						   QUEUE_SLOTS) {
+						sched_yield();
+					}
+					queue->slots[head & (QUEUE_SLOTS - 1)] =
+						malloc(sizes[batch % BATCH]);
+					queue->head.store(head + 1, memory_order_release);
+				}
+				result->ns[CALL_MALLOC] += now_ns() - t0;
+				result->calls[CALL_MALLOC] += 2 * BATCH;
+			}
+			break;
+
+		case PATTERN_XFREE:
+			mailbox = r->mailboxes[index];
+			t0 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				mailbox[batch] = malloc(sizes[batch]);
+			}
+			t1 = now_ns();
+			pthread_barrier_wait(&r->barrier);
+			mailbox = r->mailboxes[(index + 1) % r->num_threads];
+			t2 = now_ns();
+			for (batch = 0; batch < BATCH; batch++) {
+				free(mailbox[batch]);
+			}
+			t3 = now_ns();
+			pthread_barrier_wait(&r->barrier);
+			result->ns[CALL_MALLOC] += t1 - t0;
+			result->ns[CALL_FREE] 	+= t3 - t2;
+			result->calls[CALL_MALLOC] += BATCH;
+			result->calls[CALL_FREE]   += BATCH;
+			break;
+
+		default:
+			return;
+		}
+	}
+}
+
+// the same sizes for every run of a distribution, in a shuffled order
+void make_sizes(const size_dist_t *dist, uint64_t seed, size_t *sizes)
+{
+	uint64_t rng = seed * 0x9E3779B97F4A7C15ULL;
+	double 	 u;
+
+	for (uint32_t i = 0; i < BATCH; i++) {
+		// xorshift64*
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		u = (rng * 0x2545F4914F6CDD1DULL >> 11) * 0x1p-53; // [0, 1)
+
+		if (dist->log_uniform) {
+			sizes[i] = dist->min_size *
+				exp2(u * log2((double)dist->max_size / dist->min_size));
+		} else {
+			sizes[i] = dist->min_size + u * (dist->max_size - dist->min_size + 1);
+		}
+		sizes[i] = min(max(sizes[i], dist->min_size), dist->max_size);
+	}
+}
+
+uint64_t now_ns(void)
+{
+	timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void print_row(const run_t *r, int call, uint64_t calls, uint64_t ns)
+{
+	if (json) {
+		printf("{\"label\": \"%s\", \"pattern\": \"%s\", \"sizes\": \"%s\", "
+			   "\"threads\": %u, \"call\": \"%s\", \"calls\": %lu, "
+			   "\"ns_per_call\": %.1f}\n", label, pattern_names[r->pattern],
+			   r->dist->name, r->num_threads, call_names[call],
+			   (unsigned long)calls, (double)ns / calls);
+	} else {
+		printf("%s,%s,%s,%u,%s,%lu,%.1f\n", label, pattern_names[r->pattern],
+			   r->dist->name, r->num_threads, call_names[call],
+			   (unsigned long)calls, (double)ns / calls);
+	}
+}
@@ -4,21 +4,48 @@
 # build shared client
 echo "gcc -g -c -Wall -Werror -fpic shared_client.c"
 gcc -g -c -Wall -Werror -fpic shared_client.c
-echo "gcc -shared -o libshared_client.so shared_client.o"
-gcc -shared -o libshared_client.so shared_client.o
+echo "gcc -shared -o libshared_client.so shared_client.o -lpthread -lrt -lm -ldl"
+gcc -shared -o libshared_client.so shared_client.o -lpthread -lrt -lm -ldl
 
 # test app
 echo "g++ -g -Wall test.cpp -o test -lpthread"
 g++ -g -Wall test.cpp -o test -lpthread
 
 # build stat server
-echo "g++ -g -Wall stat_server.cpp -o stat_server"
-g++ -g -Wall stat_server.cpp -o stat_server
+echo "g++ -g -Wall stat_server.cpp symbolizer.cpp trace.cpp stats_export.cpp proc_mem.cpp heap_dump.cpp -o stat_server -lrt -lpthread"
+g++ -g -Wall stat_server.cpp symbolizer.cpp trace.cpp stats_export.cpp proc_mem.cpp heap_dump.cpp -o stat_server -lrt -lpthread
 
-# start stat_server
+# build offline trace analyzer
+echo "g++ -g -Wall stat_trace.cpp trace.cpp -o stat_trace"
+g++ -g -Wall stat_trace.cpp trace.cpp -o stat_trace
+
+# build heap dump comparison
+echo "g++ -g -Wall stat_heapdiff.cpp heap_dump.cpp -o stat_heapdiff"
+g++ -g -Wall stat_heapdiff.cpp heap_dump.cpp -o stat_heapdiff
+
+# build trace replay benchmark, optimized since it times the allocator
+echo "g++ -O2 -g -Wall stat_replay.cpp trace.cpp -o stat_replay -lpthread"
+g++ -O2 -g -Wall stat_replay.cpp trace.cpp -o stat_replay -lpthread
+
+# start stat_server, add -t <file> to record a trace for stat_trace
 echo "./stat_server&"
 ./stat_server&
 
+# optional: per-thread shared memory rings instead of msgQ
+# export STAT_MALLOC_TRANSPORT=ring
+
+# optional: only count allocations in shared memory, no events
+# export STAT_MALLOC_TRANSPORT=counters
+
+# optional: report a sample of about one allocation per 512KiB allocated
+# export STAT_MALLOC_SAMPLE=524288
+
+# optional: also report malloc's own heap stats, at most once a second
+# export STAT_MALLOC_HEAP_INFO_MS=1000
+
+# optional: serve allocations below 1KiB from per-thread caches
+# export STAT_MALLOC_CACHE=1
+
 # use LD_PRELOAD on our shared library
 echo "export LD_PRELOAD=libshared_client.so"
 export LD_PRELOAD=$PWD/libshared_client.so
@@ -0,0 +1,69 @@
+#!/bin/bash
+# builds the benchmark and measures the hooks in every transport and mode
+#
+# ./build_bench.sh [calls_per_thread]    results in bench_results.csv
+# FORMAT=json ./build_bench.sh           results in bench_results.json
+# ./build_bench.sh --build-only
+#-------------------------------------------------------
+CALLS=${1:-200000}
+FORMAT=${FORMAT:-csv}
+OUT=bench_results.$FORMAT
+
+# build shared client and stat_server, as build_and_install.sh does
+echo "gcc -g -c -Wall -Werror -fpic shared_client.c"
+gcc -g -c -Wall -Werror -fpic shared_client.c || exit 1
+echo "gcc -shared -o libshared_client.so shared_client.o -lpthread -lrt -lm -ldl"
+gcc -shared -o libshared_client.so shared_client.o -lpthread -lrt -lm -ldl || exit 1
+echo "g++ -g -Wall stat_server.cpp symbolizer.cpp trace.cpp stats_export.cpp proc_mem.cpp heap_dump.cpp -o stat_server -lrt -lpthread"
+g++ -g -Wall stat_server.cpp symbolizer.cpp trace.cpp stats_export.cpp proc_mem.cpp heap_dump.cpp -o stat_server -lrt -lpthread || exit 1
+
+# build benchmark, -fno-builtin keeps malloc/free pairs from being optimized out
+echo "g++ -O2 -fno-builtin -g -Wall bench.cpp -o bench -lpthread"
+g++ -O2 -fno-builtin -g -Wall bench.cpp -o bench -lpthread || exit 1
+
+if [ "$1" == "--build-only" ]; then
+	exit 0
+fi
+
+# label and client environment of every configuration measured
+MODES=(
+	"libc|"
+	"msgq|"
+	"msgq_unbatched|STAT_MALLOC_BATCH=1"
+	"msgq_drop|STAT_MALLOC_ON_FULL=drop"
+	"ring|STAT_MALLOC_TRANSPORT=ring"
+	"counters|STAT_MALLOC_TRANSPORT=counters"
+	"counters_cached|STAT_MALLOC_TRANSPORT=counters STAT_MALLOC_CACHE=1"
+	"msgq_sampled|STAT_MALLOC_SAMPLE=524288"
+	"ring_sampled|STAT_MALLOC_TRANSPORT=ring STAT_MALLOC_SAMPLE=524288"
+	"no_server|"
+)
+
+# a fresh stat_server per mode, so a backlog from one does not slow the next.
+# no_server preloads the library with no stat_server running, the cost left
+# in a process that outlives or never finds its server
+rm -f $OUT
+HEADER=""
+for MODE in "${MODES[@]}"; do
+	LABEL=${MODE%%|*}
+	ENV=${MODE#*|}
+	echo "measuring $LABEL"
+
+	if [ "$LABEL" == "libc" ]; then
+		./bench -l $LABEL -n $CALLS -f $FORMAT $HEADER >> $OUT
+	elif [ "$LABEL" == "no_server" ]; then
+		env $ENV LD_PRELOAD=$PWD/libshared_client.so \
+			./bench -l $LABEL -n $CALLS -f $FORMAT $HEADER >> $OUT
+	else
+		./stat_server 2>/dev/null &
+		SERVER=$!
+		sleep 0.5
+		env $ENV LD_PRELOAD=$PWD/libshared_client.so \
+			./bench -l $LABEL -n $CALLS -f $FORMAT $HEADER >> $OUT
+		kill $SERVER
+		wait $SERVER 2>/dev/null
+	fi
+	HEADER="-H"
+done
+
+echo "results in $OUT"
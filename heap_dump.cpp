@@ -0,0 +1,215 @@
+/*******************************************************************************
+ * Filename: heap_dump.cpp
+ *
+ * Purpose: writes and reads the heap dumps described in heap_dump.h.
+ *
+ * The writer goes through stdio with a large buffer and seeks back to fill
+ * in counts, it runs in a forked child of stat_server with the live tables
+ * to itself. The reader loads a whole dump into memory.
+ *
+ ******************************************************************************/
+
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h> // fstat
+#include "heap_dump.h"
+
+
+using namespace std;
+
+#define HEAP_DUMP_BUFFER_BYTES	(1024 * 1024)
+
+static bool read_all(FILE *fp, void *buf, size_t size);
+static bool fits(FILE *fp, off_t file_size, uint64_t count, size_t size);
+
+heap_dump_writer::heap_dump_writer() : fp(NULL), process_offset(-1),
+									   failed(false)
+{
+	memset(&header, 0, sizeof(header));
+	memset(&process, 0, sizeof(process));
+}
+
+heap_dump_writer::~heap_dump_writer()
+{
+	if (fp != NULL) {
+		fclose(fp);
+		remove((path + ".tmp").c_str());
+	}
+}
+
+bool heap_dump_writer::open(const char *path, uint64_t realtime_us)
+{
+	this->path = path;
+	if ((fp = fopen((this->path + ".tmp").c_str(), "w")) == NULL) {
+		return false;
+	}
+	setvbuf(fp, NULL, _IOFBF, HEAP_DUMP_BUFFER_BYTES);
+
+	memcpy(header.magic, HEAP_DUMP_MAGIC, sizeof(header.magic));
+	header.version 	   = HEAP_DUMP_VERSION;
+	header.header_size = sizeof(header);
+	header.realtime_us = realtime_us;
+	failed = (fwrite(&header, sizeof(header), 1, fp) != 1);
+
+	return true;
+}
+
+void heap_dump_writer::begin_section(uint32_t pid, uint32_t gen,
+									 uint32_t sample_interval,
+									 const vector<uint32_t> &tids)
+{
+	memset(&process, 0, sizeof(process));
+	process.pid 			= pid;
+	process.gen 			= gen;
+	process.sample_interval = sample_interval;
+	process.num_threads 	= tids.size();
+
+	process_offset = ftell(fp);
+	if ((fwrite(&process, sizeof(process), 1, fp) != 1) ||
+		(tids.size() &&
+		 (fwrite(&tids[0], sizeof(tids[0]), tids.size(), fp) != tids.size()))) {
+		failed = true;
+	}
+	header.num_sections++;
+}
+
+void heap_dump_writer::add(const heap_dump_alloc_t &alloc)
+{
+	if (fwrite(&alloc, sizeof(alloc), 1, fp) != 1) {
+		failed = true;
+	}
+	process.num_allocations++;
+}
+
+void heap_dump_writer::end_section(void)
+{
+	long end = ftell(fp);
+
+	if ((fseek(fp, process_offset, SEEK_SET) != 0) ||
+		(fwrite(&process, sizeof(process), 1, fp) != 1) ||
+		(fseek(fp, end, SEEK_SET) != 0)) {
+		failed = true;
+	}
+}
+
+void heap_dump_writer::add_symbol(uint32_t pid, uint64_t caller,
+								  const string &name)
+{
+	heap_dump_symbol_t symbol;
+
+	symbol.pid 	  = pid;
+	symbol.length = name.size();
+	symbol.caller = caller;
+	if ((fwrite(&symbol, sizeof(symbol), 1, fp) != 1) ||
+		(fwrite(name.data(), 1, name.size(), fp) != name.size())) {
+		failed = true;
+	}
+	header.num_symbols++;
+}
+
+bool heap_dump_writer::close(void)
+{
+	int saved_errno;
+
+	if ((fseek(fp, 0, SEEK_SET) != 0) ||
+		(fwrite(&header, sizeof(header), 1, fp) != 1)) {
+		failed = true;
+	}
+	if (fclose(fp) != 0) {
+		failed = true;
+	}
+	fp = NULL;
+
+	if (failed) {
+		saved_errno = errno;
+		remove((path + ".tmp").c_str());
+		errno = saved_errno;
+		return false;
+	}
+	return rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+bool heap_dump_read(const char *path, heap_dump_t *dump)
+{
+	heap_dump_header_t 	header;
+	heap_dump_section_t section;
+	heap_dump_symbol_t 	symbol;
+	heap_dump_name_t 	name;
+	struct stat 		st;
+	FILE 				*fp;
+	bool 				ok = false;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	if (fstat(fileno(fp), &st) == -1) {
+		fclose(fp);
+		return false;
+	}
+	setvbuf(fp, NULL, _IOFBF, HEAP_DUMP_BUFFER_BYTES);
+
+	if (!read_all(fp, &header, sizeof(header)) ||
+		(memcmp(header.magic, HEAP_DUMP_MAGIC, sizeof(header.magic)) != 0) ||
+		(header.version == 0) || (header.version > HEAP_DUMP_VERSION) ||
+		(header.header_size < sizeof(header)) ||
+		(fseek(fp, header.header_size, SEEK_SET) != 0)) {
+		goto out;
+	}
+	dump->realtime_us = header.realtime_us;
+	dump->sections.clear();
+	dump->symbols.clear();
+
+	for (uint64_t i = 0; i < header.num_sections; i++) {
+		if (!read_all(fp, &section.process, sizeof(section.process)) ||
+			!fits(fp, st.st_size, section.process.num_threads,
+				  sizeof(uint32_t)) ||
+			!fits(fp, st.st_size, section.process.num_allocations,
+				  sizeof(heap_dump_alloc_t))) {
+			goto out;
+		}
+		section.tids.resize(section.process.num_threads);
+		section.allocations.resize(section.process.num_allocations);
+		if (!read_all(fp, section.tids.data(),
+					  section.tids.size() * sizeof(uint32_t)) ||
+			!read_all(fp, section.allocations.data(),
+					  section.allocations.size() * sizeof(heap_dump_alloc_t))) {
+			goto out;
+		}
+		dump->sections.push_back(section);
+	}
+
+	for (uint64_t i = 0; i < header.num_symbols; i++) {
+		if (!read_all(fp, &symbol, sizeof(symbol)) ||
+			!fits(fp, st.st_size, symbol.length, 1)) {
+			goto out;
+		}
+		name.pid 	= symbol.pid;
+		name.caller = symbol.caller;
+		name.name.resize(symbol.length);
+		if (!read_all(fp, &name.name[0], symbol.length)) {
+			goto out;
+		}
+		dump->symbols.push_back(name);
+	}
+	ok = true;
+
+out:
+	fclose(fp);
+	return ok;
+}
+
+bool read_all(FILE *fp, void *buf, size_t size)
+{
+	return (size == 0) || (fread(buf, size, 1, fp) == 1);
+}
+
+// whether count records of size can still be in the file, so counts from a
+// damaged dump never size a buffer
+bool fits(FILE *fp, off_t file_size, uint64_t count, size_t size)
+{
+	long offset = ftell(fp);
+
+	return (offset != -1) && (offset <= file_size) &&
+		(count <= (uint64_t)(file_size - offset) / size);
+}
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Filename: heap_dump.h
+ *
+ * Purpose: binary dump of stat_server's live allocations, written on SIGUSR1
+ * and compared offline by stat_heapdiff.
+ *
+ * A dump is a heap_dump_header_t, then one section per process and shard:
+ * a heap_dump_process_t, its num_threads tids and its num_allocations
+ * records. A process has a section in every shard holding some of its
+ * allocations. The symbols of all callers recorded follow, each a
+ * heap_dump_symbol_t and its name, so a dump still reads after its
+ * processes have exited.
+ *
+ ******************************************************************************/
+
+#ifndef HEAP_DUMP_H_INCLUDED
+#define HEAP_DUMP_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define HEAP_DUMP_MAGIC			"STMHEAP"
+#define HEAP_DUMP_VERSION		1
+
+typedef struct {
+	char		magic[8];			// HEAP_DUMP_MAGIC, terminated
+	uint32_t	version;
+	uint32_t	header_size;
+	uint64_t	realtime_us;		// wall clock at the dump
+	uint64_t	num_sections;
+	uint64_t	num_symbols;
+} heap_dump_header_t;
+
+typedef struct {
+	uint32_t	pid;
+	uint32_t	gen;				// see msg_data_t
+	uint32_t	sample_interval;	// 0 if not sampled
+	uint32_t	num_threads;
+	uint64_t	num_allocations;
+} heap_dump_process_t;
+
+// one live allocation, 32 bytes
+typedef struct {
+	uint64_t	ptr;
+	uint64_t	caller;
+	uint64_t	size 	: 48;		// requested
+	uint64_t	thread 	: 16;		// index into the section's tids
+	uint32_t	age_ms;				// at the dump
+	uint32_t	weight;				// allocations this one stands for if sampled
+} heap_dump_alloc_t;
+
+typedef struct {
+	uint32_t	pid;
+	uint32_t	length;				// of the name that follows, not terminated
+	uint64_t	caller;
+} heap_dump_symbol_t;
+
+// a dump as read back
+typedef struct {
+	heap_dump_process_t				process;
+	std::vector<uint32_t>			tids;
+	std::vector<heap_dump_alloc_t>	allocations;
+} heap_dump_section_t;
+
+typedef struct {
+	uint32_t	pid;
+	uint64_t	caller;
+	std::string	name;
+} heap_dump_name_t;
+
+typedef struct {
+	uint64_t						realtime_us;
+	std::vector<heap_dump_section_t> sections;
+	std::vector<heap_dump_name_t>	symbols;
+} heap_dump_t;
+
+/*
+ * writes a dump to path + ".tmp", renamed to path by close() once whole, so
+ * readers never see a partial dump. sections are written as they come,
+ * their counts patched in by end_section().
+ */
+class heap_dump_writer {
+public:
+	heap_dump_writer();
+	~heap_dump_writer();
+
+	bool open(const char *path, uint64_t realtime_us);
+	void begin_section(uint32_t pid, uint32_t gen, uint32_t sample_interval,
+					   const std::vector<uint32_t> &tids);
+	void add(const heap_dump_alloc_t &alloc);
+	void end_section(void);
+	void add_symbol(uint32_t pid, uint64_t caller, const std::string &name);
+
+	// false, with errno set, if anything could not be written
+	bool close(void);
+
+private:
+	FILE 		*fp;
+	std::string	path;
+	heap_dump_header_t header;
+	heap_dump_process_t process;	// of the open section
+	long 		process_offset;
+	bool 		failed;
+};
+
+// false if path is not a readable dump
+bool heap_dump_read(const char *path, heap_dump_t *dump);
+
+#endif // HEAP_DUMP_H_INCLUDED
@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * Filename: lifetime_hist.h
+ *
+ * Purpose: HDR style histogram of how long freed allocations lived, so
+ * stat_server can report lifetime percentiles per size bin without keeping
+ * the lifetimes themselves.
+ *
+ * Buckets are log-linear: lifetimes below 2^LIFETIME_SUB_BITS us get a
+ * bucket each, every power of two above that is split into
+ * 2^LIFETIME_SUB_BITS equal buckets. A bucket is then never wider than
+ * 1/16th of the values it holds, at a fixed cost of LIFETIME_BUCKETS
+ * counters whatever the range.
+ *
+ ******************************************************************************/
+
+#ifndef LIFETIME_HIST_H_INCLUDED
+#define LIFETIME_HIST_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+#define LIFETIME_SUB_BITS		4
+#define LIFETIME_MAX_BITS		40		// 2^40 us, about 12 days, and longer
+#define LIFETIME_BUCKETS		((LIFETIME_MAX_BITS - LIFETIME_SUB_BITS + 1) << \
+								 LIFETIME_SUB_BITS)
+
+class lifetime_hist {
+public:
+	uint64_t count;
+	uint64_t max_us;
+
+	lifetime_hist()
+	{
+		clear();
+	}
+
+	void clear(void)
+	{
+		count  = 0;
+		max_us = 0;
+		memset(buckets, 0, sizeof(buckets));
+	}
+
+	void add(uint64_t lifetime_us, uint64_t weight = 1)
+	{
+		buckets[to_bucket(lifetime_us)] += weight;
+		count += weight;
+		if (max_us < lifetime_us) {
+			max_us = lifetime_us;
+		}
+	}
+
+	void merge(const lifetime_hist &other)
+	{
+		for (uint32_t i = 0; i < LIFETIME_BUCKETS; i++) {
+			buckets[i] += other.buckets[i];
+		}
+		count += other.count;
+		if (max_us < other.max_us) {
+			max_us = other.max_us;
+		}
+	}
+
+	// highest lifetime in the bucket holding the given fraction of them
+	uint64_t percentile(double fraction) const
+	{
+		uint64_t seen = 0;
+
+		if (count == 0) {
+			return 0;
+		}
+		for (uint32_t i = 0; i < LIFETIME_BUCKETS; i++) {
+			seen += buckets[i];
+			if ((seen > 0) && (seen >= fraction * count)) {
+				return (bucket_max(i) < max_us) ? bucket_max(i) : max_us;
+			}
+		}
+		return max_us;
+	}
+
+private:
+	uint64_t buckets[LIFETIME_BUCKETS];
+
+	static uint32_t to_bucket(uint64_t lifetime_us)
+	{
+		uint32_t msb;
+
+		if (lifetime_us < (1ULL << LIFETIME_SUB_BITS)) {
+			return lifetime_us;
+		}
+		msb = 63 - __builtin_clzll(lifetime_us);
+		if (msb >= LIFETIME_MAX_BITS) {
+			return LIFETIME_BUCKETS - 1;
+		}
+
+		// top LIFETIME_SUB_BITS bits below the leading one pick the bucket
+		return ((msb - LIFETIME_SUB_BITS + 1) << LIFETIME_SUB_BITS) |
+			((lifetime_us >> (msb - LIFETIME_SUB_BITS)) &
+			 ((1 << LIFETIME_SUB_BITS) - 1));
+	}
+
+	static uint64_t bucket_max(uint32_t bucket)
+	{
+		uint32_t group = bucket >> LIFETIME_SUB_BITS;
+		uint64_t sub = bucket & ((1 << LIFETIME_SUB_BITS) - 1);
+
+		if (group == 0) {
+			return sub;
+		}
+		return (((1ULL << LIFETIME_SUB_BITS) | sub) << (group - 1)) +
+			(1ULL << (group - 1)) - 1;
+	}
+};
+
+#endif // LIFETIME_HIST_H_INCLUDED
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ * Filename: proc_mem.cpp
+ *
+ * Purpose: reads a client process's memory footprint for stat_server.
+ *
+ * /proc/<pid>/status is cheap and always there. smaps_rollup (Linux 4.14)
+ * walks the whole address space under the process's mmap lock, but is the
+ * only place for the proportional share of anonymous memory, so it is read
+ * once per print and its values take precedence where both have one.
+ *
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "proc_mem.h"
+
+
+static bool read_kb_fields(const char *path, const char *const *names,
+						   uint64_t *const *values, size_t num_fields);
+
+bool proc_mem_read(pid_t pid, proc_mem_t *mem)
+{
+	char path[64];
+	static const char *const status_names[] = { "VmRSS:", "RssAnon:",
+												"VmSwap:" };
+	uint64_t *const status_values[] = { &mem->rss, &mem->anon, &mem->swap };
+	static const char *const rollup_names[] = { "Anonymous:", "Pss_Anon:",
+												"Swap:" };
+	uint64_t *const rollup_values[] = { &mem->anon, &mem->pss_anon,
+										&mem->swap };
+
+	memset(mem, 0, sizeof(*mem));
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if (!read_kb_fields(path, status_names, status_values, 3)) {
+		return false;
+	}
+
+	// older kernels, or not ours to read: keep what status had
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+	read_kb_fields(path, rollup_names, rollup_values, 3);
+
+	return true;
+}
+
+// "Name:   1234 kB" lines, fields not found are left alone
+bool read_kb_fields(const char *path, const char *const *names,
+					uint64_t *const *values, size_t num_fields)
+{
+	char 				line[256];
+	unsigned long long 	kb;
+	FILE 				*fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		for (size_t i = 0; i < num_fields; i++) {
+			if (!strncmp(line, names[i], strlen(names[i])) &&
+				(sscanf(line + strlen(names[i]), "%llu", &kb) == 1)) {
+				*values[i] = kb * 1024;
+				break;
+			}
+		}
+	}
+	fclose(fp);
+
+	return true;
+}
@@ -0,0 +1,27 @@
+/*******************************************************************************
+ * Filename: proc_mem.h
+ *
+ * Purpose: what a client process really takes, for stat_server to set
+ * against the bytes it asked malloc for. Read from /proc/<pid>/status and
+ * /proc/<pid>/smaps_rollup each time stat_server prints.
+ *
+ ******************************************************************************/
+
+#ifndef PROC_MEM_H_INCLUDED
+#define PROC_MEM_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// bytes, 0 if the kernel does not report it
+typedef struct {
+	uint64_t	rss;			// VmRSS
+	uint64_t	anon;			// resident anonymous memory: heap, mmaps, stacks
+	uint64_t	pss_anon;		// anon, pages shared after fork() split up
+	uint64_t	swap;			// anonymous memory swapped out
+} proc_mem_t;
+
+// false if the process is gone or its smaps can't be read
+bool proc_mem_read(pid_t pid, proc_mem_t *mem);
+
+#endif // PROC_MEM_H_INCLUDED
@@ -0,0 +1,180 @@
+/*******************************************************************************
+ * Filename: ptr_table.h
+ *
+ * Purpose: open addressing hash table of live allocations keyed by pointer,
+ * used by stat_server in place of a std::multimap.
+ *
+ * Linear probing over a flat array of compact entries. Deletion shifts the
+ * following entries of the probe run back instead of leaving tombstones, so
+ * lookups never slow down as allocations come and go.
+ *
+ ******************************************************************************/
+
+#ifndef PTR_TABLE_H_INCLUDED
+#define PTR_TABLE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stat_server.h" // NUM_SIZE_BINS, NUM_ALIGN_BINS
+
+#define PTR_TABLE_MIN_SLOTS		1024		// power of two
+#define PTR_ENTRY_MAX_SIZE		((1ULL << 48) - 1)
+
+// one live allocation, 40 bytes
+typedef struct {
+	uintptr_t	ptr;			// 0 marks an empty slot
+	uint64_t	size 	 : 48;	// for reducing total_current_size upon removal
+	uint64_t	size_bin : 8;	// zero based, for fast removal from size array
+	uint64_t	align_bin : 8;	// same for the alignment array, ALIGN_BIN_NONE
+	uint64_t	time_us	 : 48;	// allocation time, relative to server start
+	uint64_t	thread 	 : 16;	// index of the allocating thread
+	uint32_t	churn;			// index of the call site and size bin, whose
+								// churn_t knows the site
+	uint32_t	weight;			// allocations this one stands for if sampled
+	uint32_t	seq;			// of the allocation event, see msg_data_t
+} ptr_entry_t;
+
+static_assert(NUM_SIZE_BINS <= 256, "size_bin is 8 bits");
+static_assert(NUM_ALIGN_BINS <= 256, "align_bin is 8 bits");
+
+class ptr_table {
+public:
+	ptr_table() : slots(NULL), mask(0), shift(0), count(0)
+	{
+		resize(PTR_TABLE_MIN_SLOTS);
+	}
+
+	~ptr_table()
+	{
+		free(slots);
+	}
+
+	size_t size(void) const
+	{
+		return count;
+	}
+
+	size_t memory_used(void) const
+	{
+		return (mask + 1) * sizeof(ptr_entry_t);
+	}
+
+	// returns NULL if ptr is not in the table
+	ptr_entry_t *find(void *ptr)
+	{
+		uintptr_t key = (uintptr_t)ptr;
+
+		for (size_t i = home(key); slots[i].ptr != 0; i = (i + 1) & mask) {
+			if (slots[i].ptr == key) {
+				return &slots[i];
+			}
+		}
+		return NULL;
+	}
+
+	/*
+	 * returns the entry for ptr, adding an empty one if ptr is new. *existed
+	 * tells the caller whether the returned entry holds an older allocation.
+	 * entry pointers are only valid until the next insert() or erase().
+	 */
+	ptr_entry_t *insert(void *ptr, bool *existed)
+	{
+		uintptr_t key = (uintptr_t)ptr;
+		size_t 	  i;
+
+		// keep load at or below 3/4 so probe runs stay short
+		if ((count + 1) * 4 > (mask + 1) * 3) {
+			resize((mask + 1) * 2);
+		}
+
+		for (i = home(key); slots[i].ptr != 0; i = (i + 1) & mask) {
+			if (slots[i].ptr == key) {
+				*existed = true;
+				return &slots[i];
+			}
+		}
+
+		memset(&slots[i], 0, sizeof(ptr_entry_t));
+		slots[i].ptr = key;
+		count++;
+		*existed = false;
+		return &slots[i];
+	}
+
+	void erase(ptr_entry_t *entry)
+	{
+		size_t i = entry - slots;
+		size_t j = i;
+		size_t k;
+
+		// pull back later members of the probe run that may not skip slot i
+		while (1) {
+			j = (j + 1) & mask;
+			if (slots[j].ptr == 0) {
+				break;
+			}
+			k = home(slots[j].ptr);
+			if (((j > i) && ((k <= i) || (k > j))) ||
+				((j < i) && ((k <= i) && (k > j)))) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+
+		slots[i].ptr = 0;
+		count--;
+	}
+
+	// calls f(entry) for every live allocation
+	template <typename F>
+	void for_each(F f)
+	{
+		for (size_t i = 0; i <= mask; i++) {
+			if (slots[i].ptr != 0) {
+				f(slots[i]);
+			}
+		}
+	}
+
+private:
+	ptr_entry_t *slots;
+	size_t 		mask;
+	uint32_t 	shift;
+	size_t 		count;
+
+	// fibonacci hashing, top bits of the product pick the slot
+	size_t home(uintptr_t key) const
+	{
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> shift);
+	}
+
+	void resize(size_t num_slots)
+	{
+		ptr_entry_t *old_slots = slots;
+		size_t 		old_num_slots = old_slots ? mask + 1 : 0;
+		size_t 		i;
+
+		// calloc hands large zeroed tables straight from mmap
+		slots = (ptr_entry_t *)calloc(num_slots, sizeof(ptr_entry_t));
+		if (slots == NULL) {
+			abort();
+		}
+		mask  = num_slots - 1;
+		shift = 64 - __builtin_ctzll(num_slots);
+
+		for (size_t n = 0; n < old_num_slots; n++) {
+			if (old_slots[n].ptr == 0) {
+				continue;
+			}
+			for (i = home(old_slots[n].ptr); slots[i].ptr != 0;
+				 i = (i + 1) & mask) {
+			}
+			slots[i] = old_slots[n];
+		}
+
+		free(old_slots);
+	}
+};
+
+#endif // PTR_TABLE_H_INCLUDED
@@ -3,17 +3,33 @@
  *
  * Purpose: shared library to replace malloc(), free(), calloc(), and
  *          realloc() with debug versions send messages via msgQ to 
- *          stat_server that periodically prints statistics.
+ *          stat_server that periodically prints statistics. The aligned
+ *          allocators, reallocarray() and C++ operator new and delete
+ *          are replaced too, and exec*() and _exit() ship the batched
+ *          events first.
  *
  * By: Keith Hendley
  * Date: 9/3/19
  *
  *************************************************************************/
+#define _GNU_SOURCE // RTLD_NEXT
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h> // fork
 #include <unistd.h> // fork
 #include <malloc.h> // __malloc_hook, ...
-#include <stdatomic.h>
+#include <pthread.h> // thread exit notification
+#include <sched.h> // sched_yield
+#include <fcntl.h> // O_* constants
+#include <sys/mman.h> // shm_open, mmap
+#include <sys/stat.h> // fstat, fchmod
+#include <sys/syscall.h> // SYS_gettid
+#include <time.h> // clock_gettime
+#include <math.h> // log
+#include <dlfcn.h> // dlsym, for operator new's out of memory handling
+#include <stdarg.h> // execl
 #include "stat_server.h" // messageQ
 
 /*
@@ -28,80 +44,255 @@
  *       void free(void *ptr);
  *       void *calloc(size_t nmemb, size_t size);
  *       void *realloc(void *ptr, size_t size);
+ *       void *reallocarray(void *ptr, size_t nmemb, size_t size);
+ *
+ *       int posix_memalign(void **memptr, size_t alignment, size_t size);
+ *       void *aligned_alloc(size_t alignment, size_t size);
+ *       void *valloc(size_t size);
+ *
+ *       void *memalign(size_t alignment, size_t size);
+ *       void *pvalloc(size_t size);
  */
 
 // Redirect all printf to stderr
 #define printf(args...) fprintf(stderr, ##args)
 
+// per-thread events waiting to be shipped as one msgQ message
+typedef struct batch {
+	int				busy;			// owner or a flusher holds it
+	uint32_t		num_events;
+	uint64_t		deadline_ns;	// ship by then even if not full
+	struct batch	*next;			// registry of live thread batches
+	struct batch	*prev;
+	msg_t			msg;
+} batch_t;
+
 static void init(void);
-static void	send_allocation(void *ptr, size_t size);
-static void	send_free(void *ptr);
+static void	send_allocation(void *ptr, size_t size, uint8_t call,
+							uint8_t align_shift, const void *caller);
+static void	send_free(void *ptr, uint8_t call, const void *caller,
+					  const uint32_t *seq);
+static void send_event(uint8_t op, uint8_t call, void *ptr, size_t size,
+					   uint8_t align_shift, const void *caller, uint32_t seq);
+static uint32_t event_seq_now(void);
+static uint8_t alignment_shift(size_t alignment);
+static void *cxx_new(size_t size, size_t alignment, const void *nothrow,
+					 const char *symbol, const void *caller);
+static void *cxx_new_fallback(size_t size, size_t alignment,
+							  const void *nothrow, const char *symbol);
+static void msgq_send(long type, const msg_data_t *event);
+static void msgq_send_events(long type, msg_t *msg, uint32_t num_events);
+static void msgq_open(void);
+static int  server_present(void);
+static void server_seg_open(void);
+static void heap_info_send(void);
+static void events_dropped(const msg_data_t *events, uint32_t num_events);
+static void degrade_to_counters(void);
+static void batch_add(const msg_data_t *event);
+static void batch_flush(batch_t *batch);
+static void batch_flush_stale(uint64_t now);
+static void batch_register(void);
+static void batch_thread_exit(void *batch);
+static void batch_atfork_child(void);
+static void batch_flush_all(void);
+static size_t execl_argc(const char *arg, va_list *ap);
+static void execl_argv(const char *arg, va_list *ap, char **argv);
+static void next_symbols_init(void);
+static void *next_symbol(int symbol);
+static uint64_t coarse_time_ns(void);
+static void process_ident_init(void);
+static int  sample_allocation(void *ptr, size_t size);
+static int  sample_free(void *ptr);
+static int64_t sample_next_interval(void);
+static void sample_init(void);
+static void sample_atfork_child(void);
+static int  ring_send(const msg_data_t *event);
+static ring_t *ring_claim(void);
+static void ring_release(void *ring);
+static void ring_seg_create(void);
+static void ring_atfork_child(void);
+static void counter_update(size_t size, int is_free);
+static counter_slab_t *counter_slab_claim(void);
+static void counter_slab_release(void *slab);
+static void counter_seg_create(const counter_seg_t *parent);
+static void counter_atfork_child(void);
+static void segs_unlink(void);
+static void *cache_malloc(size_t size);
+static void *cache_calloc(size_t nmemb, size_t size);
+static void *cache_realloc(void *ptr, size_t size);
+static void cache_free(void *ptr);
+static size_t cache_usable_size(void *ptr);
+static size_t libc_usable_size(void *ptr);
+static int  cache_refill(uint32_t bin);
+static void cache_give_back(void **head, uint32_t *count, uint32_t bin,
+							uint32_t num_blocks);
+static void cache_count(uint32_t bin, int hit);
+static void cache_thread_exit(void *cache);
+static void cache_atfork_prepare(void);
+static void cache_atfork_parent(void);
+static void cache_atfork_child(void);
+static void cache_init(void);
+static void client_init(void) __attribute__((constructor));
+static void client_exit(void) __attribute__((destructor));
 
 // following functions point to official libc versions
 extern void *__libc_malloc(size_t size);
 extern void  __libc_free(void *ptr);
 extern void *__libc_calloc(size_t nmemb, size_t size); // TODO: may not exist
 extern void *__libc_realloc(void *ptr, size_t size);
-volatile int malloc_hook_active  = 1;
-volatile int free_hook_active 	 = 1;
-volatile int calloc_hook_active  = 1;
-volatile int realloc_hook_active = 1;
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/*
+ * set while this thread is inside a hook. anything the hook calls that
+ * allocates (libc internals, pthread, stdio) goes straight to libc and is
+ * not reported. per-thread, so hooks on different threads never wait on
+ * each other.
+ */
+static __thread int in_hook __attribute__((tls_model("initial-exec")));
 
 static void *my_malloc_hook (size_t size, const void *caller);
 static void  my_free_hook (void *ptr, const void *caller);
 static void *my_calloc_hook(size_t nmemb, size_t size, const void *caller);
 static void *my_realloc_hook(void *ptr, size_t size, const void *caller);
+static void *my_memalign_hook(size_t alignment, size_t size,
+							  const void *caller);
 
-#define LOCK_TYPE_MALLOC		1
-#define LOCK_TYPE_FREE			2
-#define LOCK_TYPE_CALLOC		3
-#define LOCK_TYPE_REALLOC		4
-
-
-void *shm_attach(void);
-void shm_spin_lock(int lock_type);
-void shm_spin_unlock(int lock_type);
-	
-// returns start of shared memory
-void *shm_attach(void)
-{
-	key_t 	shm_key;
-	int 	shmid;
-
-	// ftok to generate unique key 
-    shm_key = ftok(SHM_KEY_STRING, SHM_KEY_INT); 
-	
-	// shmget returns an identifier in shmid 
-    shmid = shmget(shm_key, SHM_SIZE, SHM_PERMISSIONS | IPC_CREAT);
-
-	// return pointer to start of shared memory
-	return (shmat(shmid, (void*)0, 0));
-}
+// msgQ id, looked up in client_init() and again when stat_server restarts
+static int msgid = -1;
+static uint32_t msgq_epoch = 0;				// server_seg epoch of msgid
 
-// multi-core, multi-procesor spin lock using shared memory
-void shm_spin_lock(int lock_type)
-{
-	volatile atomic_flag *lock = (atomic_flag *)shm_attach();
+// stat_server's presence, see server_seg_t. NULL if the segment can't be
+// mapped, events are then always sent
+static const server_seg_t *server_seg = NULL;
 
-	while (atomic_flag_test_and_set(lock + lock_type) == 1) {
-		sleep(0);
-	}
+// a full msgQ is polled this often while stat_server is alive
+#define MSGQ_FULL_WAIT_US		100
 
-	// detach from shared memory
-	shmdt((void *)lock); 
-}
+// identifies this process image in events, reset in a fork child
+static uint32_t client_pid = 0;
+static uint32_t client_gen = 0;
+static __thread uint32_t thread_tid __attribute__((tls_model("initial-exec")));
 
+/*
+ * sampling state, see STAT_MALLOC_SAMPLE. an allocation is reported when
+ * the bytes allocated by its thread since the last sample pass a random,
+ * exponentially distributed interval, so the chance of reporting grows with
+ * size. sampled pointers go in a small set so their frees are reported too;
+ * a counting filter in front of it answers "not sampled" for almost every
+ * free with a single load.
+ */
+#define SAMPLE_FILTER_BITS		16
+#define SAMPLE_SET_BITS			16
+#define SAMPLE_SET_SLOTS		(1 << SAMPLE_SET_BITS)
+#define SAMPLE_SET_MAX			(SAMPLE_SET_SLOTS / 4 * 3)
+static uint64_t sample_interval = 0;		// mean bytes, 0 reports everything
+static uint16_t *sample_filter = NULL;		// sampled pointers per filter slot
+static uintptr_t *sample_set = NULL;		// open addressing, 0 is empty
+static uint32_t sample_set_count = 0;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int64_t sample_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec")));
+
+// transport used to ship events to stat_server, see STAT_MALLOC_TRANSPORT
+#define TRANSPORT_MSGQ			0
+#define TRANSPORT_RING			1
+#define TRANSPORT_COUNTERS		2
+static int transport = TRANSPORT_MSGQ;
+
+// what to do with events when the msgQ or ring is full, see
+// STAT_MALLOC_ON_FULL. the other policies never wait on stat_server
+#define ON_FULL_BLOCK			0
+#define ON_FULL_DROP			1
+#define ON_FULL_COUNTERS		2	// drop, then switch to counters transport
+static int on_full = ON_FULL_BLOCK;
+
+// ring transport state
+#define RING_UNAVAILABLE		((ring_t *)-1) // all slots taken, use msgQ
+static ring_seg_t *ring_seg = NULL;
+static pthread_key_t ring_key;
+static __thread ring_t *thread_ring __attribute__((tls_model("initial-exec")));
+
+// counters transport state
+#define COUNTER_UNAVAILABLE		((counter_slab_t *)-1) // no segment
+static counter_seg_t *counter_seg = NULL;
+static pthread_key_t counter_key;
+static __thread counter_slab_t *thread_slab __attribute__((tls_model("initial-exec")));
 
-// multi-core, multi-procesor spin unlock using shared memory
-void shm_spin_unlock(int lock_type)
-{
-	volatile atomic_flag *lock = (atomic_flag *)shm_attach();
+/*
+ * small object cache state, see STAT_MALLOC_CACHE. one region is reserved
+ * up front so that free() tells our blocks from libc's with one compare.
+ * it is handed out in slabs, each holding blocks of one size bin, which a
+ * thread carves up as it needs them. freed blocks go to the freeing
+ * thread's list, batches of them move through the shared lists.
+ */
+#define CACHE_REGION_BYTES		(1ULL << 30)	// address space, backed as used
+#define CACHE_SLAB_SHIFT		16				// 64KiB
+#define CACHE_NUM_SLABS			(CACHE_REGION_BYTES >> CACHE_SLAB_SHIFT)
+#define CACHE_BATCH				64		// blocks moved to and from shared lists
+#define CACHE_THREAD_MAX		(2 * CACHE_BATCH)	// per thread and bin
+#define CACHE_THREAD_UNREGISTERED	0
+#define CACHE_THREAD_REGISTERED		1
+#define CACHE_THREAD_EXITED			2	// frees go to the shared lists
+
+typedef struct {
+	void		*head[NUM_CACHE_BINS];		// free blocks, linked through
+											// their first word
+	uint32_t	count[NUM_CACHE_BINS];
+	uintptr_t	carve[NUM_CACHE_BINS];		// rest of the current slab
+	uintptr_t	carve_end[NUM_CACHE_BINS];
+	int			state;
+} cache_thread_t;
+
+static uintptr_t cache_base = 0;
+static uintptr_t cache_bytes = 0;			// 0 with the cache off
+static uint32_t cache_next_slab = 0;
+static uint8_t cache_slab_bin[CACHE_NUM_SLABS];
+static void *cache_shared_head[NUM_CACHE_BINS];
+static uint32_t cache_shared_count[NUM_CACHE_BINS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static __thread cache_thread_t thread_cache __attribute__((tls_model("initial-exec")));
+static size_t (*libc_usable_size_fn)(void *) = NULL;
+
+#define cache_owns(ptr)			((uintptr_t)(ptr) - cache_base < cache_bytes)
+#define cache_block_size(bin)	((size_bin_min((bin) + 1) + 15) & ~(size_t)15)
+
+// malloc's heap stats, sent at most every heap_info_interval_ns, see
+// STAT_MALLOC_HEAP_INFO_MS. 0 sends none
+static uint64_t heap_info_interval_ns = 0;
+static uint64_t heap_info_last_ns = 0;
+
+// msgQ batching state, see STAT_MALLOC_BATCH and STAT_MALLOC_BATCH_MS
+#define BATCH_TIMEOUT_MS		10
+#define BATCH_UNREGISTERED		0
+#define BATCH_REGISTERED		1
+#define BATCH_EXITED			2	// thread or process exiting, send directly
+static uint32_t batch_size = MSG_MAX_EVENTS;
+static uint64_t batch_timeout_ns = BATCH_TIMEOUT_MS * 1000000ULL;
+static int batch_process_exiting = 0;
+static batch_t *batch_list = NULL;
+static pthread_mutex_t batch_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t batch_key;
+static __thread batch_t thread_batch __attribute__((tls_model("initial-exec")));
+static __thread int thread_batch_state __attribute__((tls_model("initial-exec")));
 
-	atomic_flag_clear(lock + lock_type);
+/*
+ * libc's exec*() and _exit(), looked up by client_init(): they are called
+ * in vfork() children too, where dlsym() is not safe
+ */
+#define NEXT_EXECVE				0
+#define NEXT_EXECV				1
+#define NEXT_EXECVP				2
+#define NEXT_EXECVPE			3
+#define NEXT_FEXECVE			4
+#define NEXT__EXIT				5
+#define NEXT__EXIT_UPPER		6
+#define NUM_NEXT_SYMBOLS		7
+static const char *next_symbol_names[NUM_NEXT_SYMBOLS] = {
+	"execve", "execv", "execvp", "execvpe", "fexecve", "_exit", "_Exit",
+};
+static void *next_symbols[NUM_NEXT_SYMBOLS];
 
-	// detach from shared memory
-	shmdt((void *)lock); 
-}
 
 
 void *malloc (size_t size)
@@ -110,7 +301,7 @@ void *malloc (size_t size)
 	void *caller;
 
 	caller = __builtin_return_address(0);
-	if (malloc_hook_active) {
+	if (!in_hook) {
 		return my_malloc_hook(size, caller);
 	}
 	ptr = __libc_malloc(size);
@@ -124,23 +315,18 @@ void *my_malloc_hook(size_t size, const void *caller)
 {
 	void *ptr;
 
-	shm_spin_lock(LOCK_TYPE_MALLOC);
-	
 	// deactivate hooks to avoid recurssion issues
-	malloc_hook_active = 0;
+	in_hook = 1;
 
-    ptr = malloc(size);
+    ptr = cache_malloc(size);
 	
     // printf("Client: my_malloc_hook 0x%08LX  %ld\n",
 	//	   (long long unsigned int) ptr, size);
 
-	// reactivate hooks
-	malloc_hook_active = 1;
-
-	shm_spin_unlock(LOCK_TYPE_MALLOC);
+	send_allocation(ptr, size, MSG_CALL_MALLOC, 0, caller);
 
-	// doesn't use malloc
-	send_allocation(ptr, size);
+	// reactivate hooks
+	in_hook = 0;
 
     return ptr;
 }
@@ -151,34 +337,34 @@ void free(void *ptr)
 	void *caller;
 
 	caller = __builtin_return_address(0);
-	if (free_hook_active) {
+	if (!in_hook) {
 		my_free_hook(ptr, caller);
 		return;
 	}
-	__libc_free(ptr);
+	cache_free(ptr);
 	//printf("Client: __libc_free 0x%08LX\n",
 	//	   (long long unsigned int) ptr);
 }
 
 void my_free_hook(void *ptr, const void *caller)
 {
-	shm_spin_lock(LOCK_TYPE_FREE);
-	
+	if (ptr == NULL) {
+		return;
+	}
+
 	// deactivate hooks to avoid recurssion issues
-	free_hook_active = 0;
+	in_hook = 1;
+
+	// report first, once freed the address can be handed out again
+	send_free(ptr, MSG_CALL_FREE, caller, NULL);
 
-    free(ptr);
+    cache_free(ptr);
 
 	//printf("Client: my_free_hook 0x%08LX\n",
 	//	   (long long unsigned int) ptr);
 
 	// reactivate hooks
-	free_hook_active = 1;
-
-	shm_spin_unlock(LOCK_TYPE_FREE);
-
-	// doesn't use malloc
-	send_free(ptr);
+	in_hook = 0;
 }
 
 
@@ -188,7 +374,7 @@ void *calloc (size_t nmemb, size_t size)
 	void *ptr;
 
 	caller = __builtin_return_address(0);
-	if (calloc_hook_active) {
+	if (!in_hook) {
 		return my_calloc_hook(nmemb, size, caller);
 	}
 	ptr = __libc_calloc(nmemb, size);
@@ -203,23 +389,18 @@ void *my_calloc_hook(size_t nmemb, size_t size, const void *caller)
 {
 	void *ptr;
 
-	shm_spin_lock(LOCK_TYPE_CALLOC);
-	
 	// deactivate hooks to avoid recurssion issues
-	calloc_hook_active = 0;
+	in_hook = 1;
 		
-    ptr = calloc(nmemb, size);
+    ptr = cache_calloc(nmemb, size);
 	
     // printf("Client: my_calloc_hook %ld  %ld\n",
     // 		   nmemb, size);
 
-	// reactivate hooks
-	calloc_hook_active = 1;
-
-	shm_spin_unlock(LOCK_TYPE_CALLOC);
+    send_allocation(ptr, nmemb * size, MSG_CALL_CALLOC, 0, caller);
 
-    // doesn't use malloc
-    send_allocation(ptr, nmemb * size);
+	// reactivate hooks
+	in_hook = 0;
 	
     return ptr;
 }
@@ -231,10 +412,10 @@ void *realloc (void *ptr, size_t size)
 	void *new_ptr;
 
 	caller = __builtin_return_address(0);
-	if (realloc_hook_active) {
+	if (!in_hook) {
 		return my_realloc_hook(ptr, size, caller);
 	}
-	new_ptr = __libc_realloc(ptr, size);
+	new_ptr = cache_realloc(ptr, size);
 	// printf("Client: __libc_realloc 0x%08LX 0x%08LX  %ld\n",
 	//	   (long long unsigned int)new_ptr,
 	//	   (long long unsigned int)ptr,
@@ -261,96 +442,1998 @@ void *realloc (void *ptr, size_t size)
  */
 void *my_realloc_hook(void *ptr, size_t size, const void *caller)
 {
-	void *new_ptr;
+	void 	 *new_ptr;
+	size_t 	 old_size = 0;
+	uint32_t free_seq = 0;
 
-	shm_spin_lock(LOCK_TYPE_REALLOC);
-	
 	// deactivate hooks to avoid recurssion issues
-	realloc_hook_active = 0;
+	in_hook = 1;
+
+	if ((transport == TRANSPORT_COUNTERS) && (ptr != NULL)) {
+		// must be read before realloc frees the block
+		old_size = cache_usable_size(ptr);
+	} else if ((ptr != NULL) && server_present()) {
+		// the free must be ordered before realloc can hand ptr out again
+		free_seq = event_seq_now();
+	}
 		
-	new_ptr = realloc(ptr, size);
+	new_ptr = cache_realloc(ptr, size);
+
+	if (transport == TRANSPORT_COUNTERS) {
+		if ((ptr != NULL) && ((new_ptr != NULL) || (size == 0))) {
+			counter_update(old_size, 1);
+		}
+		if (new_ptr != NULL) {
+			counter_update(cache_usable_size(new_ptr), 0);
+		}
+		in_hook = 0;
+		return new_ptr;
+	}
 
     // printf("Client: my_ralloc_hook 0x%08LX 0x%08LX  %ld\n",
 	//	   (long long unsigned int) ptr,
 	//	   (long long unsigned int) new_ptr,
 	//	   size);
-	
-	// reactivate hooks
-	realloc_hook_active = 1;
 
-	shm_spin_unlock(LOCK_TYPE_REALLOC);
-
-	// doesn't use malloc
 	if (ptr == NULL) {
 		// no free, just allocation
-		send_allocation(new_ptr, size);
+		send_allocation(new_ptr, size, MSG_CALL_REALLOC, 0, caller);
 	} else if ((size == 0) && (ptr != NULL)) {
 		// no allocation, just free
-        send_free(ptr);
-    } else {
-		// both free and allocation
-		send_free(ptr);
-        send_allocation(new_ptr, size);
+        send_free(ptr, MSG_CALL_REALLOC, caller, &free_seq);
+    } else if (new_ptr != NULL) {
+		// both free and allocation, a failed realloc leaves ptr alone
+		send_free(ptr, MSG_CALL_REALLOC, caller, &free_seq);
+        send_allocation(new_ptr, size, MSG_CALL_REALLOC, 0, caller);
     }
+	
+	// reactivate hooks
+	in_hook = 0;
 
     return new_ptr;
 }
 
-// must be called with hooks_active = 0
-void send_allocation(void *ptr, size_t size)
+/*
+ * The aligned allocators all end up in __libc_memalign(), with the
+ * alignment in the event so stat_server can bin by it. glibc's own
+ * aligned_alloc() is memalign() under another name.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-	msg_t msg;
-	key_t key; 
-	int msgid;
+	void *caller;
+	void *ptr;
+
+	caller = __builtin_return_address(0);
+
+	// a power of two multiple of sizeof(void *), as glibc checks
+	if ((alignment == 0) || (alignment % sizeof(void *) != 0) ||
+		((alignment & (alignment - 1)) != 0)) {
+		return EINVAL;
+	}
+	if (!in_hook) {
+		ptr = my_memalign_hook(alignment, size, caller);
+	} else {
+		ptr = __libc_memalign(alignment, size);
+	}
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
 
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *caller;
+
+	caller = __builtin_return_address(0);
+	if ((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!in_hook) {
+		return my_memalign_hook(alignment, size, caller);
+	}
+	return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *caller;
+
+	caller = __builtin_return_address(0);
+	if (!in_hook) {
+		return my_memalign_hook(alignment, size, caller);
+	}
+	return __libc_memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	void *caller;
+
+	caller = __builtin_return_address(0);
+	if (!in_hook) {
+		return my_memalign_hook(getpagesize(), size, caller);
+	}
+	return __libc_memalign(getpagesize(), size);
+}
+
+// valloc() of whole pages, at least one
+void *pvalloc(size_t size)
+{
+	void 	*caller;
+	size_t 	page_size = getpagesize();
+
+	caller = __builtin_return_address(0);
+	if (size > SIZE_MAX - page_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = (size + page_size - 1) & ~(page_size - 1);
 	if (size == 0) {
-		// malformed allocation, don't bother sending
+		size = page_size;
+	}
+	if (!in_hook) {
+		return my_memalign_hook(page_size, size, caller);
+	}
+	return __libc_memalign(page_size, size);
+}
+
+void *my_memalign_hook(size_t alignment, size_t size, const void *caller)
+{
+	void *ptr;
+
+	// deactivate hooks to avoid recurssion issues
+	in_hook = 1;
+
+	ptr = __libc_memalign(alignment, size);
+
+	send_allocation(ptr, size, MSG_CALL_MEMALIGN, alignment_shift(alignment),
+					caller);
+
+	// reactivate hooks
+	in_hook = 0;
+
+	return ptr;
+}
+
+// the cache's blocks are not glibc's to size
+size_t malloc_usable_size(void *ptr)
+{
+	return cache_usable_size(ptr);
+}
+
+// realloc() with calloc()'s overflow check
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	void 	*caller;
+	size_t 	bytes;
+
+	caller = __builtin_return_address(0);
+	if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (!in_hook) {
+		return my_realloc_hook(ptr, bytes, caller);
+	}
+	return cache_realloc(ptr, bytes);
+}
+
+// log2 of the alignment glibc will actually use, the next power of two
+uint8_t alignment_shift(size_t alignment)
+{
+	if (alignment <= 1) {
+		return 0;
+	}
+	return 64 - __builtin_clzll(alignment - 1);
+}
+
+/*
+ * C++ operator new and delete, by their mangled names since this is C.
+ * libstdc++'s versions would call malloc() and free() anyway, replacing
+ * them here reports the caller of new instead of libstdc++, tags the
+ * aligned forms. align_val_t is passed as a size_t.
+ */
+void *cxx_new_size(size_t size) __asm__("_Znwm");
+void *cxx_new_array(size_t size) __asm__("_Znam");
+void *cxx_new_nothrow(size_t size, const void *nothrow)
+	__asm__("_ZnwmRKSt9nothrow_t");
+void *cxx_new_array_nothrow(size_t size, const void *nothrow)
+	__asm__("_ZnamRKSt9nothrow_t");
+void *cxx_new_aligned(size_t size, size_t alignment)
+	__asm__("_ZnwmSt11align_val_t");
+void *cxx_new_array_aligned(size_t size, size_t alignment)
+	__asm__("_ZnamSt11align_val_t");
+void *cxx_new_aligned_nothrow(size_t size, size_t alignment,
+							  const void *nothrow)
+	__asm__("_ZnwmSt11align_val_tRKSt9nothrow_t");
+void *cxx_new_array_aligned_nothrow(size_t size, size_t alignment,
+									const void *nothrow)
+	__asm__("_ZnamSt11align_val_tRKSt9nothrow_t");
+void cxx_delete(void *ptr) __asm__("_ZdlPv");
+void cxx_delete_array(void *ptr) __asm__("_ZdaPv");
+void cxx_delete_sized(void *ptr, size_t size) __asm__("_ZdlPvm");
+void cxx_delete_array_sized(void *ptr, size_t size) __asm__("_ZdaPvm");
+void cxx_delete_nothrow(void *ptr, const void *nothrow)
+	__asm__("_ZdlPvRKSt9nothrow_t");
+void cxx_delete_array_nothrow(void *ptr, const void *nothrow)
+	__asm__("_ZdaPvRKSt9nothrow_t");
+void cxx_delete_aligned(void *ptr, size_t alignment)
+	__asm__("_ZdlPvSt11align_val_t");
+void cxx_delete_array_aligned(void *ptr, size_t alignment)
+	__asm__("_ZdaPvSt11align_val_t");
+void cxx_delete_sized_aligned(void *ptr, size_t size, size_t alignment)
+	__asm__("_ZdlPvmSt11align_val_t");
+void cxx_delete_array_sized_aligned(void *ptr, size_t size, size_t alignment)
+	__asm__("_ZdaPvmSt11align_val_t");
+void cxx_delete_aligned_nothrow(void *ptr, size_t alignment,
+								const void *nothrow)
+	__asm__("_ZdlPvSt11align_val_tRKSt9nothrow_t");
+void cxx_delete_array_aligned_nothrow(void *ptr, size_t alignment,
+									  const void *nothrow)
+	__asm__("_ZdaPvSt11align_val_tRKSt9nothrow_t");
+
+void *cxx_new_size(size_t size)
+{
+	return cxx_new(size, 0, NULL, "_Znwm", __builtin_return_address(0));
+}
+
+void *cxx_new_array(size_t size)
+{
+	return cxx_new(size, 0, NULL, "_Znam", __builtin_return_address(0));
+}
+
+void *cxx_new_nothrow(size_t size, const void *nothrow)
+{
+	return cxx_new(size, 0, nothrow, "_ZnwmRKSt9nothrow_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new_array_nothrow(size_t size, const void *nothrow)
+{
+	return cxx_new(size, 0, nothrow, "_ZnamRKSt9nothrow_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new_aligned(size_t size, size_t alignment)
+{
+	return cxx_new(size, alignment, NULL, "_ZnwmSt11align_val_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new_array_aligned(size_t size, size_t alignment)
+{
+	return cxx_new(size, alignment, NULL, "_ZnamSt11align_val_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new_aligned_nothrow(size_t size, size_t alignment,
+							  const void *nothrow)
+{
+	return cxx_new(size, alignment, nothrow,
+				   "_ZnwmSt11align_val_tRKSt9nothrow_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new_array_aligned_nothrow(size_t size, size_t alignment,
+									const void *nothrow)
+{
+	return cxx_new(size, alignment, nothrow,
+				   "_ZnamSt11align_val_tRKSt9nothrow_t",
+				   __builtin_return_address(0));
+}
+
+void *cxx_new(size_t size, size_t alignment, const void *nothrow,
+			  const char *symbol, const void *caller)
+{
+	void *ptr;
+
+	if (in_hook) {
+		ptr = alignment ? __libc_memalign(alignment, size) :
+			__libc_malloc(size);
+	} else {
+		ptr = alignment ? my_memalign_hook(alignment, size, caller) :
+			my_malloc_hook(size, caller);
+	}
+	if (ptr == NULL) {
+		ptr = cxx_new_fallback(size, alignment, nothrow, symbol);
+	}
+
+	return ptr;
+}
+
+/*
+ * out of memory. libstdc++'s operator new runs the new_handler and throws
+ * std::bad_alloc, which C cannot do, so let it have a go. its own malloc()
+ * calls come back through the hooks.
+ */
+void *cxx_new_fallback(size_t size, size_t alignment, const void *nothrow,
+					   const char *symbol)
+{
+	void *next;
+
+	if ((next = dlsym(RTLD_NEXT, symbol)) == NULL) {
+		if (nothrow != NULL) {
+			return NULL;
+		}
+		abort();
+	}
+
+	if (alignment && nothrow) {
+		return ((void *(*)(size_t, size_t, const void *))next)(size, alignment,
+															   nothrow);
+	} else if (alignment) {
+		return ((void *(*)(size_t, size_t))next)(size, alignment);
+	} else if (nothrow) {
+		return ((void *(*)(size_t, const void *))next)(size, nothrow);
+	}
+	return ((void *(*)(size_t))next)(size);
+}
+
+void cxx_delete(void *ptr)
+{
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
 		return;
 	}
+	cache_free(ptr);
+}
 
-	if (0) {
-		// init only forks and executes stat_server. due to recurssion issues
-		// we now start stat_server via shell script intead. 
-		init();
+void cxx_delete_array(void *ptr)
+{
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
 	}
+	cache_free(ptr);
+}
 
-	// ftok to generate unique key 
-	key = ftok(MSG_KEY_STRING, MSG_KEY_INT); 
-  
-	// msgget creates a message queue and returns identifier 
-	msgid = msgget(key, MSG_PERMISSIONS | IPC_CREAT);
+void cxx_delete_sized(void *ptr, size_t size)
+{
+	// free() finds the block from ptr alone
+	(void)size;
 
-	msg.type 			= MSG_TYPE_VERKADA;
-	msg.msg_data.ptr 	= ptr;
-	msg.msg_data.size 	= size;
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
 
-	// will block if msgQ full
-	msgsnd(msgid, &msg, sizeof(msg_data_t), 0); 
+void cxx_delete_array_sized(void *ptr, size_t size)
+{
+	// free() finds the block from ptr alone
+	(void)size;
 
-	return;
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
 }
 
-// must be called with hooks_active = 0
-void send_free(void *ptr)
+void cxx_delete_nothrow(void *ptr, const void *nothrow)
 {
-	msg_t msg;
-	key_t key; 
-	int msgid;
+	// only picks the overload, delete never throws
+	(void)nothrow;
 
-	// ftok to generate unique key 
-	key = ftok(MSG_KEY_STRING, MSG_KEY_INT); 
-  
-	// msgget creates a message queue and returns identifier 
-	msgid = msgget(key, MSG_PERMISSIONS | IPC_CREAT);
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_array_nothrow(void *ptr, const void *nothrow)
+{
+	// only picks the overload, delete never throws
+	(void)nothrow;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+// memalign() may leave slack after an aligned block, the size hint is
+// not trusted for those
+void cxx_delete_aligned(void *ptr, size_t alignment)
+{
+	// free() finds the block from ptr alone
+	(void)alignment;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_array_aligned(void *ptr, size_t alignment)
+{
+	// free() finds the block from ptr alone
+	(void)alignment;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_sized_aligned(void *ptr, size_t size, size_t alignment)
+{
+	// see above, and free() finds the block from ptr alone
+	(void)size;
+	(void)alignment;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_array_sized_aligned(void *ptr, size_t size, size_t alignment)
+{
+	// see above, and free() finds the block from ptr alone
+	(void)size;
+	(void)alignment;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_aligned_nothrow(void *ptr, size_t alignment,
+								const void *nothrow)
+{
+	// free() finds the block from ptr alone, delete never throws
+	(void)alignment;
+	(void)nothrow;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+void cxx_delete_array_aligned_nothrow(void *ptr, size_t alignment,
+									  const void *nothrow)
+{
+	// free() finds the block from ptr alone, delete never throws
+	(void)alignment;
+	(void)nothrow;
+
+	if (!in_hook) {
+		my_free_hook(ptr, __builtin_return_address(0));
+		return;
+	}
+	cache_free(ptr);
+}
+
+// must be called with in_hook set
+void send_allocation(void *ptr, size_t size, uint8_t call,
+					 uint8_t align_shift, const void *caller)
+{
+	if (heap_info_interval_ns) {
+		heap_info_send();
+	}
 
-	msg.type 			= MSG_TYPE_VERKADA;
-	msg.msg_data.ptr 	= ptr;
-	msg.msg_data.size 	= 0; // indicates to server this is a free
+	if (transport == TRANSPORT_COUNTERS) {
+		// counted by block size so that frees, which only know the block,
+		// balance out. malloc(0) blocks count too.
+		if (ptr != NULL) {
+			counter_update(cache_usable_size(ptr), 0);
+		}
+		return;
+	}
+
+	if (!server_present()) {
+		// nobody listening, this is all an absent stat_server costs
+		return;
+	}
+
+	if (size == 0) {
+		// malformed allocation, don't bother sending
+		return;
+	}
+
+	if (sample_interval && !sample_allocation(ptr, size)) {
+		return;
+	}
 
-	// will block if msgQ full
-	msgsnd(msgid, &msg, sizeof(msg_data_t), 0); 
+	if (0) {
+		// init only forks and executes stat_server. due to recurssion issues
+		// we now start stat_server via shell script intead. 
+		init();
+	}
+
+	// ordered after the allocation, so after any free of ptr before it
+	send_event(MSG_OP_ALLOC, call, ptr, size, align_shift, caller,
+			   event_seq_now());
+}
+
+/*
+ * must be called with in_hook set, before ptr is freed. seq, if not NULL,
+ * was taken before the free
+ */
+void send_free(void *ptr, uint8_t call, const void *caller,
+			   const uint32_t *seq)
+{
+	if (heap_info_interval_ns) {
+		// frees are what leave malloc holding free memory
+		heap_info_send();
+	}
+
+	if (transport == TRANSPORT_COUNTERS) {
+		// the same size send_allocation() added, glibc may have handed
+		// out more than the request rounded
+		counter_update(cache_usable_size(ptr), 1);
+		return;
+	}
+
+	if (!server_present()) {
+		return;
+	}
+
+	if (sample_interval && !sample_free(ptr)) {
+		return;
+	}
+
+	send_event(MSG_OP_FREE, call, ptr, 0, 0, caller,
+			   seq ? *seq : event_seq_now());
+}
+
+void send_event(uint8_t op, uint8_t call, void *ptr, size_t size,
+				uint8_t align_shift, const void *caller, uint32_t seq)
+{
+	msg_data_t event;
+
+	if (client_pid == 0) {
+		// event from before client_init()
+		process_ident_init();
+	}
+
+	event.ptr    = ptr;
+	event.size   = size;
+	event.caller = caller;
+	event.time_ns = coarse_time_ns();
+	event.pid    = client_pid;
+	event.gen    = client_gen;
+	event.tid    = thread_tid ? thread_tid :
+		(thread_tid = syscall(SYS_gettid));
+	event.op     = op;
+	event.call   = call;
+	event.align_shift = align_shift;
+	event.sample_interval = sample_interval;
+	event.seq 	 = seq;
+
+	if ((transport != TRANSPORT_RING) || !ring_send(&event)) {
+		batch_add(&event);
+	}
+}
+
+/*
+ * the fine monotonic clock, which every thread reads without writing
+ * anything shared, so a free's number is below that of any allocation that
+ * reuses its address: the free takes its number before the address is
+ * freed, the allocation after it is returned
+ */
+uint32_t event_seq_now(void)
+{
+	struct timespec ts;
+
+	// vDSO, no syscall
+	clock_gettime(EVENT_SEQ_CLOCK, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+void msgq_send(long type, const msg_data_t *event)
+{
+	msg_t msg;
+
+	msg.msg_data[0] = *event;
+
+	msgq_send_events(type, &msg, 1);
+}
+
+void msgq_send_events(long type, msg_t *msg, uint32_t num_events)
+{
+	int saved_errno;
+
+	if ((msgid == -1) || ((server_seg != NULL) &&
+						  (__atomic_load_n(&server_seg->epoch,
+										   __ATOMIC_ACQUIRE) != msgq_epoch))) {
+		// event from before client_init(), e.g. another library's
+		// constructor, or a new stat_server with a new msgQ
+		msgq_open();
+	}
+
+	msg->type = type;
+	saved_errno = errno;
+
+	if (on_full == ON_FULL_BLOCK) {
+		// wait while msgQ full, but not on a stat_server that died. a
+		// blocking msgsnd() would wait on a killed one forever, the msgQ
+		// outlives it, so its heartbeat is checked between tries
+		while (msgsnd(msgid, msg, num_events * sizeof(msg_data_t),
+					  IPC_NOWAIT) == -1) {
+			if ((errno != EINTR) && ((errno != EAGAIN) || !server_present())) {
+				break;
+			}
+			if (errno == EAGAIN) {
+				usleep(MSGQ_FULL_WAIT_US);
+			}
+		}
+		errno = saved_errno;
+		return;
+	}
+
+	while (msgsnd(msgid, msg, num_events * sizeof(msg_data_t),
+				  IPC_NOWAIT) == -1) {
+		if (errno != EINTR) {
+			// full, or stat_server removed the msgQ. a lost ring attach
+			// is made up for by stat_server's scan of /dev/shm
+			if (type == MSG_TYPE_VERKADA) {
+				events_dropped(msg->msg_data, num_events);
+			}
+			break;
+		}
+	}
+	errno = saved_errno;
+}
+
+/*
+ * ship mallinfo2() if it is due, whichever transport carries the events.
+ * mallinfo2() locks and walks every arena, so only one thread per interval
+ * gets to call it
+ */
+void heap_info_send(void)
+{
+	heap_info_msg_t msg;
+	uint64_t 		now = coarse_time_ns();
+	uint64_t 		last = __atomic_load_n(&heap_info_last_ns, __ATOMIC_RELAXED);
+	int 			saved_errno;
+#if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 info;
+#else
+	struct mallinfo info;
+#endif
+
+	if ((now - last < heap_info_interval_ns) || !server_present() ||
+		!__atomic_compare_exchange_n(&heap_info_last_ns, &last, now, 0,
+									 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+#if __GLIBC_PREREQ(2, 33)
+	info = mallinfo2();
+#else
+	// int fields, they wrap past 2GiB
+	info = mallinfo();
+#endif
+
+	if (client_pid == 0) {
+		process_ident_init();
+	}
+	msg.type 			  = MSG_TYPE_HEAP_INFO;
+	msg.info.pid 		  = client_pid;
+	msg.info.gen 		  = client_gen;
+	msg.info.time_ns 	  = now;
+	msg.info.arena 		  = info.arena;
+	msg.info.in_use 	  = info.uordblks;
+	msg.info.free 		  = info.fordblks;
+	msg.info.fastbin_free = info.fsmblks;
+	msg.info.mmapped 	  = info.hblkhd;
+	msg.info.releasable   = info.keepcost;
+
+	if ((msgid == -1) || ((server_seg != NULL) &&
+						  (__atomic_load_n(&server_seg->epoch,
+										   __ATOMIC_ACQUIRE) != msgq_epoch))) {
+		msgq_open();
+	}
+
+	// a lost one is made up for by the next, never wait for room
+	saved_errno = errno;
+	msgsnd(msgid, &msg, sizeof(msg.info), IPC_NOWAIT);
+	errno = saved_errno;
+}
+
+void msgq_open(void)
+{
+	key_t key; 
+
+	if (server_seg != NULL) {
+		msgq_epoch = __atomic_load_n(&server_seg->epoch, __ATOMIC_ACQUIRE);
+	}
+
+	// ftok to generate unique key 
+	key = ftok(MSG_KEY_STRING, MSG_KEY_INT); 
+  
+	// only stat_server creates the msgQ, one nobody reads would fill up
+	msgid = msgget(key, MSG_PERMISSIONS);
+}
+
+/*
+ * one load while stat_server is away. active stays set if it was killed,
+ * so a stale heartbeat counts as away too.
+ */
+int server_present(void)
+{
+	const server_seg_t *seg = server_seg;
+
+	if (seg == NULL) {
+		return 1;
+	}
+	if (!__atomic_load_n(&seg->active, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	return coarse_time_ns() - __atomic_load_n(&seg->heartbeat_ns,
+											  __ATOMIC_RELAXED) <
+		SERVER_HEARTBEAT_NS;
+}
+
+// created here if stat_server has not run yet, it attaches to ours then
+void server_seg_open(void)
+{
+	struct stat st;
+	void 		*seg;
+	int 		fd;
+
+	fd = shm_open(SERVER_SEG_NAME, O_RDWR | O_CREAT, SERVER_SEG_PERMISSIONS);
+	if (fd != -1) {
+		// other users' clients and stat_server need it too, despite umask
+		fchmod(fd, SERVER_SEG_PERMISSIONS);
+		if ((fstat(fd, &st) == 0) && (st.st_size < (off_t)sizeof(server_seg_t))) {
+			// new pages are zero, no server active
+			if (ftruncate(fd, sizeof(server_seg_t)) == -1) {
+				close(fd);
+				return;
+			}
+		}
+	} else if ((fd = shm_open(SERVER_SEG_NAME, O_RDONLY, 0)) == -1) {
+		return;
+	}
+
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(server_seg_t))) {
+		close(fd);
+		return;
+	}
+	seg = mmap(NULL, sizeof(server_seg_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg != MAP_FAILED) {
+		server_seg = seg;
+	}
+}
+
+// counts events lost to a full queue where stat_server can see them
+void events_dropped(const msg_data_t *events, uint32_t num_events)
+{
+	counter_seg_t *seg = counter_seg;
+	uint64_t 	  allocations = 0, frees = 0, bytes = 0;
+
+	if (seg == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < num_events; i++) {
+		if (events[i].op == MSG_OP_ALLOC) {
+			allocations++;
+			bytes += events[i].size;
+		} else {
+			frees++;
+		}
+	}
+	__atomic_fetch_add(&seg->dropped_allocations, allocations, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&seg->dropped_frees, frees, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&seg->dropped_bytes, bytes, __ATOMIC_RELAXED);
+
+	if (on_full == ON_FULL_COUNTERS) {
+		degrade_to_counters();
+	}
+}
+
+/*
+ * from now on only count, stat_server drops what it has from our events.
+ * events still batched by other threads are dropped by stat_server too.
+ */
+void degrade_to_counters(void)
+{
+	if (__atomic_load_n(&transport, __ATOMIC_RELAXED) == TRANSPORT_COUNTERS) {
+		return;
+	}
+	__atomic_store_n(&counter_seg->mode, COUNTER_SEG_DEGRADED, __ATOMIC_RELEASE);
+	__atomic_store_n(&transport, TRANSPORT_COUNTERS, __ATOMIC_RELAXED);
+}
+
+uint64_t coarse_time_ns(void)
+{
+	struct timespec ts;
+
+	// vDSO, no syscall
+	clock_gettime(EVENT_CLOCK, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// buffer an event, shipping the batch when full or past its deadline
+void batch_add(const msg_data_t *event)
+{
+	batch_t 	*batch = &thread_batch;
+	uint64_t 	now;
+	int 		expired, flushed = 0;
+
+	if (thread_batch_state == BATCH_UNREGISTERED) {
+		batch_register();
+	}
+	if ((thread_batch_state == BATCH_EXITED) || batch_process_exiting ||
+		(batch_size <= 1)) {
+		msgq_send(MSG_TYPE_VERKADA, event);
+		return;
+	}
+
+	// only contended while another thread ships our stale batch
+	while (__atomic_exchange_n(&batch->busy, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	now = event->time_ns;
+	if (batch->num_events == 0) {
+		batch->deadline_ns = now + batch_timeout_ns;
+	}
+
+	batch->msg.msg_data[batch->num_events++] = *event;
+
+	expired = (now >= batch->deadline_ns);
+	if (expired || (batch->num_events >= batch_size) ||
+		batch_process_exiting) {
+		batch_flush(batch);
+		flushed = 1;
+	}
+
+	__atomic_store_n(&batch->busy, 0, __ATOMIC_RELEASE);
+
+	if (flushed) {
+		// threads that stopped allocating would otherwise sit on their
+		// events until they exit, whoever ships a batch ships theirs
+		batch_flush_stale(now);
+	}
+}
+
+// caller must hold batch->busy
+void batch_flush(batch_t *batch)
+{
+	if (batch->num_events == 0) {
+		return;
+	}
+
+	msgq_send_events(MSG_TYPE_VERKADA, &batch->msg, batch->num_events);
+	batch->num_events = 0;
+}
+
+// ship other threads' batches that are past their deadline
+void batch_flush_stale(uint64_t now)
+{
+	batch_t *batch;
+
+	if (pthread_mutex_trylock(&batch_list_lock) != 0) {
+		// someone else is already sweeping
+		return;
+	}
+
+	for (batch = batch_list; batch != NULL; batch = batch->next) {
+		if ((batch == &thread_batch) ||
+			(__atomic_load_n(&batch->num_events, __ATOMIC_RELAXED) == 0) ||
+			__atomic_exchange_n(&batch->busy, 1, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (now >= batch->deadline_ns) {
+			batch_flush(batch);
+		}
+		__atomic_store_n(&batch->busy, 0, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&batch_list_lock);
+}
+
+void batch_register(void)
+{
+	thread_batch_state = BATCH_REGISTERED;
+
+	pthread_mutex_lock(&batch_list_lock);
+	thread_batch.prev = NULL;
+	thread_batch.next = batch_list;
+	if (batch_list != NULL) {
+		batch_list->prev = &thread_batch;
+	}
+	batch_list = &thread_batch;
+	pthread_mutex_unlock(&batch_list_lock);
+
+	// batch_thread_exit() runs at thread exit
+	pthread_setspecific(batch_key, &thread_batch);
+}
+
+// thread exit: ship what is left, the TLS batch is about to go away
+void batch_thread_exit(void *arg)
+{
+	batch_t *batch = (batch_t *)arg;
+
+	pthread_mutex_lock(&batch_list_lock);
+	if (batch->prev != NULL) {
+		batch->prev->next = batch->next;
+	} else {
+		batch_list = batch->next;
+	}
+	if (batch->next != NULL) {
+		batch->next->prev = batch->prev;
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+
+	// nobody else can reach it now
+	batch_flush(batch);
+	thread_batch_state = BATCH_EXITED;
+}
+
+// the child must not resend its parent's events or wait on its threads
+void batch_atfork_child(void)
+{
+	pthread_mutex_init(&batch_list_lock, NULL);
+	batch_list = NULL;
+	thread_batch.busy 		= 0;
+	thread_batch.num_events = 0;
+	if (thread_batch_state == BATCH_REGISTERED) {
+		thread_batch_state = BATCH_UNREGISTERED;
+	}
+}
+
+// ship every thread's pending events
+void batch_flush_all(void)
+{
+	batch_t *batch;
+
+	pthread_mutex_lock(&batch_list_lock);
+	for (batch = batch_list; batch != NULL; batch = batch->next) {
+		while (__atomic_exchange_n(&batch->busy, 1, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+		batch_flush(batch);
+		__atomic_store_n(&batch->busy, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+}
+
+// returns 0 if this thread has no ring and the event must go via msgQ
+int ring_send(const msg_data_t *event)
+{
+	ring_t 		*ring = thread_ring;
+	uint64_t 	head;
+
+	if (ring == NULL) {
+		ring = thread_ring = ring_claim();
+	}
+	if (ring == RING_UNAVAILABLE) {
+		return 0;
+	}
+
+	head = ring->head;
+	if (head - ring->tail_cache >= RING_EVENTS) {
+		// ring looks full, refresh our view of stat_server's progress and
+		// wait for room (same blocking behavior as a full msgQ)
+		while (head - (ring->tail_cache =
+					   __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) >=
+			   RING_EVENTS) {
+			if (on_full != ON_FULL_BLOCK) {
+				events_dropped(event, 1);
+				return 1;
+			}
+			if (!server_present()) {
+				// nobody left to drain it
+				return 1;
+			}
+			sched_yield();
+		}
+	}
+
+	ring->events[head & (RING_EVENTS - 1)] = *event;
+
+	// publish: event stores must be visible before the new head
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ring->head = head + 1;
+
+	return 1;
+}
+
+// claim a free ring slot for the calling thread
+ring_t *ring_claim(void)
+{
+	uint32_t expected, used;
+	ring_t   *ring;
+
+	if (ring_seg == NULL) {
+		return RING_UNAVAILABLE;
+	}
+
+	for (int i = 0; i < RING_SLOTS; i++) {
+		ring = &ring_seg->rings[i];
+		expected = RING_FREE;
+		if (!__atomic_compare_exchange_n(&ring->state, &expected, RING_OWNED,
+										 0, __ATOMIC_ACQUIRE,
+										 __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		// stat_server frees a slot only once it is drained, so head == tail
+		ring->tid 		 = syscall(SYS_gettid);
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		// let stat_server know how far to scan
+		used = __atomic_load_n(&ring_seg->num_slots_used, __ATOMIC_RELAXED);
+		while ((used < (uint32_t)i + 1) &&
+			   !__atomic_compare_exchange_n(&ring_seg->num_slots_used, &used,
+											i + 1, 0, __ATOMIC_RELEASE,
+											__ATOMIC_RELAXED)) {
+		}
+
+		// ring_release() runs at thread exit
+		pthread_setspecific(ring_key, ring);
+		return ring;
+	}
+
+	return RING_UNAVAILABLE;
+}
+
+// thread exit: hand the slot back once stat_server has drained it
+void ring_release(void *ring)
+{
+	__atomic_store_n(&((ring_t *)ring)->state, RING_CLOSED, __ATOMIC_RELEASE);
+	thread_ring = RING_UNAVAILABLE; // late frees in other destructors
+}
+
+// creates this process's ring segment and announces it to stat_server
+void ring_seg_create(void)
+{
+	char 		name[64];
+	int 		fd;
+	ring_seg_t 	*seg;
+	msg_data_t 	event;
+
+	snprintf(name, sizeof(name), RING_SEG_NAME_FORMAT, client_pid);
+
+	// a leftover segment belongs to our image before exec or to a dead
+	// process that had our pid
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, RING_SEG_PERMISSIONS);
+	if (fd == -1) {
+		return;
+	}
+
+	// new pages are zero, so all slots start out RING_FREE
+	if (ftruncate(fd, sizeof(ring_seg_t)) == -1) {
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+
+	seg = mmap(NULL, sizeof(ring_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		shm_unlink(name);
+		return;
+	}
+
+	seg->pid = client_pid;
+	__atomic_store_n(&seg->magic, RING_SEG_MAGIC, __ATOMIC_RELEASE);
+	ring_seg = seg;
+
+	memset(&event, 0, sizeof(event));
+	event.pid = client_pid;
+	event.gen = client_gen;
+	msgq_send(MSG_TYPE_RING_ATTACH, &event);
+}
+
+// the child must not produce into its parent's rings
+void ring_atfork_child(void)
+{
+	if (ring_seg != NULL) {
+		munmap(ring_seg, sizeof(ring_seg_t));
+		ring_seg = NULL;
+	}
+	// the key still holds the parent's ring, whose release at thread exit
+	// would write to the unmapped segment
+	thread_ring = NULL;
+	pthread_setspecific(ring_key, NULL);
+	ring_seg_create();
+}
+
+// returns 1 if the allocation is sampled and must be reported
+int sample_allocation(void *ptr, size_t size)
+{
+	uint64_t hash;
+	uint32_t i;
+	int 	 sampled = 0;
+
+	// the common case, one decrement
+	if ((sample_countdown -= size) > 0) {
+		return 0;
+	}
+
+	if (sample_rng == 0) {
+		// thread's first allocation, start with a random interval instead
+		sample_rng = coarse_time_ns() ^ ((uint64_t)syscall(SYS_gettid) << 32) ^
+			(uintptr_t)&sample_rng;
+		sample_countdown = sample_next_interval() - size;
+		if (sample_countdown > 0) {
+			return 0;
+		}
+	}
+	sample_countdown = sample_next_interval();
+
+	if ((ptr == NULL) || (sample_set == NULL)) {
+		return 0;
+	}
+
+	hash = (uintptr_t)ptr * 0x9E3779B97F4A7C15ULL;
+
+	pthread_mutex_lock(&sample_lock);
+	if (sample_set_count < SAMPLE_SET_MAX) {
+		for (i = hash >> (64 - SAMPLE_SET_BITS); sample_set[i] != 0;
+			 i = (i + 1) & (SAMPLE_SET_SLOTS - 1)) {
+		}
+		sample_set[i] = (uintptr_t)ptr;
+		sample_set_count++;
+		__atomic_add_fetch(&sample_filter[hash >> (64 - SAMPLE_FILTER_BITS)],
+						   1, __ATOMIC_RELAXED);
+		sampled = 1;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	// a full set drops the sample, its free could not be recognized.
+	// stat_server reports how many were lost
+	if (!sampled && (counter_seg != NULL)) {
+		__atomic_fetch_add(&counter_seg->dropped_samples, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counter_seg->dropped_sample_bytes, size,
+						   __ATOMIC_RELAXED);
+	}
+	return sampled;
+}
+
+// returns 1 if ptr was sampled, i.e. its free must be reported
+int sample_free(void *ptr)
+{
+	uint64_t hash = (uintptr_t)ptr * 0x9E3779B97F4A7C15ULL;
+	uint16_t *filter = &sample_filter[hash >> (64 - SAMPLE_FILTER_BITS)];
+	uint32_t i, j, k;
+	int 	 found = 0;
+
+	if ((sample_filter == NULL) ||
+		(__atomic_load_n(filter, __ATOMIC_RELAXED) == 0)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&sample_lock);
+	for (i = hash >> (64 - SAMPLE_SET_BITS); sample_set[i] != 0;
+		 i = (i + 1) & (SAMPLE_SET_SLOTS - 1)) {
+		if (sample_set[i] == (uintptr_t)ptr) {
+			found = 1;
+			break;
+		}
+	}
+	if (found) {
+		// backward shift delete, see ptr_table.h
+		j = i;
+		while (1) {
+			j = (j + 1) & (SAMPLE_SET_SLOTS - 1);
+			if (sample_set[j] == 0) {
+				break;
+			}
+			k = (sample_set[j] * 0x9E3779B97F4A7C15ULL) >> (64 - SAMPLE_SET_BITS);
+			if (((j > i) && ((k <= i) || (k > j))) ||
+				((j < i) && ((k <= i) && (k > j)))) {
+				sample_set[i] = sample_set[j];
+				i = j;
+			}
+		}
+		sample_set[i] = 0;
+		sample_set_count--;
+		__atomic_sub_fetch(filter, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	return found;
+}
+
+// exponentially distributed with mean sample_interval
+int64_t sample_next_interval(void)
+{
+	double u;
+
+	// xorshift64*
+	sample_rng ^= sample_rng >> 12;
+	sample_rng ^= sample_rng << 25;
+	sample_rng ^= sample_rng >> 27;
+	u = ((sample_rng * 0x2545F4914F6CDD1DULL >> 11) + 1) * 0x1p-53; // (0, 1]
+
+	return (int64_t)(-log(u) * sample_interval) + 1;
+}
+
+void sample_init(void)
+{
+	const char *env = getenv("STAT_MALLOC_SAMPLE");
+	void 		*mem;
+
+	if ((env == NULL) || (strtoull(env, NULL, 10) == 0)) {
+		return;
+	}
+
+	mem = mmap(NULL, (sizeof(uint16_t) << SAMPLE_FILTER_BITS) +
+			   SAMPLE_SET_SLOTS * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return;
+	}
+	sample_set 	  = (uintptr_t *)mem;
+	sample_filter = (uint16_t *)(sample_set + SAMPLE_SET_SLOTS);
+
+	// events carry the interval as 32 bits
+	sample_interval = strtoull(env, NULL, 10);
+	if (sample_interval > UINT32_MAX) {
+		sample_interval = UINT32_MAX;
+	}
+	pthread_atfork(NULL, NULL, sample_atfork_child);
+}
+
+// the child's copy of the set is still valid, only the lock may be stale
+void sample_atfork_child(void)
+{
+	pthread_mutex_init(&sample_lock, NULL);
+}
+
+// also the pthread_atfork() child handler, the child is a new process
+void process_ident_init(void)
+{
+	client_pid = getpid();
+	client_gen = (uint32_t)coarse_time_ns() ^ (uint32_t)(uintptr_t)&client_gen;
+	thread_tid = 0; // the forking thread has a new tid in the child
+}
+
+// must be called with in_hook set
+void counter_update(size_t size, int is_free)
+{
+	counter_slab_t *slab = thread_slab;
+	uint32_t 	   bin = size_to_bin(size);
+	uint64_t 	   *count, *bytes, *bin_count;
+
+	if (slab == NULL) {
+		slab = thread_slab = counter_slab_claim();
+	}
+	if (slab == COUNTER_UNAVAILABLE) {
+		return;
+	}
+
+	if (is_free) {
+		count 	  = &slab->frees;
+		bytes 	  = &slab->freed_bytes;
+		bin_count = &slab->bin_frees[bin];
+	} else {
+		count 	  = &slab->allocations;
+		bytes 	  = &slab->allocated_bytes;
+		bin_count = &slab->bin_allocations[bin];
+	}
+
+	if (slab == &counter_seg->slabs[0]) {
+		__atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(bytes, size, __ATOMIC_RELAXED);
+		__atomic_fetch_add(bin_count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	// our own slab, stat_server only reads it, so no locked instructions
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(bytes, *bytes + size, __ATOMIC_RELAXED);
+	__atomic_store_n(bin_count, *bin_count + 1, __ATOMIC_RELAXED);
+}
+
+// claim a free slab for the calling thread, slab 0 if there is none
+counter_slab_t *counter_slab_claim(void)
+{
+	uint32_t 		expected, used;
+	counter_slab_t	*slab;
+
+	if (counter_seg == NULL) {
+		return COUNTER_UNAVAILABLE;
+	}
+
+	for (int i = 1; i < COUNTER_SLABS; i++) {
+		slab = &counter_seg->slabs[i];
+		expected = COUNTER_SLAB_FREE;
+		if (!__atomic_compare_exchange_n(&slab->state, &expected,
+										 COUNTER_SLAB_OWNED, 0,
+										 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		slab->tid = syscall(SYS_gettid);
+
+		// let stat_server know how far to scan
+		used = __atomic_load_n(&counter_seg->num_slabs_used, __ATOMIC_RELAXED);
+		while ((used < (uint32_t)i + 1) &&
+			   !__atomic_compare_exchange_n(&counter_seg->num_slabs_used,
+											&used, i + 1, 0, __ATOMIC_RELEASE,
+											__ATOMIC_RELAXED)) {
+		}
+
+		// counter_slab_release() runs at thread exit
+		pthread_setspecific(counter_key, slab);
+		return slab;
+	}
+
+	return &counter_seg->slabs[0];
+}
+
+/*
+ * thread exit: the counts stay, the next thread to claim the slab adds to
+ * them. frees in later destructors go to the shared slab.
+ */
+void counter_slab_release(void *slab)
+{
+	thread_slab = &counter_seg->slabs[0];
+	__atomic_store_n(&((counter_slab_t *)slab)->state, COUNTER_SLAB_FREE,
+					 __ATOMIC_RELEASE);
+}
+
+/*
+ * creates this process's counter segment. a fork child starts out with a
+ * copy of its parent's heap, so it also starts with its parent's totals.
+ */
+void counter_seg_create(const counter_seg_t *parent)
+{
+	char 			name[64];
+	int 			fd;
+	counter_seg_t 	*seg;
+	counter_slab_t 	*total;
+	const counter_slab_t *slab;
+
+	snprintf(name, sizeof(name), COUNTER_SEG_NAME_FORMAT, client_pid);
+
+	// a leftover segment belongs to our image before exec or to a dead
+	// process that had our pid
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, RING_SEG_PERMISSIONS);
+	if (fd == -1) {
+		return;
+	}
+
+	// new pages are zero, so all slabs start out free and empty
+	if (ftruncate(fd, sizeof(counter_seg_t)) == -1) {
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+
+	seg = mmap(NULL, sizeof(counter_seg_t), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		shm_unlink(name);
+		return;
+	}
+
+	if (parent != NULL) {
+		total = &seg->slabs[0];
+		for (uint32_t i = 0; i < parent->num_slabs_used; i++) {
+			slab = &parent->slabs[i];
+			total->allocations 	   += slab->allocations;
+			total->frees 		   += slab->frees;
+			total->allocated_bytes += slab->allocated_bytes;
+			total->freed_bytes 	   += slab->freed_bytes;
+			for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+				total->bin_allocations[bin] += slab->bin_allocations[bin];
+				total->bin_frees[bin] 		+= slab->bin_frees[bin];
+			}
+		}
+	}
+
+	seg->pid 			= client_pid;
+	seg->gen 			= client_gen;
+	seg->num_slabs_used = 1;
+	if (transport != TRANSPORT_COUNTERS) {
+		seg->mode = COUNTER_SEG_EVENTS;
+	} else if ((parent != NULL) && (parent->mode == COUNTER_SEG_DEGRADED)) {
+		seg->mode = COUNTER_SEG_DEGRADED;
+	} else {
+		seg->mode = COUNTER_SEG_COUNTING;
+	}
+	__atomic_store_n(&seg->magic, COUNTER_SEG_MAGIC, __ATOMIC_RELEASE);
+	counter_seg = seg;
+}
+
+// the child must not count into its parent's slabs
+void counter_atfork_child(void)
+{
+	counter_seg_t *parent = counter_seg;
+
+	counter_seg = NULL;
+	// same for the slab the key holds, it is in the parent's segment
+	thread_slab = NULL;
+	pthread_setspecific(counter_key, NULL);
+	counter_seg_create(parent);
+	if (parent != NULL) {
+		munmap(parent, sizeof(counter_seg_t));
+	}
+}
+
+/*
+ * on exit with no stat_server to reclaim them, removes this process's
+ * segments from /dev/shm. a server that is up unlinks them itself once it
+ * has read their last counts.
+ */
+void segs_unlink(void)
+{
+	char name[64];
+
+	if (server_present()) {
+		return;
+	}
+	if (ring_seg != NULL) {
+		snprintf(name, sizeof(name), RING_SEG_NAME_FORMAT, client_pid);
+		shm_unlink(name);
+	}
+	if (counter_seg != NULL) {
+		snprintf(name, sizeof(name), COUNTER_SEG_NAME_FORMAT, client_pid);
+		shm_unlink(name);
+	}
+}
+
+/*
+ * malloc() through the small object cache. a hit takes a block off the
+ * thread's free list or its current slab, with no locks and no atomics
+ * but the count.
+ */
+void *cache_malloc(size_t size)
+{
+	cache_thread_t *cache = &thread_cache;
+	uint32_t 		bin;
+	void 			*ptr;
+
+	if ((size >= (1 << CACHE_MAX_BITS)) || (cache_bytes == 0) ||
+		(cache->state == CACHE_THREAD_EXITED)) {
+		return __libc_malloc(size);
+	}
+
+	bin = size_to_bin(size);
+	if ((ptr = cache->head[bin]) != NULL) {
+		cache->head[bin] = *(void **)ptr;
+		cache->count[bin]--;
+		cache_count(bin, 1);
+		return ptr;
+	}
+	if (cache->carve[bin] < cache->carve_end[bin]) {
+		ptr = (void *)cache->carve[bin];
+		cache->carve[bin] += cache_block_size(bin);
+		cache_count(bin, 1);
+		return ptr;
+	}
+
+	cache_count(bin, 0);
+	if (!cache_refill(bin)) {
+		// region used up
+		return __libc_malloc(size);
+	}
+	if ((ptr = cache->head[bin]) != NULL) {
+		cache->head[bin] = *(void **)ptr;
+		cache->count[bin]--;
+	} else {
+		ptr = (void *)cache->carve[bin];
+		cache->carve[bin] += cache_block_size(bin);
+	}
+	return ptr;
+}
+
+void *cache_calloc(size_t nmemb, size_t size)
+{
+	size_t 	bytes;
+	void 	*ptr;
+
+	if ((cache_bytes == 0) || __builtin_mul_overflow(nmemb, size, &bytes) ||
+		(bytes >= (1 << CACHE_MAX_BITS))) {
+		return __libc_calloc(nmemb, size);
+	}
+	if ((ptr = cache_malloc(bytes)) != NULL) {
+		memset(ptr, 0, bytes);
+	}
+	return ptr;
+}
+
+// a cached block stays put while the new size fits in it
+void *cache_realloc(void *ptr, size_t size)
+{
+	size_t 	old_size;
+	void 	*new_ptr;
+
+	if (ptr == NULL) {
+		return cache_malloc(size);
+	}
+	if (!cache_owns(ptr)) {
+		return __libc_realloc(ptr, size);
+	}
+	if (size == 0) {
+		cache_free(ptr);
+		return NULL;
+	}
+
+	old_size = cache_usable_size(ptr);
+	if (size <= old_size) {
+		return ptr;
+	}
+	if ((new_ptr = cache_malloc(size)) != NULL) {
+		memcpy(new_ptr, ptr, old_size);
+		cache_free(ptr);
+	}
+	return new_ptr;
+}
+
+void cache_free(void *ptr)
+{
+	cache_thread_t *cache = &thread_cache;
+	uint32_t 		bin;
+
+	if (!cache_owns(ptr)) {
+		__libc_free(ptr);
+		return;
+	}
+
+	bin = cache_slab_bin[((uintptr_t)ptr - cache_base) >> CACHE_SLAB_SHIFT];
+	*(void **)ptr = NULL;
+	if (cache->state != CACHE_THREAD_REGISTERED) {
+		// not a cache user yet, or past its exit
+		cache_give_back(&ptr, NULL, bin, 1);
+		return;
+	}
+
+	*(void **)ptr = cache->head[bin];
+	cache->head[bin] = ptr;
+	if (++cache->count[bin] > CACHE_THREAD_MAX) {
+		// a consumer thread, let producers have them back
+		cache_give_back(&cache->head[bin], &cache->count[bin], bin,
+						CACHE_BATCH);
+	}
+}
+
+size_t cache_usable_size(void *ptr)
+{
+	if (cache_owns(ptr)) {
+		return cache_block_size(cache_slab_bin[((uintptr_t)ptr - cache_base) >>
+											   CACHE_SLAB_SHIFT]);
+	}
+	return libc_usable_size(ptr);
+}
+
+// glibc's, which ours hides
+size_t libc_usable_size(void *ptr)
+{
+	size_t 	(*next)(void *);
+	int 	saved_in_hook;
+
+	if (ptr == NULL) {
+		return 0;
+	}
+	if ((next = __atomic_load_n(&libc_usable_size_fn,
+								__ATOMIC_RELAXED)) == NULL) {
+		// dlsym() may allocate
+		saved_in_hook = in_hook;
+		in_hook = 1;
+		next = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+		in_hook = saved_in_hook;
+		__atomic_store_n(&libc_usable_size_fn, next, __ATOMIC_RELAXED);
+	}
+	return next(ptr);
+}
+
+/*
+ * a batch of free blocks from the shared list, or else a new slab to
+ * carve. 0 once the region is used up.
+ */
+int cache_refill(uint32_t bin)
+{
+	cache_thread_t *cache = &thread_cache;
+	uint32_t 		slab;
+	void 			*ptr;
+
+	if (cache->state == CACHE_THREAD_UNREGISTERED) {
+		// cache_thread_exit() hands the lists back
+		cache->state = CACHE_THREAD_REGISTERED;
+		pthread_setspecific(cache_key, cache);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	while ((cache->count[bin] < CACHE_BATCH) &&
+		   ((ptr = cache_shared_head[bin]) != NULL)) {
+		cache_shared_head[bin] = *(void **)ptr;
+		cache_shared_count[bin]--;
+		*(void **)ptr = cache->head[bin];
+		cache->head[bin] = ptr;
+		cache->count[bin]++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (cache->count[bin]) {
+		return 1;
+	}
+
+	slab = __atomic_fetch_add(&cache_next_slab, 1, __ATOMIC_RELAXED);
+	if (slab >= CACHE_NUM_SLABS) {
+		__atomic_store_n(&cache_next_slab, CACHE_NUM_SLABS, __ATOMIC_RELAXED);
+		return 0;
+	}
+	cache_slab_bin[slab] = bin;
+	cache->carve[bin] = cache_base + ((uintptr_t)slab << CACHE_SLAB_SHIFT);
+	// whole blocks only
+	cache->carve_end[bin] = cache->carve[bin] +
+		((1 << CACHE_SLAB_SHIFT) / cache_block_size(bin) - 1) *
+		cache_block_size(bin) + 1;
+
+	return 1;
+}
+
+// move up to num_blocks off a list onto the shared list for the bin
+void cache_give_back(void **head, uint32_t *count, uint32_t bin,
+					 uint32_t num_blocks)
+{
+	void *ptr;
+
+	pthread_mutex_lock(&cache_lock);
+	while (num_blocks-- && ((ptr = *head) != NULL)) {
+		*head = *(void **)ptr;
+		if (count != NULL) {
+			(*count)--;
+		}
+		*(void **)ptr = cache_shared_head[bin];
+		cache_shared_head[bin] = ptr;
+		cache_shared_count[bin]++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// in the thread's counter slab, like counter_update()
+void cache_count(uint32_t bin, int hit)
+{
+	counter_slab_t *slab = thread_slab;
+	uint64_t 	   *count;
+
+	if (slab == NULL) {
+		slab = thread_slab = counter_slab_claim();
+	}
+	if (slab == COUNTER_UNAVAILABLE) {
+		return;
+	}
+
+	count = hit ? &slab->cache_hits[bin] : &slab->cache_misses[bin];
+	if (slab == &counter_seg->slabs[0]) {
+		__atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * thread exit: its free blocks go to the shared lists. the rest of its
+ * current slabs is not carved by anyone again.
+ */
+void cache_thread_exit(void *arg)
+{
+	cache_thread_t *cache = (cache_thread_t *)arg;
+
+	for (uint32_t bin = 0; bin < NUM_CACHE_BINS; bin++) {
+		cache_give_back(&cache->head[bin], &cache->count[bin], bin,
+						cache->count[bin]);
+		cache->carve[bin] = cache->carve_end[bin] = 0;
+	}
+	cache->state = CACHE_THREAD_EXITED;
+}
+
+// the shared lists must not be copied mid update
+void cache_atfork_prepare(void)
+{
+	pthread_mutex_lock(&cache_lock);
+}
+
+void cache_atfork_parent(void)
+{
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// the other threads' free blocks are lost to the child
+void cache_atfork_child(void)
+{
+	pthread_mutex_init(&cache_lock, NULL);
+}
+
+void cache_init(void)
+{
+	void *region;
+
+	if (pthread_key_create(&cache_key, cache_thread_exit) != 0) {
+		return;
+	}
+	region = mmap(NULL, CACHE_REGION_BYTES, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED) {
+		return;
+	}
+	pthread_atfork(cache_atfork_prepare, cache_atfork_parent,
+				   cache_atfork_child);
+	cache_base 	= (uintptr_t)region;
+	cache_bytes = CACHE_REGION_BYTES;
+}
+
+void client_init(void)
+{
+	const char *env;
+
+	in_hook = 1;
+
+	// must be the first atfork handler, the others send events
+	process_ident_init();
+	pthread_atfork(NULL, NULL, process_ident_init);
+
+	server_seg_open();
+	msgq_open();
+	sample_init();
+	next_symbols_init();
+
+	if ((env = getenv("STAT_MALLOC_BATCH")) != NULL) {
+		batch_size = atoi(env);
+		if (batch_size > MSG_MAX_EVENTS) {
+			batch_size = MSG_MAX_EVENTS;
+		}
+	}
+	if ((env = getenv("STAT_MALLOC_BATCH_MS")) != NULL) {
+		batch_timeout_ns = strtoull(env, NULL, 10) * 1000000ULL;
+	}
+	if (pthread_key_create(&batch_key, batch_thread_exit) != 0) {
+		batch_size = 1;
+	}
+	pthread_atfork(NULL, NULL, batch_atfork_child);
+
+	if ((env = getenv("STAT_MALLOC_HEAP_INFO_MS")) != NULL) {
+		heap_info_interval_ns = strtoull(env, NULL, 10) * 1000000ULL;
+	}
+
+	if ((env = getenv("STAT_MALLOC_ON_FULL")) != NULL) {
+		if (strcmp(env, "drop") == 0) {
+			on_full = ON_FULL_DROP;
+		} else if (strcmp(env, "counters") == 0) {
+			on_full = ON_FULL_COUNTERS;
+		}
+	}
+
+	env = getenv("STAT_MALLOC_TRANSPORT");
+	if ((env != NULL) && (strcmp(env, "ring") == 0) &&
+		(pthread_key_create(&ring_key, ring_release) == 0)) {
+		pthread_atfork(NULL, NULL, ring_atfork_child);
+		ring_seg_create();
+		transport = TRANSPORT_RING;
+	} else if ((env != NULL) && (strcmp(env, "counters") == 0) &&
+			   (pthread_key_create(&counter_key, counter_slab_release) == 0)) {
+		transport = TRANSPORT_COUNTERS;
+		pthread_atfork(NULL, NULL, counter_atfork_child);
+		counter_seg_create(NULL);
+	}
+
+	if (((env = getenv("STAT_MALLOC_CACHE")) != NULL) && (atoi(env) != 0)) {
+		cache_init();
+	}
+
+	// the counter segment then carries the drop counts and the slabs to
+	// degrade to, the cache hits or the samples lost to a full set
+	if ((transport != TRANSPORT_COUNTERS) &&
+		((on_full != ON_FULL_BLOCK) || cache_bytes || sample_set)) {
+		if (pthread_key_create(&counter_key, counter_slab_release) == 0) {
+			pthread_atfork(NULL, NULL, counter_atfork_child);
+			counter_seg_create(NULL);
+		} else {
+			on_full = ON_FULL_DROP;
+		}
+	}
+
+	in_hook = 0;
+}
+
+// process exit: ship every thread's pending events
+void client_exit(void)
+{
+	in_hook = 1;
+
+	batch_process_exiting = 1;
+	batch_flush_all();
+	segs_unlink();
+
+	in_hook = 0;
+}
+
+/*
+ * exec and _exit() replace or end the process without running destructors,
+ * so the batched events are shipped first, unless in a vfork() child,
+ * whose memory and so batches are its parent's. the execl() forms go
+ * through ours of execv(), execvp() and execve()
+ */
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+	int (*next)(const char *, char *const [], char *const []);
+
+	next = (int (*)(const char *, char *const [], char *const []))
+		next_symbol(NEXT_EXECVE);
+	return next(path, argv, envp);
+}
+
+int execv(const char *path, char *const argv[])
+{
+	int (*next)(const char *, char *const []);
+
+	next = (int (*)(const char *, char *const []))next_symbol(NEXT_EXECV);
+	return next(path, argv);
+}
+
+int execvp(const char *file, char *const argv[])
+{
+	int (*next)(const char *, char *const []);
+
+	next = (int (*)(const char *, char *const []))next_symbol(NEXT_EXECVP);
+	return next(file, argv);
+}
+
+int execvpe(const char *file, char *const argv[], char *const envp[])
+{
+	int (*next)(const char *, char *const [], char *const []);
+
+	next = (int (*)(const char *, char *const [], char *const []))
+		next_symbol(NEXT_EXECVPE);
+	return next(file, argv, envp);
+}
+
+int fexecve(int fd, char *const argv[], char *const envp[])
+{
+	int (*next)(int, char *const [], char *const []);
+
+	next = (int (*)(int, char *const [], char *const []))
+		next_symbol(NEXT_FEXECVE);
+	return next(fd, argv, envp);
+}
+
+// arguments of an execl() form, counting arg and the terminating NULL
+size_t execl_argc(const char *arg, va_list *ap)
+{
+	size_t argc = 1;
+
+	while (arg != NULL) {
+		arg = va_arg(*ap, const char *);
+		argc++;
+	}
+	return argc;
+}
+
+// the same into argv, leaves ap past the NULL
+void execl_argv(const char *arg, va_list *ap, char **argv)
+{
+	size_t i = 0;
+
+	argv[i++] = (char *)arg;
+	while (argv[i - 1] != NULL) {
+		argv[i++] = va_arg(*ap, char *);
+	}
+}
+
+int execl(const char *path, const char *arg, ...)
+{
+	va_list ap;
+	size_t 	argc;
+
+	va_start(ap, arg);
+	argc = execl_argc(arg, &ap);
+	va_end(ap);
+
+	char *argv[argc];
+
+	va_start(ap, arg);
+	execl_argv(arg, &ap, argv);
+	va_end(ap);
+
+	return execv(path, argv);
+}
+
+int execlp(const char *file, const char *arg, ...)
+{
+	va_list ap;
+	size_t 	argc;
+
+	va_start(ap, arg);
+	argc = execl_argc(arg, &ap);
+	va_end(ap);
+
+	char *argv[argc];
+
+	va_start(ap, arg);
+	execl_argv(arg, &ap, argv);
+	va_end(ap);
+
+	return execvp(file, argv);
+}
+
+int execle(const char *path, const char *arg, ...)
+{
+	va_list ap;
+	size_t 	argc;
+	char 	**envp;
+
+	va_start(ap, arg);
+	argc = execl_argc(arg, &ap);
+	va_end(ap);
+
+	char *argv[argc];
+
+	va_start(ap, arg);
+	execl_argv(arg, &ap, argv);
+	envp = va_arg(ap, char **);
+	va_end(ap);
+
+	return execve(path, argv, envp);
+}
+
+void _exit(int status)
+{
+	void (*next)(int);
+
+	next = (void (*)(int))next_symbol(NEXT__EXIT);
+	next(status);
+	for (;;) {
+	}
+}
+
+void _Exit(int status)
+{
+	void (*next)(int);
+
+	next = (void (*)(int))next_symbol(NEXT__EXIT_UPPER);
+	next(status);
+	for (;;) {
+	}
+}
+
+// called with in_hook set, dlsym() may allocate
+void next_symbols_init(void)
+{
+	for (int i = 0; i < NUM_NEXT_SYMBOLS; i++) {
+		next_symbols[i] = dlsym(RTLD_NEXT, next_symbol_names[i]);
+	}
+}
+
+// libc's symbol, once the batched events are shipped
+void *next_symbol(int symbol)
+{
+	int saved_in_hook = in_hook;
+
+	in_hook = 1;
+	// a vfork() child runs no atfork handlers, so still has the parent's pid
+	if (syscall(SYS_getpid) == client_pid) {
+		batch_flush_all();
+		if (symbol >= NEXT__EXIT) {
+			// an exec'd image of ours takes the segments over instead
+			segs_unlink();
+		}
+	}
+	if (next_symbols[symbol] == NULL) {
+		// called from a constructor that ran before ours
+		next_symbols[symbol] = dlsym(RTLD_NEXT, next_symbol_names[symbol]);
+	}
+	in_hook = saved_in_hook;
 
-	return;
+	return next_symbols[symbol];
 }
 
 /*
@@ -0,0 +1,64 @@
+/*******************************************************************************
+ * Filename: size_label.h
+ *
+ * Purpose: labels for the size bins of stat_server.h, shared by stat_server
+ * and the offline tools so their reports name the bins alike.
+ *
+ ******************************************************************************/
+
+#ifndef SIZE_LABEL_H_INCLUDED
+#define SIZE_LABEL_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include "stat_server.h"
+
+// size bins below this are labelled in exact bytes
+#define SIZE_BIN_EXACT_BYTES	8192
+
+// exact size in the largest unit it reaches, "1.25MiB"
+static inline std::string size_bound_string(size_t size)
+{
+	const char *size_units[] = { "bytes", "KiB", "MiB", "GiB", "TiB" };
+	uint32_t 	size_unit_index = 0;
+	double 		value = size;
+	char 		buf[32];
+
+	while ((value >= 1024) &&
+		   (size_unit_index < (sizeof(size_units) / sizeof(size_units[0]) - 1))) {
+		value /= 1024;
+		size_unit_index++;
+	}
+	snprintf(buf, sizeof(buf), "%g%s", value, size_units[size_unit_index]);
+
+	return buf;
+}
+
+// "4 bytes", "64 - 79 bytes", "8KiB - 10KiB" or "1GiB+"
+static inline std::string size_bin_string(uint32_t bin)
+{
+	char buf[64];
+
+	if (bin == NUM_SIZE_BINS - 1) {
+		snprintf(buf, sizeof(buf), "%s+", size_bound_string(size_bin_min(bin)).c_str());
+	} else if (size_bin_min(bin + 1) == size_bin_min(bin) + 1) {
+		// a bin of one size
+		snprintf(buf, sizeof(buf), "%lu byte%s",
+				 (unsigned long)size_bin_min(bin),
+				 (size_bin_min(bin) == 1) ? "" : "s");
+	} else if (size_bin_min(bin + 1) <= SIZE_BIN_EXACT_BYTES) {
+		snprintf(buf, sizeof(buf), "%lu - %lu bytes",
+				 (unsigned long)size_bin_min(bin),
+				 (unsigned long)size_bin_min(bin + 1) - 1);
+	} else {
+		// "1.25MiB - 1.5MiB", up to the next bin
+		snprintf(buf, sizeof(buf), "%s - %s",
+				 size_bound_string(size_bin_min(bin)).c_str(),
+				 size_bound_string(size_bin_min(bin + 1)).c_str());
+	}
+
+	return buf;
+}
+
+#endif // SIZE_LABEL_H_INCLUDED
@@ -0,0 +1,371 @@
+/*******************************************************************************
+ * Filename: stat_heapdiff.cpp
+ *
+ * Purpose: compares two heap dumps written by stat_server on SIGUSR1.
+ *
+ * Prints which processes, size bins and call sites grew from the first
+ * dump to the second, and which allocations survived across both: the
+ * same pointer, size and call site, allocated at the same time. Slow
+ * growth in a long running service shows up as survivors piling up at a
+ * few call sites, dump after dump.
+ *
+ * usage: stat_heapdiff [-n count] [-p pid] before.heap after.heap
+ *
+ ******************************************************************************/
+
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h> // getopt
+#include "stat_server.h"
+#include "size_label.h"
+#include "heap_dump.h"
+
+
+using namespace std;
+
+// survivors may be this far apart in allocation time, the client's coarse
+// clock and the dumps' millisecond ages both round
+#define SURVIVOR_SLACK_MS		1000
+
+// live bytes and count, weighted
+typedef struct {
+	long	bytes;
+	long	count;
+} totals_t;
+
+// before and after
+typedef struct {
+	totals_t	before;
+	totals_t	after;
+	totals_t	survived;
+	uint64_t	oldest_ms;			// age of the oldest survivor, after
+} growth_t;
+
+// identifies an allocation across dumps
+typedef struct {
+	uint64_t	caller;
+	uint64_t	size;
+	int64_t		time_ms;			// realtime of the allocation
+} survivor_key_t;
+
+// by pid and gen, see msg_data_t
+typedef pair<uint32_t, uint32_t> image_t;
+
+map<image_t, growth_t> process_growth;
+growth_t 			   size_growth[NUM_SIZE_BINS];
+map<pair<uint32_t, uint64_t>, growth_t> site_growth;	// by pid and caller
+map<pair<uint32_t, uint64_t>, string> symbols;
+growth_t 			   overall;
+
+void usage(const char *name);
+void add_dump(const heap_dump_t &dump, bool after, uint32_t only_pid,
+			  map<image_t, unordered_map<uint64_t, survivor_key_t> > *before);
+void add_totals(totals_t *totals, const heap_dump_alloc_t &alloc);
+vector<pair<long, pair<uint32_t, uint64_t> > > top_sites(bool survivors,
+														 size_t count);
+const string &site_symbol(uint32_t pid, uint64_t caller);
+string size_string(double size);
+string change_string(long before, long after, bool bytes);
+string time_string(uint64_t realtime_us);
+string duration_string(uint64_t time_us);
+
+int main(int argc, char *argv[])
+{
+	heap_dump_t before, after;
+	map<image_t, unordered_map<uint64_t, survivor_key_t> > before_index;
+	map<image_t, growth_t>::iterator it;
+	vector<pair<long, pair<uint32_t, uint64_t> > > sites;
+	uint32_t 	only_pid = 0;
+	size_t 		count = 10;
+	growth_t 	*growth;
+	int 		opt;
+
+	while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			only_pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (!heap_dump_read(argv[optind + i], i ? &after : &before)) {
+			cerr << argv[optind + i] << ": not a readable stat_malloc heap dump"
+				 << endl;
+			return 1;
+		}
+	}
+	add_dump(before, false, only_pid, &before_index);
+	add_dump(after, true, only_pid, &before_index);
+
+	printf("Heap dumps at %s and %s, %s apart\n",
+		   time_string(before.realtime_us).c_str(),
+		   time_string(after.realtime_us).c_str(),
+		   duration_string((after.realtime_us > before.realtime_us) ?
+						   after.realtime_us - before.realtime_us : 0).c_str());
+	printf("%s in %s allocations\n",
+		   change_string(overall.before.bytes, overall.after.bytes, true).c_str(),
+		   change_string(overall.before.count, overall.after.count,
+						 false).c_str());
+	printf("%s in %ld allocations survived from the first dump\n",
+		   size_string(overall.survived.bytes).c_str(), overall.survived.count);
+	printf("\n\n");
+
+	printf("Processes:\n");
+	for (it = process_growth.begin(); it != process_growth.end(); it++) {
+		growth = &it->second;
+		printf("pid %u: %s in %s allocations", it->first.first,
+			   change_string(growth->before.bytes, growth->after.bytes,
+							 true).c_str(),
+			   change_string(growth->before.count, growth->after.count,
+							 false).c_str());
+		if (growth->before.count == 0) {
+			printf(", new image");
+		} else if (growth->after.count == 0) {
+			printf(", gone");
+		}
+		printf("\n");
+	}
+	printf("\n\n");
+
+	printf("Growth by size:\n");
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		growth = &size_growth[bin];
+		if (growth->after.bytes > growth->before.bytes) {
+			printf("%s: %s in %s allocations\n", size_bin_string(bin).c_str(),
+				   change_string(growth->before.bytes, growth->after.bytes,
+								 true).c_str(),
+				   change_string(growth->before.count, growth->after.count,
+								 false).c_str());
+		}
+	}
+	printf("\n\n");
+
+	sites = top_sites(false, count);
+	printf("Top call sites by growth:\n");
+	for (size_t i = 0; i < sites.size(); i++) {
+		growth = &site_growth[sites[i].second];
+		printf("%s in %s allocations: pid %u %s\n",
+			   change_string(growth->before.bytes, growth->after.bytes,
+							 true).c_str(),
+			   change_string(growth->before.count, growth->after.count,
+							 false).c_str(), sites[i].second.first,
+			   site_symbol(sites[i].second.first,
+						   sites[i].second.second).c_str());
+	}
+	printf("\n\n");
+
+	sites = top_sites(true, count);
+	printf("Top call sites by surviving size:\n");
+	for (size_t i = 0; i < sites.size(); i++) {
+		growth = &site_growth[sites[i].second];
+		printf("%s in %ld allocations, %.0f%% of the site, oldest %s: "
+			   "pid %u %s\n", size_string(growth->survived.bytes).c_str(),
+			   growth->survived.count,
+			   100.0 * growth->survived.bytes / max(growth->after.bytes, 1L),
+			   duration_string(growth->oldest_ms * 1000).c_str(),
+			   sites[i].second.first,
+			   site_symbol(sites[i].second.first,
+						   sites[i].second.second).c_str());
+	}
+
+	return 0;
+}
+
+void usage(const char *name)
+{
+	cerr << "usage: " << name << " [-n count] [-p pid] before.heap after.heap"
+		 << endl;
+	cerr << "  -n  call sites to list, default 10" << endl;
+	cerr << "  -p  only this process" << endl;
+}
+
+/*
+ * adds one dump's allocations to the totals. the first dump's are indexed
+ * by pointer in *before, where the second's look up whether they survived.
+ */
+void add_dump(const heap_dump_t &dump, bool after, uint32_t only_pid,
+			  map<image_t, unordered_map<uint64_t, survivor_key_t> > *before)
+{
+	unordered_map<uint64_t, survivor_key_t> *index;
+	unordered_map<uint64_t, survivor_key_t>::iterator it;
+	survivor_key_t 	key;
+	growth_t 		*growth[4];
+
+	for (size_t i = 0; i < dump.symbols.size(); i++) {
+		symbols[make_pair(dump.symbols[i].pid, dump.symbols[i].caller)] =
+			dump.symbols[i].name;
+	}
+
+	for (size_t i = 0; i < dump.sections.size(); i++) {
+		const heap_dump_section_t &section = dump.sections[i];
+		image_t image(section.process.pid, section.process.gen);
+
+		if (only_pid && (section.process.pid != only_pid)) {
+			continue;
+		}
+		index = &(*before)[image];
+		growth[0] = &overall;
+		growth[1] = &process_growth[image];
+
+		for (size_t a = 0; a < section.allocations.size(); a++) {
+			const heap_dump_alloc_t &alloc = section.allocations[a];
+
+			growth[2] = &size_growth[size_to_bin(alloc.size)];
+			growth[3] = &site_growth[make_pair(section.process.pid,
+											   alloc.caller)];
+			key.caller 	= alloc.caller;
+			key.size 	= alloc.size;
+			key.time_ms = dump.realtime_us / 1000 - alloc.age_ms;
+
+			if (!after) {
+				(*index)[alloc.ptr] = key;
+				for (int g = 0; g < 4; g++) {
+					add_totals(&growth[g]->before, alloc);
+				}
+				continue;
+			}
+
+			for (int g = 0; g < 4; g++) {
+				add_totals(&growth[g]->after, alloc);
+			}
+			if (((it = index->find(alloc.ptr)) == index->end()) ||
+				(it->second.caller != key.caller) ||
+				(it->second.size != key.size) ||
+				(llabs(it->second.time_ms - key.time_ms) > SURVIVOR_SLACK_MS)) {
+				continue;
+			}
+			for (int g = 0; g < 4; g++) {
+				add_totals(&growth[g]->survived, alloc);
+				growth[g]->oldest_ms = max(growth[g]->oldest_ms,
+										   (uint64_t)alloc.age_ms);
+			}
+		}
+	}
+}
+
+void add_totals(totals_t *totals, const heap_dump_alloc_t &alloc)
+{
+	totals->bytes += alloc.size * alloc.weight;
+	totals->count += alloc.weight;
+}
+
+// call sites with the most growth, or the most surviving bytes
+vector<pair<long, pair<uint32_t, uint64_t> > > top_sites(bool survivors,
+														 size_t count)
+{
+	vector<pair<long, pair<uint32_t, uint64_t> > > by_bytes;
+	map<pair<uint32_t, uint64_t>, growth_t>::iterator it;
+	long bytes;
+
+	for (it = site_growth.begin(); it != site_growth.end(); it++) {
+		bytes = survivors ? it->second.survived.bytes :
+			it->second.after.bytes - it->second.before.bytes;
+		if (bytes > 0) {
+			by_bytes.push_back(make_pair(bytes, it->first));
+		}
+	}
+	count = min(by_bytes.size(), count);
+	partial_sort(by_bytes.begin(), by_bytes.begin() + count, by_bytes.end(),
+				 greater<pair<long, pair<uint32_t, uint64_t> > >());
+	by_bytes.resize(count);
+
+	return by_bytes;
+}
+
+// as the dumps recorded it, the raw address if neither did
+const string &site_symbol(uint32_t pid, uint64_t caller)
+{
+	map<pair<uint32_t, uint64_t>, string>::iterator it;
+	char buf[32];
+
+	if ((it = symbols.find(make_pair(pid, caller))) == symbols.end()) {
+		snprintf(buf, sizeof(buf), "0x%lx", (unsigned long)caller);
+		it = symbols.insert(make_pair(make_pair(pid, caller), string(buf))).first;
+	}
+	return it->second;
+}
+
+// size in appropriate units
+string size_string(double size)
+{
+	const char *size_units[] = { "", "KiB", "MiB", "GiB", "TiB" };
+	uint32_t 	size_unit_index = 0;
+	const char 	*sign = (size < 0) ? "-" : "";
+	char 		buf[32];
+
+	size = (size < 0) ? -size : size;
+	while ((size > 1024) &&
+		   (size_unit_index < (sizeof(size_units) / sizeof(size_units[0]) - 1))) {
+		size /= 1024;
+		size_unit_index++;
+	}
+	snprintf(buf, sizeof(buf), "%s%.1f%s", sign, size, size_units[size_unit_index]);
+
+	return buf;
+}
+
+// "1.0MiB -> 3.0MiB (+2.0MiB)" or "100 -> 300 (+200)"
+string change_string(long before, long after, bool bytes)
+{
+	char buf[96];
+
+	if (bytes) {
+		snprintf(buf, sizeof(buf), "%s -> %s (%s%s)", size_string(before).c_str(),
+				 size_string(after).c_str(), (after >= before) ? "+" : "",
+				 size_string(after - before).c_str());
+	} else {
+		snprintf(buf, sizeof(buf), "%ld -> %ld (%+ld)", before, after,
+				 after - before);
+	}
+
+	return buf;
+}
+
+// "2019-09-03 10:11:12"
+string time_string(uint64_t realtime_us)
+{
+	time_t 	  t = realtime_us / 1000000;
+	struct tm tam = *localtime(&t);
+	char 	  buf[64];
+
+	snprintf(buf, sizeof(buf), "%d-%02d-%02d %02d:%02d:%02d",
+			 tam.tm_year + 1900, tam.tm_mon + 1, tam.tm_mday, tam.tm_hour,
+			 tam.tm_min, tam.tm_sec);
+
+	return buf;
+}
+
+// duration in appropriate units
+string duration_string(uint64_t time_us)
+{
+	char buf[32];
+
+	if (time_us < 1000) {
+		snprintf(buf, sizeof(buf), "%luus", (unsigned long)time_us);
+	} else if (time_us < 1000000) {
+		snprintf(buf, sizeof(buf), "%.1fms", time_us / 1000.0);
+	} else {
+		snprintf(buf, sizeof(buf), "%.1fs", time_us / 1000000.0);
+	}
+
+	return buf;
+}
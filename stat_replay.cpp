@@ -0,0 +1,505 @@
+/*******************************************************************************
+ * Filename: stat_replay.cpp
+ *
+ * Purpose: replays the malloc/calloc/realloc/memalign/free calls of one
+ * process from a trace recorded with stat_server -t, to compare allocators
+ * on a real workload. Run it as is for glibc malloc, or with another
+ * allocator in LD_PRELOAD (but not libshared_client.so).
+ *
+ * Every recorded thread gets a replay thread. Pointers are turned into slot
+ * numbers while the trace is loaded, so the replay itself does no lookups.
+ * A free of memory another thread allocates waits until that allocation
+ * has been replayed. With -T, calls are also spaced out as recorded.
+ *
+ * usage: stat_replay [-p pid] [-T] [-s speed] trace_file
+ *
+ ******************************************************************************/
+
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h> // memalign
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // getopt, sysconf
+#include <fcntl.h> // open
+#include <pthread.h>
+#include <sched.h> // sched_yield
+#include "stat_server.h"
+#include "trace.h"
+
+
+using namespace std;
+
+#define REPLAY_MALLOC			0
+#define REPLAY_CALLOC			1
+#define REPLAY_REALLOC			2
+#define REPLAY_FREE				3
+#define REPLAY_MEMALIGN			4
+#define NUM_REPLAY_KINDS		5
+
+#define NO_SLOT					UINT32_MAX
+#define FAILED_PTR				((void *)-1)	// slot of a failed allocation
+
+#define RSS_SAMPLE_US			1000
+
+typedef struct {
+	uint64_t	time_us;		// since the first call of the process
+	uint64_t	size;
+	uint32_t	slot;			// allocated, or freed for REPLAY_FREE
+	uint32_t	old_slot;		// REPLAY_REALLOC, NO_SLOT for realloc(NULL)
+	uint8_t		kind;			// REPLAY_*
+	uint8_t		align_shift;	// REPLAY_MEMALIGN
+} replay_op_t;
+
+typedef struct {
+	uint32_t			tid;
+	vector<replay_op_t>	ops;
+	vector<uint32_t>	latency_ns[NUM_REPLAY_KINDS];
+	pthread_t			thread;
+} replay_thread_t;
+
+// per thread, in recorded order
+vector<replay_thread_t *> threads;
+
+// replayed pointer of every allocation, published once it exists
+void 	 **slots = NULL;
+uint32_t num_slots = 0;
+
+// requested bytes live in trace order
+uint64_t peak_live_bytes = 0;
+uint64_t end_live_bytes  = 0;
+
+bool 	 honor_timing = false;
+double 	 speed = 1.0;
+timespec replay_start;
+pthread_barrier_t start_barrier;
+
+volatile bool replay_done = false;
+long 	 peak_rss_pages = 0;
+
+void usage(const char *name);
+bool load_trace(const char *path, pid_t pid);
+void *replay_thread(void *arg);
+void *wait_slot(uint32_t slot);
+void touch(void *ptr, size_t size);
+uint64_t elapsed_ns(const timespec &start);
+void *rss_monitor(void *arg);
+long rss_pages(int fd);
+void print_latencies(void);
+
+int main(int argc, char *argv[])
+{
+	pthread_t rss_thread;
+	timespec  start;
+	uint64_t  wall_ns;
+	long 	  base_rss_pages, end_rss_pages, page_size;
+	pid_t 	  pid = 0;
+	int 	  opt, fd;
+
+	while ((opt = getopt(argc, argv, "p:Ts:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'T':
+			honor_timing = true;
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			if (speed <= 0) {
+				speed = 1.0;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!load_trace(argv[optind], pid)) {
+		return 1;
+	}
+
+	slots = (void **)calloc(num_slots + 1, sizeof(void *));
+	page_size = sysconf(_SC_PAGESIZE);
+	fd = open("/proc/self/statm", O_RDONLY);
+	base_rss_pages = peak_rss_pages = rss_pages(fd);
+	pthread_create(&rss_thread, NULL, rss_monitor, &fd);
+
+	// threads start together so none gets a head start on the others
+	pthread_barrier_init(&start_barrier, NULL, threads.size() + 1);
+	for (size_t i = 0; i < threads.size(); i++) {
+		pthread_create(&threads[i]->thread, NULL, replay_thread, threads[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	start = replay_start;
+	pthread_barrier_wait(&start_barrier);
+	for (size_t i = 0; i < threads.size(); i++) {
+		pthread_join(threads[i]->thread, NULL);
+	}
+	wall_ns = elapsed_ns(start);
+
+	replay_done = true;
+	pthread_join(rss_thread, NULL);
+	end_rss_pages = rss_pages(fd);
+	close(fd);
+
+	printf("wall time: %.3f s\n", wall_ns / 1e9);
+	print_latencies();
+	printf("\n");
+	printf("RSS before replay: %.1f MiB\n",
+		   base_rss_pages * page_size / 1048576.0);
+	printf("RSS peak: %.1f MiB, +%.1f MiB\n",
+		   peak_rss_pages * page_size / 1048576.0,
+		   (peak_rss_pages - base_rss_pages) * page_size / 1048576.0);
+	printf("RSS at end: %.1f MiB, +%.1f MiB\n",
+		   end_rss_pages * page_size / 1048576.0,
+		   (end_rss_pages - base_rss_pages) * page_size / 1048576.0);
+	printf("requested bytes live: peak %.1f MiB, at end %.1f MiB\n",
+		   peak_live_bytes / 1048576.0, end_live_bytes / 1048576.0);
+	if (peak_live_bytes > 0) {
+		// what the allocator needed beyond what was asked for
+		printf("fragmentation at peak: %.2fx RSS growth per requested byte\n",
+			   (double)(peak_rss_pages - base_rss_pages) * page_size /
+			   peak_live_bytes);
+	}
+
+	return 0;
+}
+
+void usage(const char *name)
+{
+	cerr << "usage: " << name << " [-p pid] [-T] [-s speed] trace_file" << endl;
+	cerr << "  -p  process to replay, default the one with the most events"
+		 << endl;
+	cerr << "  -T  keep the recorded time between calls" << endl;
+	cerr << "  -s  with -T, replay this many times faster" << endl;
+}
+
+/*
+ * turns the calls of one process image into per-thread op lists. the
+ * free and allocation halves of a moved realloc() are merged back into one
+ * op, frees of memory allocated before the trace started are dropped.
+ * records of different threads are in the order received, the calls are
+ * put back in the order they happened first, see trace_event_ns(), so a
+ * free pairs with the allocation it freed and not a later one at its
+ * address.
+ */
+bool load_trace(const char *path, pid_t pid)
+{
+	trace_reader  reader;
+	trace_event_t event;
+	vector<trace_event_t> events;
+	map<pair<uint32_t, uint32_t>, uint64_t> num_events;	// by pid, gen
+	map<pair<uint32_t, uint32_t>, uint64_t>::iterator it;
+	pair<uint32_t, uint32_t> image(0, 0);
+	unordered_map<uint64_t, pair<uint32_t, uint64_t> > live;	// slot, size
+	unordered_map<uint64_t, pair<uint32_t, uint64_t> >::iterator lit;
+	unordered_map<uint32_t, replay_thread_t *> by_tid;
+	unordered_map<uint32_t, replay_op_t> pending;	// realloc's free half
+	unordered_map<uint32_t, replay_op_t>::iterator pit;
+	replay_thread_t *thread;
+	replay_op_t op;
+	uint64_t 	live_bytes = 0, first_us = 0, best = 0;
+	uint32_t 	old_slot;
+	bool 		started = false, sampled = false;
+
+	// first pass picks the process image
+	if (!reader.open(path)) {
+		cerr << path << ": not a readable stat_malloc trace" << endl;
+		return false;
+	}
+	while (reader.next(&event)) {
+		if ((event.op != TRACE_OP_EXIT) &&
+			((pid == 0) || (event.pid == (uint32_t)pid))) {
+			num_events[make_pair(event.pid, event.gen)]++;
+		}
+	}
+	for (it = num_events.begin(); it != num_events.end(); it++) {
+		if (it->second > best) {
+			best  = it->second;
+			image = it->first;
+		}
+	}
+	if (best == 0) {
+		cerr << path << ": no events to replay" << endl;
+		return false;
+	}
+	reader.close();
+
+	reader.open(path);
+	events.reserve(best);
+	while (reader.next(&event)) {
+		if ((event.pid == image.first) && (event.gen == image.second) &&
+			(event.op != TRACE_OP_EXIT)) {
+			events.push_back(event);
+		}
+	}
+	reader.close();
+
+	// stable, a thread's own calls are already in order
+	stable_sort(events.begin(), events.end(),
+				[](const trace_event_t &a, const trace_event_t &b) {
+					return trace_event_ns(a.time_us, a.seq) <
+						trace_event_ns(b.time_us, b.seq);
+				});
+
+	for (size_t i = 0; i < events.size(); i++) {
+		event = events[i];
+		if (!started) {
+			first_us = event.time_us;
+			started  = true;
+		}
+		sampled |= (event.sample_interval != 0);
+
+		if ((thread = by_tid[event.tid]) == NULL) {
+			thread = by_tid[event.tid] = new replay_thread_t();
+			thread->tid = event.tid;
+			threads.push_back(thread);
+		}
+
+		// the free half of a moved realloc() waits for its allocation half,
+		// anything else in between means it was realloc(p, 0)
+		old_slot = NO_SLOT;
+		if ((pit = pending.find(event.tid)) != pending.end()) {
+			if ((event.op == MSG_OP_ALLOC) && (event.call == MSG_CALL_REALLOC)) {
+				old_slot = pit->second.slot;
+			} else {
+				thread->ops.push_back(pit->second);
+			}
+			pending.erase(pit);
+		}
+
+		memset(&op, 0, sizeof(op));
+		// coarse, it can be a little behind the order sorted by
+		op.time_us  = (event.time_us > first_us) ? event.time_us - first_us : 0;
+		op.old_slot = NO_SLOT;
+
+		if (event.op == MSG_OP_ALLOC) {
+			if (event.call == MSG_CALL_REALLOC) {
+				op.kind 	= REPLAY_REALLOC;
+				op.old_slot = old_slot;
+			} else if (event.call == MSG_CALL_CALLOC) {
+				op.kind = REPLAY_CALLOC;
+			} else if (event.call == MSG_CALL_MEMALIGN) {
+				op.kind 		= REPLAY_MEMALIGN;
+				op.align_shift 	= event.align_shift;
+			} else {
+				op.kind = REPLAY_MALLOC;
+			}
+			op.size = event.size;
+			op.slot = ++num_slots;
+			thread->ops.push_back(op);
+			if (event.ptr == 0) {
+				// failed when recorded, replayed but never live
+				continue;
+			}
+			if ((lit = live.find(event.ptr)) != live.end()) {
+				// its free was never recorded
+				live_bytes -= lit->second.second;
+			}
+			live[event.ptr] = make_pair(op.slot, event.size);
+			live_bytes += event.size;
+			peak_live_bytes = max(peak_live_bytes, live_bytes);
+		} else if (event.op == MSG_OP_FREE) {
+			if ((lit = live.find(event.ptr)) == live.end()) {
+				continue;
+			}
+			op.kind = REPLAY_FREE;
+			op.slot = lit->second.first;
+			live_bytes -= lit->second.second;
+			live.erase(lit);
+			if (event.call == MSG_CALL_REALLOC) {
+				// wait for the allocation half
+				pending[event.tid] = op;
+			} else {
+				thread->ops.push_back(op);
+			}
+		}
+	}
+	for (pit = pending.begin(); pit != pending.end(); pit++) {
+		by_tid[pit->first]->ops.push_back(pit->second);
+	}
+	end_live_bytes = live_bytes;
+
+	printf("replaying pid %u: %lu events in %lu threads, %u allocations\n",
+		   image.first, (unsigned long)best, (unsigned long)threads.size(),
+		   num_slots);
+	if (sampled) {
+		printf("warning: trace is sampled, only sampled calls are replayed\n");
+	}
+
+	return true;
+}
+
+void *replay_thread(void *arg)
+{
+	replay_thread_t *thread = (replay_thread_t *)arg;
+	replay_op_t 	*op;
+	timespec 		start, due;
+	uint64_t 		due_ns;
+	void 			*ptr, *old_ptr;
+
+	for (int i = 0; i < NUM_REPLAY_KINDS; i++) {
+		thread->latency_ns[i].reserve(thread->ops.size());
+	}
+	pthread_barrier_wait(&start_barrier);
+
+	for (size_t i = 0; i < thread->ops.size(); i++) {
+		op = &thread->ops[i];
+
+		if (honor_timing) {
+			due_ns = replay_start.tv_nsec + (uint64_t)(op->time_us * 1000 / speed);
+			due.tv_sec 	= replay_start.tv_sec + due_ns / 1000000000;
+			due.tv_nsec = due_ns % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		}
+
+		switch (op->kind) {
+		case REPLAY_MALLOC:
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ptr = malloc(op->size);
+			thread->latency_ns[op->kind].push_back(elapsed_ns(start));
+			break;
+		case REPLAY_CALLOC:
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ptr = calloc(1, op->size);
+			thread->latency_ns[op->kind].push_back(elapsed_ns(start));
+			break;
+		case REPLAY_MEMALIGN:
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ptr = memalign((size_t)1 << op->align_shift, op->size);
+			thread->latency_ns[op->kind].push_back(elapsed_ns(start));
+			break;
+		case REPLAY_REALLOC:
+			old_ptr = (op->old_slot == NO_SLOT) ? NULL : wait_slot(op->old_slot);
+			if (old_ptr == FAILED_PTR) {
+				old_ptr = NULL;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ptr = realloc(old_ptr, op->size);
+			thread->latency_ns[op->kind].push_back(elapsed_ns(start));
+			break;
+		case REPLAY_FREE:
+			ptr = wait_slot(op->slot);
+			if (ptr != FAILED_PTR) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				free(ptr);
+				thread->latency_ns[op->kind].push_back(elapsed_ns(start));
+			}
+			continue;
+		default:
+			continue;
+		}
+
+		if (ptr == NULL) {
+			ptr = FAILED_PTR;
+		} else {
+			// the program would have used the memory
+			touch(ptr, op->size);
+		}
+		__atomic_store_n(&slots[op->slot], ptr, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+// the allocation may belong to another thread that is not there yet
+void *wait_slot(uint32_t slot)
+{
+	void *ptr;
+
+	while ((ptr = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE)) == NULL) {
+		sched_yield();
+	}
+
+	return ptr;
+}
+
+// one write per page, enough to make it resident
+void touch(void *ptr, size_t size)
+{
+	for (size_t offset = 0; offset < size; offset += 4096) {
+		((volatile char *)ptr)[offset] = 0;
+	}
+}
+
+uint64_t elapsed_ns(const timespec &start)
+{
+	timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000000000ULL +
+		now.tv_nsec - start.tv_nsec;
+}
+
+// peak resident set while the replay runs
+void *rss_monitor(void *arg)
+{
+	int fd = *(int *)arg;
+
+	while (!replay_done) {
+		peak_rss_pages = max(peak_rss_pages, rss_pages(fd));
+		usleep(RSS_SAMPLE_US);
+	}
+
+	return NULL;
+}
+
+long rss_pages(int fd)
+{
+	char buf[128];
+	long size, resident;
+	ssize_t len;
+
+	if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+		return 0;
+	}
+	buf[len] = '\0';
+	if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+		return 0;
+	}
+
+	return resident;
+}
+
+void print_latencies(void)
+{
+	const char *names[NUM_REPLAY_KINDS] = { "malloc", "calloc", "realloc",
+											"free", "memalign" };
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	vector<uint32_t> all;
+	size_t 			 n;
+
+	printf("%-8s %10s %8s %8s %8s %8s %8s  (ns)\n", "call", "count", "p50",
+		   "p90", "p99", "p99.9", "max");
+	for (int kind = 0; kind < NUM_REPLAY_KINDS; kind++) {
+		all.clear();
+		for (size_t i = 0; i < threads.size(); i++) {
+			all.insert(all.end(), threads[i]->latency_ns[kind].begin(),
+					   threads[i]->latency_ns[kind].end());
+		}
+		if (all.empty()) {
+			continue;
+		}
+
+		printf("%-8s %10lu", names[kind], (unsigned long)all.size());
+		for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]);
+			 p++) {
+			n = min((size_t)(percentiles[p] * all.size()), all.size() - 1);
+			nth_element(all.begin(), all.begin() + n, all.end());
+			printf(" %8u", all[n]);
+		}
+		printf(" %8u\n", *max_element(all.begin(), all.end()));
+	}
+}
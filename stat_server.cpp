@@ -16,13 +16,36 @@ using namespace std;
 
 #include <iostream>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
 #include <time.h> // localtime(), time_t
 #include <sys/time.h> //  gettimeofday(), timeval
 #include <sys/types.h> // fork
 #include <unistd.h> // fork
+#include <string.h>
+#include <limits.h> // PATH_MAX
+#include <errno.h>
+#include <signal.h> // kill
+#include <dirent.h> // opendir
+#include <fcntl.h> // O_* constants
+#include <sys/stat.h> // fstat
+#include <sys/mman.h> // shm_open, mmap
+#include <pthread.h> // shard workers
+#include <sched.h> // sched_yield
+#include <sys/wait.h> // waitpid
 #include "stat_server.h" 
+#include "size_label.h"
+#include "ptr_table.h"
+#include "age_hist.h"
+#include "lifetime_hist.h"
+#include "symbolizer.h"
+#include "trace.h"
+#include "stats_export.h"
+#include "proc_mem.h"
+#include "heap_dump.h"
 
 
 using namespace std;
@@ -30,24 +53,226 @@ using namespace std;
 // Redirect all printf to stderr
 #define printf(args...) fprintf(stderr, ##args)
 
+// Per call site totals, within one process
 typedef struct {
-    size_t              size;       // for reducing total_current_size upon removal
-    uint32_t            size_bin;   // zero based, for fast removal from size array
-    timeval             time;  
-} data_t;
+	uintptr_t	caller;
+	long		live_bytes;
+	long		live_count;
+	long		interval_allocations;	// since last print_stats()
+	long		interval_frees;			// of allocations made here
+} site_t;
 
-// Save pertinant data into a map
-multimap<void *, data_t> map_data;
+/*
+ * Per call site and size bin, within one process: how many allocations
+ * are freed again within churn_window_us, and the most live at once. Many
+ * short lived allocations with few live at a time make a pool candidate.
+ */
+typedef struct {
+	uint32_t	site;					// index of the call site
+	uint32_t	size_bin;
+	long		live_count;
+	long		peak_live_count;		// since start
+	long		interval_allocations;	// since last print_stats()
+	long		interval_short_lived;	// freed within churn_window_us
+} churn_t;
+
+// Per thread totals, within one process
+#define MAX_THREADS_PER_PROCESS	65535	// ptr_entry_t.thread, the last one
+										// stands for all later threads
+#define THREAD_TID_OTHERS		0
+
+typedef struct {
+	uint32_t	tid;
+	long		live_bytes;				// allocated by this thread
+	long		live_count;
+	long		interval_allocations;	// since last print_stats()
+	long		interval_frees;			// made by this thread
+} thread_t;
+
+// frees of one thread's allocations by another thread, since start
+typedef struct {
+	long		count;
+	long		bytes;
+} cross_free_t;
+
+/*
+ * Per process state within a shard. Processes sharing LD_PRELOAD reuse the
+ * same addresses, so each gets its own table of live allocations and its
+ * own totals.
+ */
+typedef struct {
+	pid_t		pid;
+	uint32_t	gen;					// see msg_data_t
+	ptr_table	map_data;				// pertinant data keyed by pointer
+	long		overall_allocations;
+	long		total_current_size;
+	long		current_allocations;
+	uint32_t	sample_interval;		// see msg_data_t, 0 if not sampled
+	unordered_map<uintptr_t, uint32_t> site_index;	// caller to sites index
+	vector<site_t> sites;
+	unordered_map<uint64_t, uint32_t> churn_index;	// see find_churn()
+	vector<churn_t> churns;
+	unordered_map<uint32_t, uint16_t> thread_index;	// tid to threads index
+	vector<thread_t> threads;
+	// by allocating thread index << 16 | freeing thread index
+	unordered_map<uint32_t, cross_free_t> cross_frees;
+} process_t;
+
+/*
+ * Ingestion is sharded. main() receives every event and routes it, by pid
+ * and pointer, to one shard. Only that shard's worker thread updates the
+ * shard's live allocations, totals and bins, under the shard lock, which
+ * print_stats() takes to merge the shards. A pointer's allocation and free
+ * always land in the same shard, in the order they were received, which
+ * need not be the order they happened in, see event_before().
+ */
+#define MAX_SHARDS				64
+#define SHARD_QUEUE_SLOTS		16384	// per shard, power of two
+
+#define SHARD_MSG_EVENT			0
+#define SHARD_MSG_RECLAIM		1		// msg_data.pid exited or exec'd
+
+typedef struct {
+	uint32_t	type;			// SHARD_MSG_*
+	uint32_t	align_bin;		// see align_to_bin()
+	uint64_t	time_us;		// see event_time_us()
+	uint64_t	now_us;			// when main() received it
+	msg_data_t	msg_data;
+} shard_msg_t;
+
+/*
+ * frees the shard saw lately, direct mapped by pid and pointer, so that an
+ * allocation that comes in after its free, or after the free of a later
+ * allocation at its address, is known to be freed already
+ */
+#define RECENT_FREE_BITS		14
+#define RECENT_FREE_SLOTS		(1 << RECENT_FREE_BITS)
+
+typedef struct {
+	uintptr_t	ptr;			// 0 marks an empty slot
+	uint32_t	pid;
+	uint32_t	gen;			// of the image that freed
+	uint64_t	time_us;		// when the client freed
+	uint32_t	seq;
+	uint32_t	tid;
+} recent_free_t;
+
+// events this far apart are ordered by their time, seq may have wrapped
+#define SEQ_WINDOW_US			1000000
+
+typedef struct {
+	// written by main()
+	uint64_t		head;
+	uint8_t			pad0[CACHE_LINE_SIZE - 8];
+
+	// written by the worker
+	uint64_t		tail;
+	uint32_t		idle;			// waiting on wake for main() to push
+	uint8_t			pad1[CACHE_LINE_SIZE - 12];
+
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	map<pid_t, process_t *> processes;
+	long			overall_allocations;
+	long			overall_frees;
+	long			overall_cross_frees;	// freed by another thread
+	long			total_current_size;
+	uint64_t		size_array[NUM_SIZE_BINS];
+	uint64_t		align_array[NUM_ALIGN_BINS];
+	age_hist		age_histogram;
+	lifetime_hist	lifetimes[NUM_SIZE_BINS];
+	shard_msg_t		queue[SHARD_QUEUE_SLOTS];
+	recent_free_t	recent_frees[RECENT_FREE_SLOTS];
+} shard_t;
+
+shard_t  *shards[MAX_SHARDS];
+uint32_t num_shards = 0;
+volatile bool shards_stopping = false;
+
+// current image of every process main() routes events for, see route_process()
+map<pid_t, uint32_t> process_gens;
+
+// A process as merged from the shards by merge_shards()
+typedef struct {
+	long		overall_allocations;
+	long		total_current_size;
+	long		current_allocations;
+	uint32_t	sample_interval;
+	size_t		tracked;				// entries in its tables
+	size_t		table_size;				// bytes of its tables
+} process_summary_t;
+
+map<pid_t, process_summary_t> process_summaries;
+
+// Call sites merged from the shards by merge_shards()
+map<pair<pid_t, uintptr_t>, site_t> site_summaries;
+
+// Pool candidates merged from the shards by merge_shards(), by pid, caller
+// and size bin. peak_live_count is the sum of the shards' peaks
+map<pair<pid_t, pair<uintptr_t, uint32_t> >, churn_t> churn_summaries;
 
+// allocations freed within this many microseconds count as churn, see -c
+#define CHURN_WINDOW_US			10000
+uint64_t churn_window_us = CHURN_WINDOW_US;
+
+// pool candidates listed by print_stats(), most short lived per second
+// first, and how many a second it takes to be one
+#define POOL_CANDIDATES_TO_PRINT	10
+#define POOL_MIN_SHORT_LIVED_RATE	100
+
+// Threads merged from the shards by merge_shards(), by pid and tid
+map<pair<pid_t, uint32_t>, thread_t> thread_summaries;
+
+// Cross thread frees merged from the shards, by pid and allocating and
+// freeing tid
+map<pair<pid_t, pair<uint32_t, uint32_t> >, cross_free_t> cross_free_summaries;
+
+// symbols of the call sites printed so far, by pid and caller
+map<pair<pid_t, uintptr_t>, string> site_symbols;
+
+// number of processes listed by print_stats(), largest first
+#define PROCESSES_TO_PRINT		10
+
+// number of call sites listed by print_stats(), most live bytes first
+#define SITES_TO_PRINT			10
+
+// number of threads, and of allocating to freeing thread pairs, listed
+#define THREADS_TO_PRINT		10
+#define CROSS_FREES_TO_PRINT	10
+
+// when print_stats() last reset the per interval counters, and seconds
+// since the reset before
+uint64_t last_print_time_us = 0;
+double 	 print_interval = 1;
+
+// time base for ptr_entry_t.time_us, EVENT_CLOCK ticks the same
+timespec server_start_time;
+
+// delay from the client's call to handle_event() since the last
+// print_stats(), by power of two microseconds
+#define NUM_LATENCY_BINS		32
+uint64_t latency_array[NUM_LATENCY_BINS] = {0};
+uint64_t latency_events = 0;
+uint64_t latency_max_us = 0;
+
+// Totals and bins merged from the shards by merge_shards()
 long overall_allocations = 0;
+long overall_frees = 0;
+long overall_cross_frees = 0;
 long total_current_size  = 0;
 
-// Size array for printing size
-#define         NUM_SIZE_BINS    12
-uint32_t size_array[NUM_SIZE_BINS] = {0};
+// Size array for printing size, see size_to_bin()
+uint64_t size_array[NUM_SIZE_BINS] = {0};
 
-// Age array for printing age
-#define 		NUM_AGE_BINS	5
+// Aligned allocations by alignment, see align_to_bin()
+uint64_t align_array[NUM_ALIGN_BINS] = {0};
+
+// Age bins for printing age, each shard keeps its histogram current
+uint64_t age_array[NUM_AGE_BINS] = {0};
+
+// How long freed allocations lived, by size bin, since start
+lifetime_hist lifetime_array[NUM_SIZE_BINS];
 typedef enum {
 	LESS_THAN_1_SEC,
 	LESS_THAN_10_SEC,
@@ -56,257 +281,2364 @@ typedef enum {
 	EQUAL_TO_OR_OVER_1000_SEC
 } AGE_BIN;
 
-void insert_allocation(void *ptr, size_t size);
-void remove_allocation(void *ptr);
-void print_stats(void);
-uint32_t get_max_bin_num(uint32_t *age_array);
-void print_size_symbol(uint32_t bin, uint32_t symbol_size);
-void print_age_symbol(uint32_t *age_array, uint32_t bin, uint32_t symbol_size);
+// every event as received, see -t
+trace_writer trace;
+
+// what print_stats() last printed, written to export_path if set, see -e
+stats_snapshot_t snapshot;
+const char *export_path = NULL;
+
+// set by SIGINT/SIGTERM, main() then shuts down cleanly
+volatile sig_atomic_t stop_requested = 0;
+
+// set by SIGUSR1, main() then dumps the live allocations to
+// <dump_prefix>.<seconds since epoch>.heap for stat_heapdiff, see -d
+volatile sig_atomic_t dump_requested = 0;
+const char *dump_prefix = "stat_malloc";
+pid_t dump_child = 0;			// forked to write the dump, 0 if none
+string dump_path;				// of dump_child
+
+// where clients look for us, see server_seg_t
+server_seg_t *server_seg = NULL;
+
+// Client ring segments being drained, by pid
+map<pid_t, ring_seg_t *> ring_segs;
+
+// Counter segments, by pid: counters mode clients, and event transport
+// clients counting their dropped events. the inode tells a segment
+// recreated by an exec'd image from the one we mapped
+typedef struct {
+	counter_seg_t	*seg;
+	ino_t			ino;
+	bool			counting;	// not COUNTER_SEG_EVENTS, the slabs count
+	counter_slab_t	total;		// sum of the slabs as of the last print
+} counter_client_t;
+map<pid_t, counter_client_t> counter_clients;
+
+// allocations made by counters mode processes that have since exited
+long counter_exited_allocations = 0;
+
+// event transport clients that degraded to counters, by pid, to the gen
+// whose late events are dropped
+map<pid_t, uint32_t> degraded_gens;
+
+// events clients dropped on a full queue, see STAT_MALLOC_ON_FULL, and
+// sampled allocations they dropped on a full sample set
+typedef struct {
+	uint64_t	allocations;
+	uint64_t	frees;
+	uint64_t	bytes;
+	uint64_t	samples;
+	uint64_t	sample_bytes;
+} drop_counts_t;
+drop_counts_t exited_drops = drop_counts_t();	// by processes since exited
+
+// latest malloc view of the clients that send one, by pid, see
+// STAT_MALLOC_HEAP_INFO_MS
+map<pid_t, heap_info_t> heap_infos;
+
+// size array of counters mode processes, summed up at print time
+uint64_t counter_size_array[NUM_SIZE_BINS] = {0};
+uint32_t num_counting_clients = 0;
+
+// small object cache outcomes of all clients since start, by size bin, see
+// STAT_MALLOC_CACHE
+uint64_t cache_hits[NUM_CACHE_BINS] = {0};
+uint64_t cache_misses[NUM_CACHE_BINS] = {0};
+uint64_t exited_cache_hits[NUM_CACHE_BINS] = {0};	// by processes since exited
+uint64_t exited_cache_misses[NUM_CACHE_BINS] = {0};
+
+// bound time spent on one source before servicing the others
+#define MAX_MSGS_PER_PASS		4096
+
+// an idle main() blocks in msgrcv() until a message or SIGALRM this often
+#define TICK_US					100000
+#define RING_TICK_US			1000	// while ring clients are attached
+
+void handle_event(msg_data_t *msg_data, uint64_t now_us);
+void trace_msg_event(const msg_data_t *msg_data, uint64_t time_us);
+bool route_process(pid_t pid, uint32_t gen, bool is_alloc);
+void handle_stop_signal(int sig);
+void handle_dump_signal(int sig);
+void handle_tick_signal(int sig);
+void set_tick(uint64_t interval_us);
+void server_seg_attach(void);
+void server_seg_heartbeat(void);
+void server_seg_detach(void);
+void start_heap_dump(void);
+bool write_heap_dump(const char *path, uint64_t realtime_us, uint64_t now_us);
+void reap_heap_dump(bool wait);
+void shards_start(uint32_t count);
+void shards_stop(void);
+void shard_push(shard_t *shard, const shard_msg_t *msg);
+void shards_wake(void);
+void *shard_worker(void *arg);
+void shard_apply(shard_t *shard, shard_msg_t *msg);
+void merge_shards(void);
+void ring_seg_attach(pid_t pid);
+void ring_seg_detach(pid_t pid, bool unlink);
+void discover_ring_segs(void);
+uint32_t drain_rings(void);
+uint32_t drain_ring_seg(ring_seg_t *seg);
+void counter_seg_attach(pid_t pid, ino_t ino);
+void counter_seg_detach(pid_t pid, bool unlink);
+void discover_counter_segs(void);
+void counter_seg_degraded(pid_t pid, uint32_t gen);
+void sum_counter_segs(void);
+uint64_t dropped_events(pid_t pid);
+drop_counts_t sum_drops(uint32_t *num_processes);
+uint64_t server_time_us(void);
+uint64_t event_time_us(const msg_data_t *msg_data, uint64_t now_us);
+void record_latency(uint64_t latency_us);
+process_t *find_process(shard_t *shard, pid_t pid, uint32_t gen);
+void reclaim_process(pid_t pid);
+void shard_reclaim_process(shard_t *shard, pid_t pid, uint64_t now_us);
+void reclaim_exited_processes(void);
+uint32_t find_site(process_t *proc, const void *caller);
+uint32_t find_thread(process_t *proc, uint32_t tid);
+uint32_t find_churn(process_t *proc, const void *caller, uint32_t size_bin);
+bool event_before(uint32_t seq, uint64_t time_us, uint32_t other_seq,
+				  uint64_t other_time_us);
+recent_free_t *recent_free(shard_t *shard, pid_t pid, void *ptr);
+void insert_allocation(shard_t *shard, process_t *proc, void *ptr,
+					   size_t size, uint32_t align_bin, const void *caller,
+					   uint32_t tid, uint64_t time_us, uint64_t now_us,
+					   uint32_t seq);
+void remove_allocation(shard_t *shard, process_t *proc, void *ptr,
+					   uint32_t tid, uint64_t time_us, uint64_t now_us,
+					   uint32_t seq);
+string size_string(double size);
+string duration_string(uint64_t time_us);
+void print_latency_stats(void);
+void print_process_stats(void);
+void read_process_memory(export_process_t *export_proc);
+void print_process_memory(const export_process_t *export_proc);
+void print_lifetime_stats(void);
+void print_site_stats(void);
+void print_thread_stats(void);
+void print_pool_candidates(void);
+void print_cache_stats(void);
+const string &site_symbol(pid_t pid, uintptr_t caller);
+void print_stats(void);
+uint64_t get_max_bin_num(void);
+void print_size_symbol(uint32_t bin, uint64_t symbol_size);
+void print_age_symbol(uint32_t bin, uint64_t symbol_size);
+void print_align_stats(uint64_t symbol_size);
+
+int main(int argc, char *argv[])
+{
+	msg_t 	 msg;
+	key_t 	 msg_key; 
+    int 	 msgid;
+	timeval  start_time, intermediate_time;
+	uint32_t elapsed_seconds;
+	uint32_t num_events;
+	ssize_t  msg_size;
+	int 	 flags;
+	uint64_t now_us;
+	const char *trace_path = NULL;
+	long 	 num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int 	 opt;
+
+	while ((opt = getopt(argc, argv, "c:d:e:t:w:")) != -1) {
+		switch (opt) {
+		case 'c':
+			churn_window_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			dump_prefix = optarg;
+			break;
+		case 'e':
+			export_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
+		default:
+			cerr << "usage: " << argv[0] << " [-c churn_window_us]"
+				 << " [-d dump_prefix] [-e export_file] [-t trace_file]"
+				 << " [-w workers]" << endl;
+			return 1;
+		}
+	}
+	num_workers = min(max(num_workers, 1L), (long)MAX_SHARDS);
+
+	cerr << "Server Started, pid: " << getpid() << endl;
+	clock_gettime(CLOCK_MONOTONIC, &server_start_time);
+
+	if (trace_path != NULL) {
+		// offsets in the trace are relative to server_start_time
+		gettimeofday(&start_time, NULL);
+		if (!trace.open(trace_path, start_time.tv_sec * 1000000ULL +
+						start_time.tv_usec)) {
+			perror(trace_path);
+			return 1;
+		}
+		cerr << "Recording trace to " << trace_path << endl;
+	}
+	signal(SIGINT, handle_stop_signal);
+	signal(SIGTERM, handle_stop_signal);
+	signal(SIGUSR1, handle_dump_signal);
+	signal(SIGALRM, handle_tick_signal);
+
+	shards_start(num_workers);
+	cerr << "Ingesting with " << num_workers << " worker threads" << endl;
+  
+    // ftok to generate unique key 
+    msg_key = ftok(MSG_KEY_STRING, MSG_KEY_INT); 
+  
+    // msgget creates a message queue and returns identifier 
+    msgid = msgget(msg_key, MSG_PERMISSIONS | IPC_CREAT);
+
+	// pick up ring clients that started before us
+	discover_ring_segs();
+	discover_counter_segs();
+
+	// clients start sending once the msgQ is there
+	server_seg_attach();
+
+	gettimeofday(&start_time, NULL);
+
+	num_events = 0;
+	while (!stop_requested) {
+		set_tick(ring_segs.empty() ? TICK_US : RING_TICK_US);
+
+		// block for the first message only when the last pass found
+		// nothing, rings are drained as long as they have events
+		flags = (num_events == 0) ? 0 : IPC_NOWAIT;
+		num_events = 0;
+		while ((num_events < MAX_MSGS_PER_PASS) &&
+			   ((msg_size = msgrcv(msgid, &msg, sizeof(msg.msg_data), 0,
+								   flags)) != -1)) {
+			flags = IPC_NOWAIT;
+			if (msg.type == MSG_TYPE_RING_ATTACH) {
+				ring_seg_attach((pid_t)msg.msg_data[0].pid);
+			} else if (msg.type == MSG_TYPE_HEAP_INFO) {
+				if (msg_size == sizeof(heap_info_t)) {
+					heap_info_t info;
+
+					memcpy(&info, msg.msg_data, sizeof(info));
+					heap_infos[info.pid] = info;
+				}
+			} else {
+				// unpack however many events the client batched, they carry
+				// their own times so one clock read does for all of them
+				now_us = server_time_us();
+				for (size_t i = 0; i < msg_size / sizeof(msg_data_t); i++) {
+					handle_event(&msg.msg_data[i], now_us);
+				}
+				shards_wake();
+			}
+			num_events++;
+		}
+		if ((num_events == 0) && (flags == 0) && (errno != EINTR)) {
+			// msgQ gone or never there, rings still get their ticks
+			pause();
+		}
+
+		num_events += drain_rings();
+
+		if (dump_requested) {
+			dump_requested = 0;
+			start_heap_dump();
+		}
+
+		gettimeofday(&intermediate_time, NULL);
+
+		elapsed_seconds = (intermediate_time.tv_sec - start_time.tv_sec) +
+			(intermediate_time.tv_usec - start_time.tv_usec) / 1000000;
+
+		if (elapsed_seconds >= 1) {
+			// for testing, break
+			discover_ring_segs();
+			discover_counter_segs();
+			reclaim_exited_processes();
+			reap_heap_dump(false);
+			server_seg_heartbeat();
+			print_stats(); // only about every 1 seconds
+			trace.flush(); // lose at most a second of trace on a crash
+			gettimeofday(&start_time, NULL);
+		}
+
+		// rings and reclaims pushed too
+		shards_wake();
+	}
+
+	// clients go quiet before the msgQ goes away
+	server_seg_detach();
+	shards_stop();
+	trace.close();
+	reap_heap_dump(true);
+
+    // destroy the message queue
+	cerr << "Server: Destroying msgQ" << endl;
+    msgctl(msgid, IPC_RMID, NULL); 
+	
+	return 0;
+}
+
+
+// runs in main(), routes the event to the shard that owns its pointer
+void handle_event(msg_data_t *msg_data, uint64_t now_us)
+{
+	shard_msg_t msg;
+	uint64_t 	hash;
+
+	msg.time_us = event_time_us(msg_data, now_us);
+	record_latency(now_us - msg.time_us);
+
+	if (trace.is_open()) {
+		trace_msg_event(msg_data, msg.time_us);
+	}
+
+	// only an allocation can introduce a new process image
+	if (!route_process(msg_data->pid, msg_data->gen,
+					   msg_data->op == MSG_OP_ALLOC)) {
+		return;
+	}
+
+	msg.type 	  = SHARD_MSG_EVENT;
+	msg.align_bin = (msg_data->call == MSG_CALL_MEMALIGN) ?
+		align_to_bin(msg_data->align_shift) : ALIGN_BIN_NONE;
+	msg.now_us 	  = now_us;
+	msg.msg_data  = *msg_data;
+
+	// low pointer bits are alignment, mix in the pid for processes
+	// sharing addresses
+	hash = (((uintptr_t)msg_data->ptr >> 4) ^ ((uint64_t)msg_data->pid << 32)) *
+		0x9e3779b97f4a7c15ULL;
+	shard_push(shards[(hash >> 32) % num_shards], &msg);
+}
+
+void trace_msg_event(const msg_data_t *msg_data, uint64_t time_us)
+{
+	trace_event_t event;
+	uint64_t 	  start_ns = server_start_time.tv_sec * 1000000000ULL +
+		server_start_time.tv_nsec;
+
+	event.time_us 		  = time_us;
+	// EVENT_SEQ_CLOCK is the clock server_start_time was read from
+	event.seq 			  = msg_data->seq - (uint32_t)start_ns;
+	event.ptr 			  = (uintptr_t)msg_data->ptr;
+	event.size 			  = msg_data->size;
+	event.caller 		  = (uintptr_t)msg_data->caller;
+	event.pid 			  = msg_data->pid;
+	event.gen 			  = msg_data->gen;
+	event.tid 			  = msg_data->tid;
+	event.sample_interval = msg_data->sample_interval;
+	event.op 			  = msg_data->op;
+	event.call 			  = msg_data->call;
+	event.align_shift 	  = msg_data->align_shift;
+	trace.add(event);
+}
+
+/*
+ * main()'s view of the process images, so the shards only ever see
+ * events of the current image. false if the event is to be dropped.
+ */
+bool route_process(pid_t pid, uint32_t gen, bool is_alloc)
+{
+	map<pid_t, uint32_t>::iterator it;
+
+	if (!degraded_gens.empty() &&
+		((it = degraded_gens.find(pid)) != degraded_gens.end()) &&
+		(it->second == gen)) {
+		// counted by its counter segment now
+		return false;
+	}
+
+	if ((it = process_gens.find(pid)) != process_gens.end()) {
+		if (it->second == gen) {
+			return true;
+		}
+		if (!is_alloc) {
+			// late event from an image that is already replaced
+			return false;
+		}
+		// pid exec'd or was reused, the old image's memory is gone
+		reclaim_process(pid);
+	} else if (!is_alloc) {
+		// allocated before LD_PRELOAD or before we started
+		return false;
+	}
+
+	process_gens[pid] = gen;
+	return true;
+}
+
+void handle_stop_signal(int sig)
+{
+	stop_requested = 1;
+}
+
+/*
+ * clients may have created the segment already and keep it mapped, so it
+ * is reused as is and never unlinked.
+ */
+void server_seg_attach(void)
+{
+	struct stat st;
+	void 		*seg;
+	int 		fd;
+
+	fd = shm_open(SERVER_SEG_NAME, O_RDWR | O_CREAT, SERVER_SEG_PERMISSIONS);
+	if (fd == -1) {
+		perror("shm_open " SERVER_SEG_NAME);
+		return;
+	}
+	fchmod(fd, SERVER_SEG_PERMISSIONS);
+	if ((fstat(fd, &st) == -1) ||
+		((st.st_size < (off_t)sizeof(server_seg_t)) &&
+		 (ftruncate(fd, sizeof(server_seg_t)) == -1))) {
+		perror(SERVER_SEG_NAME);
+		close(fd);
+		return;
+	}
+	seg = mmap(NULL, sizeof(server_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		perror("mmap " SERVER_SEG_NAME);
+		return;
+	}
+
+	server_seg = (server_seg_t *)seg;
+	server_seg->server_pid = getpid();
+	server_seg_heartbeat();
+	__atomic_add_fetch(&server_seg->epoch, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&server_seg->active, 1, __ATOMIC_RELEASE);
+}
+
+// clients take us for dead once it is SERVER_HEARTBEAT_NS old
+void server_seg_heartbeat(void)
+{
+	timespec now;
+
+	if (server_seg == NULL) {
+		return;
+	}
+	clock_gettime(EVENT_CLOCK, &now);
+	__atomic_store_n(&server_seg->heartbeat_ns,
+					 now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+}
+
+void server_seg_detach(void)
+{
+	if (server_seg == NULL) {
+		return;
+	}
+	__atomic_store_n(&server_seg->active, 0, __ATOMIC_RELEASE);
+	munmap(server_seg, sizeof(server_seg_t));
+	server_seg = NULL;
+}
+
+void handle_dump_signal(int sig)
+{
+	dump_requested = 1;
+}
+
+// only there to interrupt msgrcv(), which is never restarted
+void handle_tick_signal(int sig)
+{
+}
+
+void set_tick(uint64_t interval_us)
+{
+	static uint64_t current_us = 0;
+	itimerval 		timer;
+
+	if (interval_us == current_us) {
+		return;
+	}
+	timer.it_interval.tv_sec  = interval_us / 1000000;
+	timer.it_interval.tv_usec = interval_us % 1000000;
+	timer.it_value 			  = timer.it_interval;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	current_us = interval_us;
+}
+
+/*
+ * fork() with every shard lock held, so the child gets a consistent copy
+ * of the live tables, copy on write, and writes the dump from it while
+ * ingestion goes on. the workers only wait for the fork() itself.
+ */
+void start_heap_dump(void)
+{
+	timeval  now;
+	uint64_t now_us;
+	char 	 path[PATH_MAX];
+	pid_t 	 pid;
+
+	if (dump_child != 0) {
+		cerr << "Heap dump to " << dump_path << " still being written" << endl;
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	snprintf(path, sizeof(path), "%s.%ld.heap", dump_prefix, (long)now.tv_sec);
+
+	for (uint32_t i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&shards[i]->lock);
+	}
+	now_us = server_time_us();
+	pid = fork();
+	if (pid == 0) {
+		// only this thread lives on here, the locks stay held for good
+		_exit(write_heap_dump(path, now.tv_sec * 1000000ULL + now.tv_usec,
+							  now_us) ? 0 : 1);
+	}
+	for (uint32_t i = 0; i < num_shards; i++) {
+		pthread_mutex_unlock(&shards[i]->lock);
+	}
+
+	if (pid == -1) {
+		perror("fork");
+		return;
+	}
+	dump_child = pid;
+	dump_path  = path;
+	cerr << "Writing heap dump to " << path << endl;
+}
+
+// in the forked child, the tables are its own
+bool write_heap_dump(const char *path, uint64_t realtime_us, uint64_t now_us)
+{
+	heap_dump_writer  writer;
+	heap_dump_alloc_t alloc;
+	set<pair<pid_t, uintptr_t> > callers;
+	set<pair<pid_t, uintptr_t> >::iterator cit;
+	map<pid_t, process_t *>::iterator it;
+	vector<uint32_t> tids;
+	process_t *proc;
+
+	if (!writer.open(path, realtime_us)) {
+		perror(path);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < num_shards; i++) {
+		for (it = shards[i]->processes.begin();
+			 it != shards[i]->processes.end(); it++) {
+			proc = it->second;
+			if (proc->map_data.size() == 0) {
+				continue;
+			}
+			tids.clear();
+			for (size_t t = 0; t < proc->threads.size(); t++) {
+				tids.push_back(proc->threads[t].tid);
+			}
+
+			writer.begin_section(it->first, proc->gen, proc->sample_interval,
+								 tids);
+			proc->map_data.for_each([&](const ptr_entry_t &entry) {
+				alloc.ptr 	 = entry.ptr;
+				alloc.caller = proc->sites[proc->churns[entry.churn].site].caller;
+				alloc.size 	 = entry.size;
+				alloc.thread = entry.thread;
+				alloc.age_ms = (now_us > entry.time_us) ?
+					min((now_us - entry.time_us) / 1000, (uint64_t)UINT32_MAX) : 0;
+				alloc.weight = entry.weight;
+				writer.add(alloc);
+				callers.insert(make_pair(it->first, (uintptr_t)alloc.caller));
+			});
+			writer.end_section();
+		}
+	}
+
+	// the processes may be gone by the time the dump is read
+	for (cit = callers.begin(); cit != callers.end(); cit++) {
+		writer.add_symbol(cit->first, cit->second,
+						  symbolize(cit->first, cit->second));
+	}
+
+	if (!writer.close()) {
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+// reports the dump once its child is done, waits for it if wait is set
+void reap_heap_dump(bool wait)
+{
+	int   status = 0;
+	pid_t pid;
+
+	if ((dump_child == 0) ||
+		((pid = waitpid(dump_child, &status, wait ? 0 : WNOHANG)) == 0)) {
+		return;
+	}
+
+	if ((pid == dump_child) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+		cerr << "Heap dump written to " << dump_path << endl;
+	} else {
+		cerr << "Heap dump to " << dump_path << " failed" << endl;
+	}
+	dump_child = 0;
+}
+
+// workers take no signals, so they all interrupt main()'s msgrcv()
+void shards_start(uint32_t count)
+{
+	sigset_t signals, saved;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &signals, &saved);
+
+	for (num_shards = 0; num_shards < count; num_shards++) {
+		shards[num_shards] = new shard_t();
+		pthread_mutex_init(&shards[num_shards]->lock, NULL);
+		pthread_cond_init(&shards[num_shards]->wake, NULL);
+		pthread_create(&shards[num_shards]->thread, NULL, shard_worker,
+					   shards[num_shards]);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+// workers finish what is queued, then exit
+void shards_stop(void)
+{
+	shards_stopping = true;
+	for (uint32_t i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&shards[i]->lock);
+		pthread_cond_signal(&shards[i]->wake);
+		pthread_mutex_unlock(&shards[i]->lock);
+		pthread_join(shards[i]->thread, NULL);
+	}
+}
+
+/*
+ * waits while the shard's worker is a whole queue behind. the worker is not
+ * woken for every event, main() calls shards_wake() once it is done with a
+ * message and before it blocks.
+ */
+void shard_push(shard_t *shard, const shard_msg_t *msg)
+{
+	uint64_t head = shard->head;
+
+	while (head - __atomic_load_n(&shard->tail, __ATOMIC_ACQUIRE) >=
+		   SHARD_QUEUE_SLOTS) {
+		shards_wake();
+		sched_yield();
+	}
+	shard->queue[head & (SHARD_QUEUE_SLOTS - 1)] = *msg;
+	__atomic_store_n(&shard->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// wakes the workers waiting for what main() pushed since
+void shards_wake(void)
+{
+	// pairs with the fence in shard_worker(), either main() sees idle or
+	// the worker sees the new head
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (uint32_t i = 0; i < num_shards; i++) {
+		if (__atomic_load_n(&shards[i]->idle, __ATOMIC_RELAXED) &&
+			(shards[i]->head !=
+			 __atomic_load_n(&shards[i]->tail, __ATOMIC_RELAXED))) {
+			pthread_mutex_lock(&shards[i]->lock);
+			pthread_cond_signal(&shards[i]->wake);
+			pthread_mutex_unlock(&shards[i]->lock);
+		}
+	}
+}
+
+void *shard_worker(void *arg)
+{
+	shard_t  *shard = (shard_t *)arg;
+	uint64_t head, tail;
+
+	for (;;) {
+		head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
+		tail = shard->tail;
+		if (tail == head) {
+			if (shards_stopping) {
+				break;
+			}
+
+			// nothing queued, sleep until shards_wake()
+			pthread_mutex_lock(&shard->lock);
+			__atomic_store_n(&shard->idle, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			while ((__atomic_load_n(&shard->head, __ATOMIC_ACQUIRE) == tail) &&
+				   !shards_stopping) {
+				pthread_cond_wait(&shard->wake, &shard->lock);
+			}
+			__atomic_store_n(&shard->idle, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&shard->lock);
+			continue;
+		}
+
+		// everything queued so far in one go, print_stats() waits meanwhile
+		pthread_mutex_lock(&shard->lock);
+		for (; tail != head; tail++) {
+			shard_apply(shard, &shard->queue[tail & (SHARD_QUEUE_SLOTS - 1)]);
+		}
+		pthread_mutex_unlock(&shard->lock);
+
+		__atomic_store_n(&shard->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+// called with the shard lock held
+void shard_apply(shard_t *shard, shard_msg_t *msg)
+{
+	msg_data_t *msg_data = &msg->msg_data;
+	process_t  *proc;
+
+	if (msg->type == SHARD_MSG_RECLAIM) {
+		shard_reclaim_process(shard, msg_data->pid, msg->now_us);
+		return;
+	}
+
+	// created by a free too, it can come before its allocation
+	proc = find_process(shard, msg_data->pid, msg_data->gen);
+
+	if (msg_data->op == MSG_OP_ALLOC) {
+		// cerr << "Server Rx: Insertion " << msg_data->ptr << ", "
+		//	 << msg_data->size << endl;
+			
+		proc->sample_interval = msg_data->sample_interval;
+		insert_allocation(shard, proc, msg_data->ptr, msg_data->size,
+						  msg->align_bin, msg_data->caller, msg_data->tid,
+						  msg->time_us, msg->now_us, msg_data->seq);
+	} else if (msg_data->op == MSG_OP_FREE) {
+		// cerr << "Server Rx: Removal " << msg_data->ptr << endl;
+		remove_allocation(shard, proc, msg_data->ptr, msg_data->tid,
+						  msg->time_us, msg->now_us, msg_data->seq);
+	}
+}
+
+/*
+ * the shard's state for a process, created if pid/gen is new here.
+ * route_process() already dropped stale images.
+ */
+process_t *find_process(shard_t *shard, pid_t pid, uint32_t gen)
+{
+	map<pid_t, process_t *>::iterator it;
+	process_t *proc;
+
+	if ((it = shard->processes.find(pid)) != shard->processes.end()) {
+		if (it->second->gen == gen) {
+			return it->second;
+		}
+		shard_reclaim_process(shard, pid, server_time_us());
+	}
+
+	proc = new process_t();
+	proc->pid = pid;
+	proc->gen = gen;
+	shard->processes[pid] = proc;
+
+	return proc;
+}
+
+// drop everything a process had live, in bulk, in every shard
+void reclaim_process(pid_t pid)
+{
+	map<pid_t, uint32_t>::iterator it;
+	shard_msg_t msg = shard_msg_t();
+
+	if ((it = process_gens.find(pid)) == process_gens.end()) {
+		return;
+	}
+
+	msg.type 		 = SHARD_MSG_RECLAIM;
+	msg.now_us 		 = server_time_us();
+	msg.msg_data.pid = pid;
+	msg.msg_data.gen = it->second;
+
+	if (trace.is_open()) {
+		// so offline tools drop the process's memory at the same point
+		trace_event_t event = trace_event_t();
+		event.time_us = msg.now_us;
+		event.pid 	  = pid;
+		event.gen 	  = it->second;
+		event.op 	  = TRACE_OP_EXIT;
+		trace.add(event);
+	}
+
+	for (uint32_t i = 0; i < num_shards; i++) {
+		shard_push(shards[i], &msg);
+	}
+	process_gens.erase(it);
+	site_symbols.erase(site_symbols.lower_bound(make_pair(pid, (uintptr_t)0)),
+					   site_symbols.upper_bound(make_pair(pid, UINTPTR_MAX)));
+	symbolizer_forget(pid);
+}
+
+// called with the shard lock held
+void shard_reclaim_process(shard_t *shard, pid_t pid, uint64_t now_us)
+{
+	map<pid_t, process_t *>::iterator it;
+
+	if ((it = shard->processes.find(pid)) == shard->processes.end()) {
+		return;
+	}
+
+	it->second->map_data.for_each([&](const ptr_entry_t &entry) {
+		shard->size_array[entry.size_bin] -= entry.weight;
+		shard->align_array[entry.align_bin] -= entry.weight;
+		shard->age_histogram.remove(entry.time_us, now_us, entry.weight);
+	});
+	shard->total_current_size -= it->second->total_current_size;
+
+	delete it->second;
+	shard->processes.erase(it);
+}
+
+void reclaim_exited_processes(void)
+{
+	vector<pid_t> dead;
+	map<pid_t, uint32_t>::iterator it;
+	map<pid_t, heap_info_t>::iterator hit;
+
+	for (it = process_gens.begin(); it != process_gens.end(); it++) {
+		if ((kill(it->first, 0) == -1) && (errno == ESRCH)) {
+			dead.push_back(it->first);
+		}
+	}
+	for (size_t i = 0; i < dead.size(); i++) {
+		reclaim_process(dead[i]);
+	}
+
+	// counters mode clients send them too
+	for (hit = heap_infos.begin(); hit != heap_infos.end(); ) {
+		if ((kill(hit->first, 0) == -1) && (errno == ESRCH)) {
+			heap_infos.erase(hit++);
+		} else {
+			hit++;
+		}
+	}
+}
+
+// map a client's ring segment, replacing any segment of a previous pid owner
+void ring_seg_attach(pid_t pid)
+{
+	char 		name[64];
+	int 		fd;
+	struct stat st;
+	ring_seg_t 	*seg;
+
+	if (ring_segs.count(pid)) {
+		// client unlinked the old segment before creating its own
+		ring_seg_detach(pid, false);
+	}
+
+	snprintf(name, sizeof(name), RING_SEG_NAME_FORMAT, pid);
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1) {
+		return;
+	}
+
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(ring_seg_t))) {
+		close(fd);
+		return;
+	}
+
+	seg = (ring_seg_t *) mmap(NULL, sizeof(ring_seg_t), PROT_READ | PROT_WRITE,
+							  MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		return;
+	}
+
+	if ((__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != RING_SEG_MAGIC) ||
+		(seg->pid != (uint32_t)pid)) {
+		// still being initialized, next discovery pass will retry
+		munmap(seg, sizeof(ring_seg_t));
+		return;
+	}
+
+	ring_segs[pid] = seg;
+}
+
+void ring_seg_detach(pid_t pid, bool unlink)
+{
+	char name[64];
+	map<pid_t, ring_seg_t *>::iterator it;
+
+	if ((it = ring_segs.find(pid)) == ring_segs.end()) {
+		return;
+	}
+
+	// whatever the client published before going away still counts
+	drain_ring_seg(it->second);
+	munmap(it->second, sizeof(ring_seg_t));
+	ring_segs.erase(it);
+
+	if (unlink) {
+		snprintf(name, sizeof(name), RING_SEG_NAME_FORMAT, pid);
+		shm_unlink(name);
+	}
+}
+
+// attach to new ring segments and reclaim those of exited clients
+void discover_ring_segs(void)
+{
+	DIR 			*dir;
+	struct dirent 	*entry;
+	size_t 			prefix_len = strlen(RING_SEG_NAME_PREFIX);
+	pid_t 			pid;
+	vector<pid_t> 	dead;
+	map<pid_t, ring_seg_t *>::iterator it;
+
+	if ((dir = opendir(RING_SEG_DIR)) != NULL) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (strncmp(entry->d_name, RING_SEG_NAME_PREFIX, prefix_len)) {
+				continue;
+			}
+			pid = atoi(entry->d_name + prefix_len);
+			if ((pid > 0) && !ring_segs.count(pid)) {
+				ring_seg_attach(pid);
+				if (!ring_segs.count(pid) &&
+					(kill(pid, 0) == -1) && (errno == ESRCH)) {
+					// left behind by a client we never saw
+					shm_unlink(entry->d_name);
+				}
+			}
+		}
+		closedir(dir);
+	}
+
+	for (it = ring_segs.begin(); it != ring_segs.end(); it++) {
+		if ((kill(it->first, 0) == -1) && (errno == ESRCH)) {
+			dead.push_back(it->first);
+		}
+	}
+	for (size_t i = 0; i < dead.size(); i++) {
+		ring_seg_detach(dead[i], true);
+	}
+}
+
+uint32_t drain_rings(void)
+{
+	uint32_t num_events = 0;
+	map<pid_t, ring_seg_t *>::iterator it;
+
+	for (it = ring_segs.begin(); it != ring_segs.end(); it++) {
+		num_events += drain_ring_seg(it->second);
+	}
+
+	return num_events;
+}
+
+uint32_t drain_ring_seg(ring_seg_t *seg)
+{
+	uint32_t num_events = 0;
+	uint32_t num_slots, expected;
+	uint64_t head, tail;
+	uint64_t now_us = server_time_us();
+	ring_t 	 *ring;
+
+	num_slots = min(__atomic_load_n(&seg->num_slots_used, __ATOMIC_ACQUIRE),
+					(uint32_t)RING_SLOTS);
+
+	for (uint32_t i = 0; i < num_slots; i++) {
+		ring = &seg->rings[i];
+		expected = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+		if (expected == RING_FREE) {
+			continue;
+		}
+
+		// acquire pairs with the producer's release fence
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			handle_event(&ring->events[tail & (RING_EVENTS - 1)], now_us);
+			num_events++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (expected == RING_CLOSED) {
+			// producer is gone and everything it published has been seen
+			__atomic_compare_exchange_n(&ring->state, &expected, RING_FREE, 0,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		}
+	}
+
+	return num_events;
+}
+
+// map a counters mode client's segment, replacing one of an older image
+void counter_seg_attach(pid_t pid, ino_t ino)
+{
+	char 			 name[64];
+	int 			 fd;
+	struct stat 	 st;
+	counter_seg_t 	 *seg;
+	counter_client_t client = counter_client_t();
+
+	if (counter_clients.count(pid)) {
+		counter_seg_detach(pid, false);
+	}
+
+	snprintf(name, sizeof(name), COUNTER_SEG_NAME_FORMAT, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return;
+	}
+
+	if ((fstat(fd, &st) == -1) || (st.st_ino != ino) ||
+		(st.st_size < (off_t)sizeof(counter_seg_t))) {
+		close(fd);
+		return;
+	}
+
+	// read only, stat_server never writes to a counters mode client
+	seg = (counter_seg_t *) mmap(NULL, sizeof(counter_seg_t), PROT_READ,
+								 MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		return;
+	}
+
+	if ((__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != COUNTER_SEG_MAGIC) ||
+		(seg->pid != (uint32_t)pid)) {
+		// still being initialized, next discovery pass will retry
+		munmap(seg, sizeof(counter_seg_t));
+		return;
+	}
+
+	client.seg = seg;
+	client.ino = ino;
+	counter_clients[pid] = client;
+}
+
+void counter_seg_detach(pid_t pid, bool unlink)
+{
+	char name[64];
+	map<pid_t, counter_client_t>::iterator it;
+
+	if ((it = counter_clients.find(pid)) == counter_clients.end()) {
+		return;
+	}
+
+	// keep the overall allocation and drop counts from going backwards
+	sum_counter_segs();
+	counter_exited_allocations += it->second.total.allocations;
+	exited_drops.allocations += it->second.seg->dropped_allocations;
+	exited_drops.frees += it->second.seg->dropped_frees;
+	exited_drops.bytes += it->second.seg->dropped_bytes;
+	exited_drops.samples += it->second.seg->dropped_samples;
+	exited_drops.sample_bytes += it->second.seg->dropped_sample_bytes;
+	for (uint32_t bin = 0; bin < NUM_CACHE_BINS; bin++) {
+		exited_cache_hits[bin] += it->second.total.cache_hits[bin];
+		exited_cache_misses[bin] += it->second.total.cache_misses[bin];
+	}
+	degraded_gens.erase(pid);
+
+	munmap(it->second.seg, sizeof(counter_seg_t));
+	counter_clients.erase(it);
+
+	if (unlink) {
+		snprintf(name, sizeof(name), COUNTER_SEG_NAME_FORMAT, pid);
+		shm_unlink(name);
+	}
+}
+
+// attach to new or recreated counter segments, drop those of exited clients
+void discover_counter_segs(void)
+{
+	DIR 			*dir;
+	struct dirent 	*entry;
+	size_t 			prefix_len = strlen(COUNTER_SEG_NAME_PREFIX);
+	pid_t 			pid;
+	uint32_t 		mode;
+	vector<pid_t> 	dead;
+	map<pid_t, counter_client_t>::iterator it;
+
+	if ((dir = opendir(RING_SEG_DIR)) != NULL) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (strncmp(entry->d_name, COUNTER_SEG_NAME_PREFIX, prefix_len)) {
+				continue;
+			}
+			pid = atoi(entry->d_name + prefix_len);
+			if (pid <= 0) {
+				continue;
+			}
+			it = counter_clients.find(pid);
+			if ((it != counter_clients.end()) && (it->second.ino == entry->d_ino)) {
+				continue;
+			}
+			counter_seg_attach(pid, entry->d_ino);
+			if (!counter_clients.count(pid) &&
+				(kill(pid, 0) == -1) && (errno == ESRCH)) {
+				// left behind by a client we never saw
+				shm_unlink(entry->d_name);
+			}
+		}
+		closedir(dir);
+	}
+
+	for (it = counter_clients.begin(); it != counter_clients.end(); it++) {
+		if ((kill(it->first, 0) == -1) && (errno == ESRCH)) {
+			dead.push_back(it->first);
+		}
+	}
+	for (size_t i = 0; i < dead.size(); i++) {
+		counter_seg_detach(dead[i], true);
+	}
+
+	// new segments, and event transport clients that just degraded
+	for (it = counter_clients.begin(); it != counter_clients.end(); it++) {
+		if (it->second.counting) {
+			continue;
+		}
+		mode = __atomic_load_n(&it->second.seg->mode, __ATOMIC_ACQUIRE);
+		if (mode == COUNTER_SEG_DEGRADED) {
+			counter_seg_degraded(it->first, it->second.seg->gen);
+		}
+		it->second.counting = (mode != COUNTER_SEG_EVENTS);
+	}
+}
+
+/*
+ * an event transport client switched to counting after dropping events.
+ * what its events told us is incomplete from then on, so it is dropped in
+ * favour of the counters, along with the events still on their way.
+ */
+void counter_seg_degraded(pid_t pid, uint32_t gen)
+{
+	map<pid_t, uint32_t>::iterator it;
+
+	if (((it = process_gens.find(pid)) != process_gens.end()) &&
+		(it->second == gen)) {
+		reclaim_process(pid);
+	}
+	degraded_gens[pid] = gen;
+}
+
+// events a running client dropped, 0 if it keeps no count
+uint64_t dropped_events(pid_t pid)
+{
+	map<pid_t, counter_client_t>::iterator it;
+
+	if ((it = counter_clients.find(pid)) == counter_clients.end()) {
+		return 0;
+	}
+	return __atomic_load_n(&it->second.seg->dropped_allocations,
+						   __ATOMIC_RELAXED) +
+		__atomic_load_n(&it->second.seg->dropped_frees, __ATOMIC_RELAXED);
+}
+
+// events dropped by the clients still running
+drop_counts_t sum_drops(uint32_t *num_processes)
+{
+	map<pid_t, counter_client_t>::iterator it;
+	drop_counts_t drops = drop_counts_t();
+	const counter_seg_t *seg;
+	uint64_t allocations, frees, samples;
+
+	*num_processes = 0;
+	for (it = counter_clients.begin(); it != counter_clients.end(); it++) {
+		seg = it->second.seg;
+		allocations = __atomic_load_n(&seg->dropped_allocations,
+									  __ATOMIC_RELAXED);
+		frees = __atomic_load_n(&seg->dropped_frees, __ATOMIC_RELAXED);
+		samples = __atomic_load_n(&seg->dropped_samples, __ATOMIC_RELAXED);
+		if (allocations || frees || samples) {
+			drops.allocations += allocations;
+			drops.frees += frees;
+			drops.bytes += __atomic_load_n(&seg->dropped_bytes,
+										   __ATOMIC_RELAXED);
+			drops.samples += samples;
+			drops.sample_bytes += __atomic_load_n(&seg->dropped_sample_bytes,
+												  __ATOMIC_RELAXED);
+			(*num_processes)++;
+		}
+	}
+
+	return drops;
+}
+
+// the only work counters mode clients cost stat_server
+void sum_counter_segs(void)
+{
+	map<pid_t, counter_client_t>::iterator it;
+	const counter_slab_t *slab;
+	counter_slab_t 		 *total;
+	uint32_t 			 num_slabs;
+	int64_t 			 live;
+
+	memset(counter_size_array, 0, sizeof(counter_size_array));
+	memcpy(cache_hits, exited_cache_hits, sizeof(cache_hits));
+	memcpy(cache_misses, exited_cache_misses, sizeof(cache_misses));
+	num_counting_clients = 0;
+
+	for (it = counter_clients.begin(); it != counter_clients.end(); it++) {
+		total = &it->second.total;
+		memset(total, 0, sizeof(*total));
+		num_slabs = min(__atomic_load_n(&it->second.seg->num_slabs_used,
+										__ATOMIC_ACQUIRE),
+						(uint32_t)COUNTER_SLABS);
+
+		// event transport clients count their cache hits here too
+		for (uint32_t i = 0; i < num_slabs; i++) {
+			slab = &it->second.seg->slabs[i];
+			for (uint32_t bin = 0; bin < NUM_CACHE_BINS; bin++) {
+				total->cache_hits[bin] +=
+					__atomic_load_n(&slab->cache_hits[bin], __ATOMIC_RELAXED);
+				total->cache_misses[bin] +=
+					__atomic_load_n(&slab->cache_misses[bin], __ATOMIC_RELAXED);
+			}
+		}
+		for (uint32_t bin = 0; bin < NUM_CACHE_BINS; bin++) {
+			cache_hits[bin] += total->cache_hits[bin];
+			cache_misses[bin] += total->cache_misses[bin];
+		}
+
+		if (!it->second.counting) {
+			continue;
+		}
+		num_counting_clients++;
+
+		for (uint32_t i = 0; i < num_slabs; i++) {
+			slab = &it->second.seg->slabs[i];
+			total->allocations += __atomic_load_n(&slab->allocations,
+												  __ATOMIC_RELAXED);
+			total->frees += __atomic_load_n(&slab->frees, __ATOMIC_RELAXED);
+			total->allocated_bytes += __atomic_load_n(&slab->allocated_bytes,
+													  __ATOMIC_RELAXED);
+			total->freed_bytes += __atomic_load_n(&slab->freed_bytes,
+												  __ATOMIC_RELAXED);
+			for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+				total->bin_allocations[bin] +=
+					__atomic_load_n(&slab->bin_allocations[bin],
+									__ATOMIC_RELAXED);
+				total->bin_frees[bin] +=
+					__atomic_load_n(&slab->bin_frees[bin], __ATOMIC_RELAXED);
+			}
+		}
+
+		// frees of blocks allocated before the hooks were up can
+		// outnumber allocations in a bin
+		for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+			live = total->bin_allocations[bin] - total->bin_frees[bin];
+			if (live > 0) {
+				counter_size_array[bin] += live;
+			}
+		}
+	}
+}
+
+uint64_t server_time_us(void)
+{
+	timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - server_start_time.tv_sec) * 1000000ULL +
+		(now.tv_nsec - server_start_time.tv_nsec) / 1000;
+}
+
+/*
+ * when the client made the call, on the server_time_us() scale. the
+ * client's coarse clock runs a little behind ours, and events queued
+ * before we started count as made at our start.
+ */
+uint64_t event_time_us(const msg_data_t *msg_data, uint64_t now_us)
+{
+	uint64_t start_ns = server_start_time.tv_sec * 1000000000ULL +
+		server_start_time.tv_nsec;
+	uint64_t time_us;
+
+	if (msg_data->time_ns <= start_ns) {
+		return 0;
+	}
+	time_us = (msg_data->time_ns - start_ns) / 1000;
+
+	return min(time_us, now_us);
+}
 
-int main()
+void record_latency(uint64_t latency_us)
 {
-	msg_t 	 msg;
-	key_t 	 msg_key, shm_key; 
-    int 	 msgid, shmid;
-	timeval  start_time, intermediate_time;
-	uint32_t elapsed_seconds;
-	uint32_t *shm;
+	uint32_t bin = 0;
 
-	cerr << "Server Started, pid: " << getpid() << endl;
-  
-    // ftok to generate unique key 
-    msg_key = ftok(MSG_KEY_STRING, MSG_KEY_INT); 
-  
-    // msgget creates a message queue and returns identifier 
-    msgid = msgget(msg_key, MSG_PERMISSIONS | IPC_CREAT);
+	latency_max_us = max(latency_max_us, latency_us);
+	latency_events++;
+	while ((latency_us >>= 1) && (bin < NUM_LATENCY_BINS - 1)) {
+		bin++;
+	}
+	latency_array[bin]++;
+}
 
-	// ftok to generate unique key 
-    shm_key = ftok(SHM_KEY_STRING, SHM_KEY_INT); 
-	
-	// shmget returns an identifier in shmid 
-    shmid = shmget(shm_key, SHM_SIZE, SHM_PERMISSIONS | IPC_CREAT);
+uint32_t find_site(process_t *proc, const void *caller)
+{
+	unordered_map<uintptr_t, uint32_t>::iterator it;
+	site_t site = site_t();
 
-	// initialize shm mutex area - 4 locks
-	shm = (uint32_t *) shmat(shmid, (void*)0, 0);
-	for (int i = 0; i < 4; i++) {
-		*shm = 0;
-		shm++;
+	it = proc->site_index.find((uintptr_t)caller);
+	if (it != proc->site_index.end()) {
+		return it->second;
 	}
 
-	// detach from shared memory
-	shmdt(shm); 
+	site.caller = (uintptr_t)caller;
+	proc->sites.push_back(site);
+	proc->site_index[site.caller] = proc->sites.size() - 1;
 
-	gettimeofday(&start_time, NULL);
+	return proc->sites.size() - 1;
+}
 
-	while (1) {
-	
-		// wait on message receive 
-		msgrcv(msgid, &msg, sizeof(msg_t), MSG_TYPE_VERKADA, 0);
+// one lookup by caller and size bin, the call site only for new pairs
+uint32_t find_churn(process_t *proc, const void *caller, uint32_t size_bin)
+{
+	unordered_map<uint64_t, uint32_t>::iterator it;
+	churn_t  churn = churn_t();
+	// user space code addresses fit in 56 bits
+	uint64_t key = (uintptr_t)caller | ((uint64_t)size_bin << 56);
 
-		if (msg.msg_data.size) {
-			// cerr << "Server Rx: Insertion " << msg.msg_data.ptr << ", "
-			//	 << msg.msg_data.size << endl;
-			
-			insert_allocation(msg.msg_data.ptr, msg.msg_data.size);
-		} else {
-			// zero size means remove
-			// cerr << "Server Rx: Removal " << msg.msg_data.ptr << endl;
-			remove_allocation(msg.msg_data.ptr);
-		}
+	it = proc->churn_index.find(key);
+	if (it != proc->churn_index.end()) {
+		return it->second;
+	}
 
-		gettimeofday(&intermediate_time, NULL);
+	churn.site 	   = find_site(proc, caller);
+	churn.size_bin = size_bin;
+	proc->churns.push_back(churn);
+	proc->churn_index[key] = proc->churns.size() - 1;
 
-		elapsed_seconds = (intermediate_time.tv_sec - start_time.tv_sec) +
-			(intermediate_time.tv_usec - start_time.tv_usec) / 1000000;
+	return proc->churns.size() - 1;
+}
 
-		if (elapsed_seconds >= 1) {
-			// for testing, break
-			print_stats(); // only about every 1 seconds
-			gettimeofday(&start_time, NULL);
-		}
-		
+// threads past MAX_THREADS_PER_PROCESS share the last index
+uint32_t find_thread(process_t *proc, uint32_t tid)
+{
+	unordered_map<uint32_t, uint16_t>::iterator it;
+	thread_t thread = thread_t();
+
+	it = proc->thread_index.find(tid);
+	if (it != proc->thread_index.end()) {
+		return it->second;
 	}
-                    
-    // destroy the message queue
-	cerr << "Server: Destroying msgQ" << endl;
-    msgctl(msgid, IPC_RMID, NULL); 
-	
-	return 0;
+
+	if (proc->threads.size() == MAX_THREADS_PER_PROCESS - 1) {
+		thread.tid = THREAD_TID_OTHERS;
+		proc->threads.push_back(thread);
+	}
+	if (proc->threads.size() == MAX_THREADS_PER_PROCESS) {
+		return MAX_THREADS_PER_PROCESS - 1;
+	}
+
+	thread.tid = tid;
+	proc->threads.push_back(thread);
+	proc->thread_index[tid] = proc->threads.size() - 1;
+
+	return proc->threads.size() - 1;
+}
+
+/*
+ * whether the event with seq and time_us happened before the other, by
+ * seq, see msg_data_t. stat_server gets one thread's events in order, but
+ * events of different threads in the order their batches come in. time_us
+ * is coarse but tells events too far apart for seq
+ */
+bool event_before(uint32_t seq, uint64_t time_us, uint32_t other_seq,
+				  uint64_t other_time_us)
+{
+	if (time_us + SEQ_WINDOW_US < other_time_us) {
+		return true;
+	}
+	if (other_time_us + SEQ_WINDOW_US < time_us) {
+		return false;
+	}
+	return seq_before(seq, other_seq);
 }
 
+// the slot a free of ptr goes to, whoever holds it now
+recent_free_t *recent_free(shard_t *shard, pid_t pid, void *ptr)
+{
+	uint64_t hash = ((uintptr_t)ptr ^ pid) * 0x9E3779B97F4A7C15ULL;
+
+	return &shard->recent_frees[hash >> (64 - RECENT_FREE_BITS)];
+}
 
-void insert_allocation(void *ptr, size_t size)
+// time_us is when the client allocated, now_us when we got to hear of it
+void insert_allocation(shard_t *shard, process_t *proc, void *ptr,
+					   size_t size, uint32_t align_bin, const void *caller,
+					   uint32_t tid, uint64_t time_us, uint64_t now_us,
+					   uint32_t seq)
 {
-    // record time
-    data_t data;
-    gettimeofday(&data.time, NULL);
+	site_t 		*site;
+	churn_t 	*churn;
+	thread_t 	*thread;
+
+	ptr_entry_t   *entry;
+	recent_free_t *free_event;
+	bool 		  existed;
+	uint32_t 	  size_bin;
+
+	if (ptr == NULL) {
+		// failed allocation
+		return;
+	}
 
-    // record size
-    data.size = size;
-	
     // calculate and record bin
-    size_t temp_size = size;
-    data.size_bin = 0; // save size_bin for fast removal from array_size
-    temp_size >>= 1;
-    while (temp_size >>= 1)
-    {
-        data.size_bin++;
-    }
-    data.size_bin =  min(data.size_bin, (uint32_t)(NUM_SIZE_BINS - 1));
+    size_bin = size_to_bin(size); // save size_bin for fast removal from array_size
+
+	entry = proc->map_data.insert(ptr, &existed);
+	if (existed && event_before(seq, time_us, entry->seq, entry->time_us)) {
+		// a late allocation, freed meanwhile and the address reused by the
+		// one we have. it and its late free are left out
+		return;
+	}
+	if (existed) {
+		// the free of the previous owner of this address was not seen, or
+		// is late and will be left out
+		shard->total_current_size -= entry->size * entry->weight;
+		proc->total_current_size -= entry->size * entry->weight;
+		proc->current_allocations -= entry->weight;
+		shard->size_array[entry->size_bin] -= entry->weight;
+		shard->align_array[entry->align_bin] -= entry->weight;
+		shard->age_histogram.remove(entry->time_us, now_us, entry->weight);
+		churn = &proc->churns[entry->churn];
+		churn->live_count -= entry->weight;
+		proc->sites[churn->site].live_bytes -= entry->size * entry->weight;
+		proc->sites[churn->site].live_count -= entry->weight;
+		proc->threads[entry->thread].live_bytes -= entry->size * entry->weight;
+		proc->threads[entry->thread].live_count -= entry->weight;
+	}
+
+    // record size, bin and time
+	entry->size 	= min((uint64_t)size, (uint64_t)PTR_ENTRY_MAX_SIZE);
+	entry->size_bin = size_bin;
+	entry->align_bin = align_bin;
+	entry->time_us 	= time_us;
+	entry->churn 	= find_churn(proc, caller, size_bin);
+	entry->thread 	= find_thread(proc, tid);
+	entry->weight 	= sample_weight(size, proc->sample_interval);
+	entry->seq 		= seq;
+	shard->age_histogram.add(entry->time_us, now_us, entry->weight);
+
+	churn = &proc->churns[entry->churn];
+	churn->live_count += entry->weight;
+	churn->peak_live_count = max(churn->peak_live_count, churn->live_count);
+	churn->interval_allocations += entry->weight;
+
+	site = &proc->sites[churn->site];
+	site->live_bytes += entry->size * entry->weight;
+	site->live_count += entry->weight;
+	site->interval_allocations += entry->weight;
+
+	thread = &proc->threads[entry->thread];
+	thread->live_bytes += entry->size * entry->weight;
+	thread->live_count += entry->weight;
+	thread->interval_allocations += entry->weight;
 
     // update data structures
-    map_data.insert(pair <void *, data_t> (ptr, data)); // add to master map data
-    overall_allocations++;		  // update total allocations
-    total_current_size += size;   // update current total size
-    size_array[data.size_bin]++;  // add to correct size bin for printing
+    shard->overall_allocations += entry->weight;		  // update total allocations
+    shard->total_current_size += entry->size * entry->weight;   // update current total size
+	proc->overall_allocations += entry->weight;
+	proc->total_current_size += entry->size * entry->weight;
+	proc->current_allocations += entry->weight;
+    shard->size_array[size_bin] += entry->weight;  // add to correct size bin for printing
+	shard->align_array[align_bin] += entry->weight;
+
+	free_event = recent_free(shard, proc->pid, ptr);
+	if (!existed && (free_event->ptr == (uintptr_t)ptr) &&
+		(free_event->pid == (uint32_t)proc->pid) &&
+		(free_event->gen == proc->gen) &&
+		event_before(seq, time_us, free_event->seq, free_event->time_us)) {
+		// its free, or a later one at this address, came in first
+		remove_allocation(shard, proc, ptr, free_event->tid,
+						  free_event->time_us, now_us, free_event->seq);
+	}
 }
 
-void remove_allocation(void *ptr)
+// time_us is when the client freed, now_us when we got to hear of it
+void remove_allocation(shard_t *shard, process_t *proc, void *ptr,
+					   uint32_t tid, uint64_t time_us, uint64_t now_us,
+					   uint32_t seq)
 {
-	map<void *, data_t>::iterator it;
+	ptr_entry_t  *entry;
+	site_t 		 *site;
+	churn_t 	 *churn;
+	thread_t 	 *thread;
+	uint32_t 	 free_thread;
+	cross_free_t *cross_free;
+	recent_free_t *free_event;
+	uint64_t 	 lifetime_us;
+
+	entry = proc->map_data.find(ptr);
+	if ((entry != NULL) &&
+		event_before(seq, time_us, entry->seq, entry->time_us)) {
+		// a late free of the allocation this one replaced
+		return;
+	}
+
+	free_event = recent_free(shard, proc->pid, ptr);
+	if ((free_event->ptr != (uintptr_t)ptr) ||
+		(free_event->pid != (uint32_t)proc->pid) ||
+		(free_event->gen != proc->gen) ||
+		event_before(free_event->seq, free_event->time_us, seq, time_us)) {
+		free_event->ptr 	= (uintptr_t)ptr;
+		free_event->pid 	= proc->pid;
+		free_event->gen 	= proc->gen;
+		free_event->seq 	= seq;
+		free_event->time_us = time_us;
+		free_event->tid 	= tid;
+	}
 
-	if ((it = map_data.find(ptr)) == map_data.end()) {
-		// ptr not in map - it must have been allocated before LD_PRELOAD set
+	if (entry == NULL) {
+		// ptr not in map - it must have been allocated before LD_PRELOAD
+		// set, or another thread has yet to send its allocation
 		return;
 	}
 
-	total_current_size -= it->second.size;   // reduce current total size
-	size_array[it->second.size_bin]--;  // reduce correct size bin by 1
-    map_data.erase(it);
+	shard->total_current_size -= entry->size * entry->weight;   // reduce current total size
+	proc->total_current_size -= entry->size * entry->weight;
+	proc->current_allocations -= entry->weight;
+	lifetime_us = (time_us > entry->time_us) ? time_us - entry->time_us : 0;
+	churn = &proc->churns[entry->churn];
+	churn->live_count -= entry->weight;
+	if (lifetime_us <= churn_window_us) {
+		churn->interval_short_lived += entry->weight;
+	}
+	site = &proc->sites[churn->site];
+	site->live_bytes -= entry->size * entry->weight;
+	site->live_count -= entry->weight;
+	site->interval_frees += entry->weight;
+	shard->overall_frees += entry->weight;
+
+	thread = &proc->threads[entry->thread];
+	thread->live_bytes -= entry->size * entry->weight;
+	thread->live_count -= entry->weight;
+	if (tid == thread->tid) {
+		thread->interval_frees += entry->weight;
+	} else {
+		// allocated on one thread, freed on another
+		free_thread = find_thread(proc, tid);
+		proc->threads[free_thread].interval_frees += entry->weight;
+		if (free_thread != entry->thread) {
+			cross_free = &proc->cross_frees[(entry->thread << 16) | free_thread];
+			cross_free->count += entry->weight;
+			cross_free->bytes += entry->size * entry->weight;
+			shard->overall_cross_frees += entry->weight;
+		}
+	}
+	shard->size_array[entry->size_bin] -= entry->weight;  // reduce correct size bin
+	shard->align_array[entry->align_bin] -= entry->weight;
+	shard->age_histogram.remove(entry->time_us, now_us, entry->weight);
+	shard->lifetimes[entry->size_bin].add(lifetime_us, entry->weight);
+    proc->map_data.erase(entry);
+}
+
+/*
+ * brings the shards' totals, bins, processes and call sites together for
+ * printing. each worker is held off only while its own shard is copied.
+ */
+void merge_shards(void)
+{
+	uint64_t now_us = server_time_us();
+	shard_t  *shard;
+	site_t 	 *summary;
+	process_summary_t *proc_summary;
+	map<pid_t, process_t *>::iterator it;
+
+	overall_allocations = 0;
+	overall_frees = 0;
+	overall_cross_frees = 0;
+	total_current_size = 0;
+	memset(size_array, 0, sizeof(size_array));
+	memset(align_array, 0, sizeof(align_array));
+	memset(age_array, 0, sizeof(age_array));
+	for (int bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		lifetime_array[bin].clear();
+	}
+	process_summaries.clear();
+	site_summaries.clear();
+	thread_summaries.clear();
+	cross_free_summaries.clear();
+	churn_summaries.clear();
+
+	print_interval = (now_us - last_print_time_us) / 1000000.0;
+	if (print_interval <= 0) {
+		print_interval = 1;
+	}
+	last_print_time_us = now_us;
+
+	for (uint32_t i = 0; i < num_shards; i++) {
+		shard = shards[i];
+		pthread_mutex_lock(&shard->lock);
+
+		overall_allocations += shard->overall_allocations;
+		overall_frees += shard->overall_frees;
+		overall_cross_frees += shard->overall_cross_frees;
+		total_current_size += shard->total_current_size;
+		for (int bin = 0; bin < NUM_SIZE_BINS; bin++) {
+			size_array[bin] += shard->size_array[bin];
+		}
+		for (int bin = 0; bin < NUM_ALIGN_BINS; bin++) {
+			align_array[bin] += shard->align_array[bin];
+		}
+		// Age bins are maintained incrementally, just bring them up to date
+		shard->age_histogram.advance(now_us);
+		for (int bin = 0; bin < NUM_AGE_BINS; bin++) {
+			age_array[bin] += shard->age_histogram.bins[bin];
+		}
+		for (int bin = 0; bin < NUM_SIZE_BINS; bin++) {
+			lifetime_array[bin].merge(shard->lifetimes[bin]);
+		}
+
+		for (it = shard->processes.begin(); it != shard->processes.end(); it++) {
+			proc_summary = &process_summaries[it->first];
+			proc_summary->overall_allocations += it->second->overall_allocations;
+			proc_summary->total_current_size += it->second->total_current_size;
+			proc_summary->current_allocations += it->second->current_allocations;
+			proc_summary->sample_interval = it->second->sample_interval;
+			proc_summary->tracked += it->second->map_data.size();
+			proc_summary->table_size += it->second->map_data.memory_used();
+
+			for (size_t j = 0; j < it->second->sites.size(); j++) {
+				site_t *site = &it->second->sites[j];
+				if (!site->live_count && !site->interval_allocations &&
+					!site->interval_frees) {
+					continue;
+				}
+				summary = &site_summaries[make_pair(it->first, site->caller)];
+				summary->caller = site->caller;
+				summary->live_bytes += site->live_bytes;
+				summary->live_count += site->live_count;
+				summary->interval_allocations += site->interval_allocations;
+				summary->interval_frees += site->interval_frees;
+
+				// start the next rate interval
+				site->interval_allocations = 0;
+				site->interval_frees = 0;
+			}
+
+			for (size_t j = 0; j < it->second->churns.size(); j++) {
+				churn_t *churn = &it->second->churns[j];
+				churn_t *churn_summary;
+				if (churn->interval_allocations || churn->interval_short_lived) {
+					churn_summary = &churn_summaries[make_pair(it->first,
+						make_pair(it->second->sites[churn->site].caller,
+								  churn->size_bin))];
+					churn_summary->size_bin = churn->size_bin;
+					churn_summary->live_count += churn->live_count;
+					churn_summary->peak_live_count += churn->peak_live_count;
+					churn_summary->interval_allocations +=
+						churn->interval_allocations;
+					churn_summary->interval_short_lived +=
+						churn->interval_short_lived;
+				}
+
+				churn->interval_allocations = 0;
+				churn->interval_short_lived = 0;
+			}
+
+			for (size_t j = 0; j < it->second->threads.size(); j++) {
+				thread_t *thread = &it->second->threads[j];
+				thread_t *thread_summary;
+				if (!thread->live_count && !thread->interval_allocations &&
+					!thread->interval_frees) {
+					continue;
+				}
+				thread_summary = &thread_summaries[make_pair(it->first,
+															 thread->tid)];
+				thread_summary->tid = thread->tid;
+				thread_summary->live_bytes += thread->live_bytes;
+				thread_summary->live_count += thread->live_count;
+				thread_summary->interval_allocations +=
+					thread->interval_allocations;
+				thread_summary->interval_frees += thread->interval_frees;
+
+				thread->interval_allocations = 0;
+				thread->interval_frees = 0;
+			}
+
+			for (unordered_map<uint32_t, cross_free_t>::iterator cit =
+					 it->second->cross_frees.begin();
+				 cit != it->second->cross_frees.end(); cit++) {
+				cross_free_t *cross_summary = &cross_free_summaries[
+					make_pair(it->first, make_pair(
+						it->second->threads[cit->first >> 16].tid,
+						it->second->threads[cit->first & 0xffff].tid))];
+				cross_summary->count += cit->second.count;
+				cross_summary->bytes += cit->second.bytes;
+			}
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
 }
 
 void print_stats(void)
 {
-	map<void *, data_t>::iterator it;
-	timeval current_time;
-	uint32_t elapsed_time;
-	uint32_t age_array[NUM_AGE_BINS] = {0};
-	uint32_t age_bin;
     time_t t = time(NULL);
-	double unit_sized;
-	uint32_t size_unit_index;
-	vector<string> size_units;
-	uint32_t max_bin_num, symbol_size;
+	uint64_t max_bin_num, symbol_size;
+	long num_allocations = 0;
+	long num_overall = counter_exited_allocations;
+	long current_size;
+	size_t table_size = 0;
+	map<pid_t, process_summary_t>::iterator it;
+	map<pid_t, counter_client_t>::iterator cit;
+	drop_counts_t drops;
+	uint32_t num_drop_processes;
     struct tm tam = *localtime(&t);
 
+	merge_shards();
+	num_overall += overall_allocations;
+	current_size = total_current_size;
+
+	// counters mode clients only show up here
+	sum_counter_segs();
+	for (cit = counter_clients.begin(); cit != counter_clients.end(); cit++) {
+		num_overall += cit->second.total.allocations;
+		num_allocations += cit->second.total.allocations -
+			cit->second.total.frees;
+		current_size += cit->second.total.allocated_bytes -
+			cit->second.total.freed_bytes;
+	}
+
     printf(">>>>>>>>>>>>>>>> %d-%02d-%02d %02d:%02d:%02d %s <<<<<<<<<<<<<<<<\n", tam.tm_mon + 1, tam.tm_mday,
            tam.tm_year + 1900, tam.tm_hour, tam.tm_min, tam.tm_sec, tam.tm_zone);
     printf("Overall stats:\n");
-    printf("%ld Overall allocations since start\n", overall_allocations);
+    printf("%ld Overall allocations since start\n", num_overall);
 	// print current total size in appropriate units
-	unit_sized = total_current_size;
-	size_units.push_back("");
-	size_units.push_back("KiB");
-	size_units.push_back("MiB");
-	size_units.push_back("GiB");
-	size_units.push_back("TiB");
-	size_unit_index = 0;
-	while ((unit_sized > 1024) &&
-		   (size_unit_index < (size_units.size() - 1))) {
-		unit_sized /= 1024;
-		size_unit_index++;
-	}
-	printf("%.1f", unit_sized);
-	cerr << size_units.at(size_unit_index);
+	cerr << size_string(current_size);
 	printf(" Current total allocated size\n");
-	printf("\n\n");
+	for (it = process_summaries.begin(); it != process_summaries.end(); it++) {
+		num_allocations += it->second.current_allocations;
+		table_size += it->second.table_size;
+	}
+	printf("%ld Current allocations in %ld processes, %s table\n",
+		   num_allocations,
+		   (long)(process_summaries.size() + num_counting_clients),
+		   size_string(table_size).c_str());
 
-	// Create age bins
-	gettimeofday(&current_time, NULL);
-	for (it = map_data.begin(); it != map_data.end(); it++) {
-		elapsed_time = (current_time.tv_sec - it->second.time.tv_sec) +
-			(current_time.tv_usec - it->second.time.tv_usec) / 1000000;
-		
-	    age_bin = LESS_THAN_1_SEC;
-		while ((elapsed_time > 1) &&
-			   (age_bin < EQUAL_TO_OR_OVER_1000_SEC)) {
-			elapsed_time /= 10;
-			age_bin++;
-		}
-		age_array[age_bin]++;
-		// printf("map size: %ld, current age bin: %d\n", map_data.size(), age_bin);
+	drops = sum_drops(&num_drop_processes);
+	drops.allocations += exited_drops.allocations;
+	drops.frees += exited_drops.frees;
+	drops.bytes += exited_drops.bytes;
+	drops.samples += exited_drops.samples;
+	drops.sample_bytes += exited_drops.sample_bytes;
+	if (drops.allocations || drops.frees) {
+		printf("%lu events dropped on full queues since start (%lu "
+			   "allocations of %s, %lu frees), %u running processes "
+			   "incomplete\n", (unsigned long)(drops.allocations + drops.frees),
+			   (unsigned long)drops.allocations, size_string(drops.bytes).c_str(),
+			   (unsigned long)drops.frees, num_drop_processes);
 	}
+	if (drops.samples) {
+		printf("%lu sampled allocations of %s dropped on full sample sets "
+			   "since start\n", (unsigned long)drops.samples,
+			   size_string(drops.sample_bytes).c_str());
+	}
+	snapshot.dropped_allocations  = drops.allocations;
+	snapshot.dropped_frees 		  = drops.frees;
+	snapshot.dropped_bytes 		  = drops.bytes;
+	snapshot.dropped_samples 	  = drops.samples;
+	snapshot.dropped_sample_bytes = drops.sample_bytes;
+
+	snapshot.time_us 			 = t * 1000000ULL;
+	snapshot.overall_allocations = num_overall;
+	snapshot.current_size 		 = current_size;
+	snapshot.current_allocations = num_allocations;
+	snapshot.table_size 		 = table_size;
+	print_latency_stats();
+	printf("\n\n");
+
+	print_process_stats();
+	print_site_stats();
+	print_pool_candidates();
+	print_cache_stats();
+	print_thread_stats();
 
 	// Normalize symbol
 	symbol_size = 1;
-	max_bin_num = get_max_bin_num(age_array);
+	max_bin_num = get_max_bin_num();
 	while (max_bin_num > 40) { // reduce symbol count 20 or below
 		max_bin_num >>= 1;
 		symbol_size <<= 1;
 	}
 	
-	printf("Current allocations by size: (# - %d current allocations)\n",
-		   symbol_size);
-    printf("0 - 3 bytes: ");
-    print_size_symbol(0, symbol_size);
-    printf("\n");
-    printf("4 - 7 bytes: ");
-    print_size_symbol(1, symbol_size);
-    printf("\n");
-    printf("8 - 15 bytes: ");
-    print_size_symbol(2, symbol_size);
-    printf("\n");
-    printf("16 - 31 bytes: ");
-    print_size_symbol(3, symbol_size);
-    printf("\n");
-    printf("32 - 63 bytes: ");
-    print_size_symbol(4, symbol_size);
-    printf("\n");
-    printf("64 - 127 bytes: ");
-    print_size_symbol(5, symbol_size);
-    printf("\n");
-    printf("128 - 255 bytes: ");
-    print_size_symbol(6, symbol_size);
-    printf("\n");
-    printf("256 - 511 bytes: ");
-    print_size_symbol(7, symbol_size);
-    printf("\n");
-    printf("512 - 1023 bytes: ");
-    print_size_symbol(8, symbol_size);
-    printf("\n");
-    printf("1024 - 2047 bytes: ");
-    print_size_symbol(9, symbol_size);
-    printf("\n");
-    printf("2048 - 4095 bytes: ");
-    print_size_symbol(10, symbol_size);
-    printf("\n");
-    printf("4096+: ");
-    print_size_symbol(11, symbol_size);
-    printf("\n");
+	printf("Current allocations by size: (# - %lu current allocations)\n",
+		   (unsigned long)symbol_size);
+	// only the bins in use, there are many fine grained ones
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		if (size_array[bin] + counter_size_array[bin]) {
+			printf("%s: ", size_bin_string(bin).c_str());
+			print_size_symbol(bin, symbol_size);
+			printf("\n");
+		}
+	}
+	for (int i = 0; i < NUM_SIZE_BINS; i++) {
+		snapshot.size_array[i] = size_array[i] + counter_size_array[i];
+	}
 
 	printf("\n\n");
 
+	print_align_stats(symbol_size);
+	memcpy(snapshot.align_array, align_array, sizeof(align_array));
+
 	// print time table
-	printf("Current allocations by age: (# - %d current allocations)\n",
-		   symbol_size);
+	printf("Current allocations by age: (# - %lu current allocations)\n",
+		   (unsigned long)symbol_size);
+	if (num_counting_clients) {
+		printf("(not including %ld counters mode processes)\n",
+			   (long)num_counting_clients);
+	}
 	
 	printf("< 1 sec: ");
-    print_age_symbol(age_array, (uint32_t)LESS_THAN_1_SEC, symbol_size);
+    print_age_symbol((uint32_t)LESS_THAN_1_SEC, symbol_size);
 	printf("\n");
 
 	printf("< 10 sec: ");
-    print_age_symbol(age_array, (uint32_t)LESS_THAN_10_SEC, symbol_size);
+    print_age_symbol((uint32_t)LESS_THAN_10_SEC, symbol_size);
 	printf("\n");
 
 	printf("< 100 sec: ");
-    print_age_symbol(age_array, (uint32_t)LESS_THAN_100_SEC, symbol_size);
+    print_age_symbol((uint32_t)LESS_THAN_100_SEC, symbol_size);
 	printf("\n");
 
 	printf("< 1000 sec: ");
-    print_age_symbol(age_array, (uint32_t)LESS_THAN_1000_SEC, symbol_size);
+    print_age_symbol((uint32_t)LESS_THAN_1000_SEC, symbol_size);
 	printf("\n");
 
 	printf(">= 1000 sec: ");
-    print_age_symbol(age_array, (uint32_t)EQUAL_TO_OR_OVER_1000_SEC, symbol_size);
+    print_age_symbol((uint32_t)EQUAL_TO_OR_OVER_1000_SEC, symbol_size);
+	printf("\n");
+	memcpy(snapshot.age_array, age_array, sizeof(age_array));
+	printf("\n\n");
+
+	print_lifetime_stats();
+
+	if ((export_path != NULL) && !stats_export_write(export_path, snapshot)) {
+		perror(export_path);
+	}
+}
+
+// size in appropriate units
+string size_string(double size)
+{
+	const char *size_units[] = { "", "KiB", "MiB", "GiB", "TiB" };
+	uint32_t 	size_unit_index = 0;
+	char 		buf[32];
+
+	// gaps can be negative
+	while (((size > 1024) || (size < -1024)) &&
+		   (size_unit_index < (sizeof(size_units) / sizeof(size_units[0]) - 1))) {
+		size /= 1024;
+		size_unit_index++;
+	}
+	snprintf(buf, sizeof(buf), "%.1f%s", size, size_units[size_unit_index]);
+
+	return buf;
+}
+
+// duration in appropriate units
+string duration_string(uint64_t time_us)
+{
+	char buf[32];
+
+	if (time_us < 1000) {
+		snprintf(buf, sizeof(buf), "%luus", (unsigned long)time_us);
+	} else if (time_us < 1000000) {
+		snprintf(buf, sizeof(buf), "%.1fms", time_us / 1000.0);
+	} else {
+		snprintf(buf, sizeof(buf), "%.1fs", time_us / 1000000.0);
+	}
+
+	return buf;
+}
+
+/*
+ * how far behind the clients we are, from their call to handle_event().
+ * includes the time events wait in the client's batch, and the client's
+ * clock only ticks every few ms.
+ */
+void print_latency_stats(void)
+{
+	const double percentiles[] = { 0.5, 0.99 };
+	const char 	 *names[] = { "p50", "p99" };
+	uint64_t 	 *bounds[] = { &snapshot.latency_p50_us,
+							   &snapshot.latency_p99_us };
+	uint64_t 	 count = 0;
+	uint32_t 	 bin = 0;
+	timespec 	 res;
+
+	snapshot.latency_events = latency_events;
+	snapshot.latency_max_us = latency_max_us;
+	snapshot.latency_p50_us = snapshot.latency_p99_us = 0;
+	if (latency_events == 0) {
+		return;
+	}
+
+	clock_getres(EVENT_CLOCK, &res);
+	printf("Queue latency over %lu events:", (unsigned long)latency_events);
+	for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+		while ((bin < NUM_LATENCY_BINS - 1) &&
+			   (count + latency_array[bin] < percentiles[p] * latency_events)) {
+			count += latency_array[bin++];
+		}
+		*bounds[p] = 2ULL << bin;
+		printf(" %s < %s,", names[p], duration_string(*bounds[p]).c_str());
+	}
+	printf(" max %s (client clock resolution %s)\n",
+		   duration_string(latency_max_us).c_str(),
+		   duration_string(res.tv_nsec / 1000).c_str());
+
+	// start the next interval
+	memset(latency_array, 0, sizeof(latency_array));
+	latency_events = 0;
+	latency_max_us = 0;
+}
+
+/*
+ * how long the allocations freed since start lived, by size. sizes whose
+ * p99 stays short are candidates for a per-request arena.
+ */
+void print_lifetime_stats(void)
+{
+	lifetime_hist *hist;
+
+	printf("Lifetimes of freed allocations by size:\n");
+	if (num_counting_clients) {
+		printf("(not including %ld counters mode processes)\n",
+			   (long)num_counting_clients);
+	}
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		hist = &lifetime_array[bin];
+		snapshot.lifetime_count[bin]  = hist->count;
+		snapshot.lifetime_p50_us[bin] = hist->percentile(0.5);
+		snapshot.lifetime_p99_us[bin] = hist->percentile(0.99);
+		snapshot.lifetime_max_us[bin] = hist->max_us;
+		if (hist->count == 0) {
+			continue;
+		}
+		printf("%s: %lu freed, p50 <= %s, p99 <= %s, max %s\n",
+			   size_bin_string(bin).c_str(), (unsigned long)hist->count,
+			   duration_string(snapshot.lifetime_p50_us[bin]).c_str(),
+			   duration_string(snapshot.lifetime_p99_us[bin]).c_str(),
+			   duration_string(hist->max_us).c_str());
+	}
+}
+
+// largest processes by current total size
+void print_process_stats(void)
+{
+	vector<pair<long, size_t> > by_size;
+	map<pid_t, process_summary_t>::iterator it;
+	map<pid_t, counter_client_t>::iterator cit;
+	process_summary_t *proc;
+	counter_slab_t *total;
+	export_process_t *export_proc;
+	uint64_t num_dropped;
+	uint64_t anon = 0, rss = 0;
+	long requested = 0;
+	uint32_t num_read = 0;
+	pid_t pid;
+
+	// all of them are exported, only the largest printed
+	snapshot.processes.clear();
+	for (it = process_summaries.begin(); it != process_summaries.end(); it++) {
+		if (((cit = counter_clients.find(it->first)) != counter_clients.end()) &&
+			cit->second.counting) {
+			// degraded, the shards may not have reclaimed its events yet
+			continue;
+		}
+		snapshot.processes.push_back(export_process_t());
+		export_proc = &snapshot.processes.back();
+		export_proc->pid 				 = it->first;
+		export_proc->current_size 		 = it->second.total_current_size;
+		export_proc->current_allocations = it->second.current_allocations;
+		export_proc->overall_allocations = it->second.overall_allocations;
+		export_proc->sample_interval 	 = it->second.sample_interval;
+		export_proc->counters 			 = false;
+		export_proc->dropped_events 	 = dropped_events(it->first);
+	}
+	for (cit = counter_clients.begin(); cit != counter_clients.end(); cit++) {
+		if (!cit->second.counting) {
+			// only reports drops, its events are in process_summaries
+			continue;
+		}
+		total = &cit->second.total;
+		snapshot.processes.push_back(export_process_t());
+		export_proc = &snapshot.processes.back();
+		export_proc->pid 				 = cit->first;
+		export_proc->current_size 		 = total->allocated_bytes -
+			total->freed_bytes;
+		export_proc->current_allocations = total->allocations - total->frees;
+		export_proc->overall_allocations = total->allocations;
+		export_proc->sample_interval 	 = 0;
+		export_proc->counters 			 = true;
+		export_proc->dropped_events 	 = dropped_events(cit->first);
+	}
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		export_proc = &snapshot.processes[i];
+		read_process_memory(export_proc);
+		by_size.push_back(make_pair(export_proc->current_size, i));
+		if (export_proc->mem_read) {
+			requested += export_proc->current_size;
+			anon 	  += export_proc->anon_bytes;
+			rss 	  += export_proc->rss_bytes;
+			num_read++;
+		}
+	}
+	sort(by_size.rbegin(), by_size.rend());
+	if (by_size.size() > PROCESSES_TO_PRINT) {
+		by_size.resize(PROCESSES_TO_PRINT);
+	}
+
+	printf("Current allocations by process:\n");
+	if (num_read) {
+		printf("%s requested, %s anonymous resident (%s RSS) in %u "
+			   "processes, %s gap\n", size_string(requested).c_str(),
+			   size_string(anon).c_str(), size_string(rss).c_str(), num_read,
+			   size_string((double)anon - requested).c_str());
+	}
+	for (size_t i = 0; i < by_size.size(); i++) {
+		export_proc = &snapshot.processes[by_size[i].second];
+		pid = export_proc->pid;
+		num_dropped = export_proc->dropped_events;
+		if (export_proc->counters) {
+			total = &counter_clients[pid].total;
+			printf("pid %d: %s in %ld allocations, %ld since start "
+				   "(counters", pid, size_string(by_size[i].first).c_str(),
+				   (long)(total->allocations - total->frees),
+				   (long)total->allocations);
+			if (degraded_gens.count(pid)) {
+				// counts only what was allocated and freed since
+				printf(", degraded after %lu dropped events",
+					   (unsigned long)num_dropped);
+			}
+			printf(")\n");
+			print_process_memory(export_proc);
+			continue;
+		}
+		proc = &process_summaries[pid];
+		printf("pid %d: %s in %ld allocations, %ld since start",
+			   pid, size_string(proc->total_current_size).c_str(),
+			   proc->current_allocations, proc->overall_allocations);
+		if (proc->sample_interval) {
+			// estimates scaled up from the sampled allocations
+			printf(" (sampled every %s, %ld tracked)",
+				   size_string(proc->sample_interval).c_str(),
+				   (long)proc->tracked);
+		}
+		if (num_dropped) {
+			printf(" (%lu events dropped)", (unsigned long)num_dropped);
+		}
+		printf("\n");
+		print_process_memory(export_proc);
+	}
+	printf("\n\n");
+}
+
+// what the process takes, from /proc and from malloc if it reports
+void read_process_memory(export_process_t *export_proc)
+{
+	proc_mem_t mem;
+	msg_data_t stamp = msg_data_t();
+	uint64_t   now_us;
+	map<pid_t, heap_info_t>::iterator it;
+
+	if ((export_proc->mem_read = proc_mem_read(export_proc->pid, &mem))) {
+		export_proc->rss_bytes 		= mem.rss;
+		export_proc->anon_bytes 	= mem.anon;
+		export_proc->pss_anon_bytes = mem.pss_anon;
+		export_proc->swap_bytes 	= mem.swap;
+	}
+
+	if ((it = heap_infos.find(export_proc->pid)) != heap_infos.end()) {
+		export_proc->heap_info 				 = true;
+		export_proc->malloc_in_use_bytes 	 = it->second.in_use +
+			it->second.mmapped;
+		export_proc->malloc_free_bytes 		 = it->second.free;
+		export_proc->malloc_releasable_bytes = it->second.releasable;
+		// sent only while the process allocates or frees
+		stamp.time_ns = it->second.time_ns;
+		now_us = server_time_us();
+		export_proc->heap_info_age_us 		 = now_us -
+			event_time_us(&stamp, now_us);
+	}
+}
+
+/*
+ * the gap between requested bytes and anonymous RSS is malloc's overhead
+ * per chunk, free memory it has not returned, and anonymous memory that
+ * is not heap at all (thread stacks, private mmaps). malloc's own numbers
+ * split the first two apart.
+ */
+void print_process_memory(const export_process_t *export_proc)
+{
+	if (!export_proc->mem_read) {
+		return;
+	}
+
+	printf("    %s anonymous resident",
+		   size_string(export_proc->anon_bytes).c_str());
+	if (export_proc->swap_bytes) {
+		printf(" + %s swapped", size_string(export_proc->swap_bytes).c_str());
+	}
+	printf(", %s RSS, %s gap", size_string(export_proc->rss_bytes).c_str(),
+		   size_string((double)export_proc->anon_bytes -
+					   export_proc->current_size).c_str());
+	printf("\n");
+	if (export_proc->heap_info) {
+		printf("    malloc: %s in use, %s free (%s at the top of the heap), "
+			   "as of %s ago\n",
+			   size_string(export_proc->malloc_in_use_bytes).c_str(),
+			   size_string(export_proc->malloc_free_bytes).c_str(),
+			   size_string(export_proc->malloc_releasable_bytes).c_str(),
+			   duration_string(export_proc->heap_info_age_us).c_str());
+	}
+}
+
+/*
+ * call sites with the most live bytes across all processes, with their
+ * allocation and free rates since the last call. only the printed sites
+ * get symbolized.
+ */
+void print_site_stats(void)
+{
+	vector<pair<long, pair<pid_t, uintptr_t> > > by_size;
+	map<pair<pid_t, uintptr_t>, site_t>::iterator it;
+	double 	 interval = print_interval;
+	site_t 	 *site;
+	size_t 	 num_print;
+	export_site_t export_site;
+
+	for (it = site_summaries.begin(); it != site_summaries.end(); it++) {
+		site = &it->second;
+		if (site->live_count || site->interval_allocations) {
+			by_size.push_back(make_pair(site->live_bytes, it->first));
+		}
+	}
+	num_print = min(by_size.size(), (size_t)SITES_TO_PRINT);
+	partial_sort(by_size.begin(), by_size.begin() + num_print, by_size.end(),
+				 greater<pair<long, pair<pid_t, uintptr_t> > >());
+
+	snapshot.sites.clear();
+	printf("Top call sites by current allocated size:\n");
+	for (size_t i = 0; i < num_print; i++) {
+		pid_t pid = by_size[i].second.first;
+		site = &site_summaries[by_size[i].second];
+		printf("%s in %ld allocations, %.0f allocs/s, %.0f frees/s: "
+			   "pid %d %s\n", size_string(site->live_bytes).c_str(),
+			   site->live_count, site->interval_allocations / interval,
+			   site->interval_frees / interval, pid,
+			   site_symbol(pid, site->caller).c_str());
+
+		export_site.pid 				= pid;
+		export_site.caller 				= site->caller;
+		export_site.symbol 				= site_symbol(pid, site->caller);
+		export_site.live_bytes 			= site->live_bytes;
+		export_site.live_count 			= site->live_count;
+		export_site.allocations_per_sec = site->interval_allocations / interval;
+		export_site.frees_per_sec 		= site->interval_frees / interval;
+		snapshot.sites.push_back(export_site);
+	}
+	printf("\n\n");
+}
+
+// symbolized once, only the printed sites get looked up
+const string &site_symbol(pid_t pid, uintptr_t caller)
+{
+	map<pair<pid_t, uintptr_t>, string>::iterator it;
+
+	if ((it = site_symbols.find(make_pair(pid, caller))) == site_symbols.end()) {
+		it = site_symbols.insert(make_pair(make_pair(pid, caller),
+										   symbolize(pid, caller))).first;
+	}
+	return it->second;
+}
+
+/*
+ * call site and size pairs whose allocations are mostly freed within
+ * churn_window_us, most short lived per second first. a pool or free list
+ * holding the most that were ever live at once would serve all of them.
+ */
+void print_pool_candidates(void)
+{
+	vector<pair<long, pair<pid_t, pair<uintptr_t, uint32_t> > > > by_rate;
+	map<pair<pid_t, pair<uintptr_t, uint32_t> >, churn_t>::iterator it;
+	churn_t  *churn;
+	pid_t 	 pid;
+	uint64_t capacity;
+	size_t 	 num_print;
+	export_pool_candidate_t export_candidate;
+
+	for (it = churn_summaries.begin(); it != churn_summaries.end(); it++) {
+		churn = &it->second;
+		if ((churn->interval_short_lived / print_interval >=
+			 POOL_MIN_SHORT_LIVED_RATE) &&
+			(churn->interval_short_lived * 2 >= churn->interval_allocations)) {
+			by_rate.push_back(make_pair(churn->interval_short_lived, it->first));
+		}
+	}
+	num_print = min(by_rate.size(), (size_t)POOL_CANDIDATES_TO_PRINT);
+	partial_sort(by_rate.begin(), by_rate.begin() + num_print, by_rate.end(),
+				 greater<pair<long, pair<pid_t, pair<uintptr_t, uint32_t> > > >());
+
+	snapshot.pool_candidates.clear();
+	printf("Pool candidates, freed within %s:\n",
+		   duration_string(churn_window_us).c_str());
+	for (size_t i = 0; i < num_print; i++) {
+		pid   = by_rate[i].second.first;
+		churn = &churn_summaries[by_rate[i].second];
+		// power of two at or above the peak
+		capacity = 1;
+		while (capacity < (uint64_t)churn->peak_live_count) {
+			capacity <<= 1;
+		}
+		printf("%.0f/s of %s (%.0f%% of allocations), peak %ld live, pool of "
+			   "%lu: pid %d %s\n", churn->interval_short_lived / print_interval,
+			   size_bin_string(churn->size_bin).c_str(),
+			   100.0 * churn->interval_short_lived /
+			   max(churn->interval_allocations, 1L), churn->peak_live_count,
+			   (unsigned long)capacity, pid,
+			   site_symbol(pid, by_rate[i].second.second.first).c_str());
+
+		export_candidate.pid 				 = pid;
+		export_candidate.caller 			 = by_rate[i].second.second.first;
+		export_candidate.symbol 			 = site_symbol(pid,
+			by_rate[i].second.second.first);
+		export_candidate.min_bytes 			 = size_bin_min(churn->size_bin);
+		export_candidate.short_lived_per_sec = churn->interval_short_lived /
+			print_interval;
+		export_candidate.allocations_per_sec = churn->interval_allocations /
+			print_interval;
+		export_candidate.peak_live_count 	 = churn->peak_live_count;
+		export_candidate.capacity 			 = capacity;
+		snapshot.pool_candidates.push_back(export_candidate);
+	}
+	printf("\n\n");
+}
+
+/*
+ * how often the clients' small object caches served an allocation on
+ * their own, by size bin, since start. printed only once some client
+ * runs with STAT_MALLOC_CACHE.
+ */
+void print_cache_stats(void)
+{
+	uint64_t hits = 0, misses = 0;
+	export_cache_bin_t export_bin;
+
+	snapshot.cache_bins.clear();
+	for (uint32_t bin = 0; bin < NUM_CACHE_BINS; bin++) {
+		if (cache_hits[bin] + cache_misses[bin] == 0) {
+			continue;
+		}
+		hits += cache_hits[bin];
+		misses += cache_misses[bin];
+
+		export_bin.min_bytes = size_bin_min(bin);
+		export_bin.hits 	 = cache_hits[bin];
+		export_bin.misses 	 = cache_misses[bin];
+		snapshot.cache_bins.push_back(export_bin);
+	}
+	if (hits + misses == 0) {
+		return;
+	}
+
+	printf("Small object cache: %.1f%% hits of %lu allocations since start\n",
+		   100.0 * hits / (hits + misses), (unsigned long)(hits + misses));
+	for (size_t i = 0; i < snapshot.cache_bins.size(); i++) {
+		export_bin = snapshot.cache_bins[i];
+		printf("%s: %.1f%% hits of %lu\n",
+			   size_bin_string(size_to_bin(export_bin.min_bytes)).c_str(),
+			   100.0 * export_bin.hits / (export_bin.hits + export_bin.misses),
+			   (unsigned long)(export_bin.hits + export_bin.misses));
+	}
+	printf("\n\n");
+}
+
+/*
+ * threads with the most live bytes across all processes, with their
+ * allocation and free rates since the last call, then the allocating to
+ * freeing thread pairs with the most cross thread frees since start.
+ */
+void print_thread_stats(void)
+{
+	vector<pair<long, pair<pid_t, uint32_t> > > by_size;
+	vector<pair<long, pair<pid_t, pair<uint32_t, uint32_t> > > > by_count;
+	map<pair<pid_t, uint32_t>, thread_t>::iterator it;
+	map<pair<pid_t, pair<uint32_t, uint32_t> >, cross_free_t>::iterator cit;
+	thread_t 	 *thread;
+	cross_free_t *cross_free;
+	size_t 		 num_print;
+	export_thread_t 	export_thread;
+	export_cross_free_t export_cross_free;
+
+	for (it = thread_summaries.begin(); it != thread_summaries.end(); it++) {
+		by_size.push_back(make_pair(it->second.live_bytes, it->first));
+	}
+	num_print = min(by_size.size(), (size_t)THREADS_TO_PRINT);
+	partial_sort(by_size.begin(), by_size.begin() + num_print, by_size.end(),
+				 greater<pair<long, pair<pid_t, uint32_t> > >());
+
+	snapshot.threads.clear();
+	printf("Top threads by current allocated size:\n");
+	for (size_t i = 0; i < num_print; i++) {
+		thread = &thread_summaries[by_size[i].second];
+		printf("%s in %ld allocations, %.0f allocs/s, %.0f frees/s: "
+			   "pid %d tid ", size_string(thread->live_bytes).c_str(),
+			   thread->live_count, thread->interval_allocations / print_interval,
+			   thread->interval_frees / print_interval, by_size[i].second.first);
+		if (thread->tid == THREAD_TID_OTHERS) {
+			printf("(others)\n");
+		} else {
+			printf("%u\n", thread->tid);
+		}
+
+		export_thread.pid 				  = by_size[i].second.first;
+		export_thread.tid 				  = thread->tid;
+		export_thread.live_bytes 		  = thread->live_bytes;
+		export_thread.live_count 		  = thread->live_count;
+		export_thread.allocations_per_sec = thread->interval_allocations /
+			print_interval;
+		export_thread.frees_per_sec 	  = thread->interval_frees /
+			print_interval;
+		snapshot.threads.push_back(export_thread);
+	}
 	printf("\n");
+
+	for (cit = cross_free_summaries.begin(); cit != cross_free_summaries.end();
+		 cit++) {
+		by_count.push_back(make_pair(cit->second.count, cit->first));
+	}
+	num_print = min(by_count.size(), (size_t)CROSS_FREES_TO_PRINT);
+	partial_sort(by_count.begin(), by_count.begin() + num_print, by_count.end(),
+				 greater<pair<long, pair<pid_t, pair<uint32_t, uint32_t> > > >());
+
+	snapshot.overall_frees 		 = overall_frees;
+	snapshot.overall_cross_frees = overall_cross_frees;
+	snapshot.cross_frees.clear();
+	printf("Cross thread frees: %ld of %ld frees since start (%.1f%%)\n",
+		   overall_cross_frees, overall_frees,
+		   overall_frees ? 100.0 * overall_cross_frees / overall_frees : 0.0);
+	for (size_t i = 0; i < num_print; i++) {
+		cross_free = &cross_free_summaries[by_count[i].second];
+		printf("%ld frees of %s: pid %d tid %u -> tid %u\n", cross_free->count,
+			   size_string(cross_free->bytes).c_str(), by_count[i].second.first,
+			   by_count[i].second.second.first, by_count[i].second.second.second);
+
+		export_cross_free.pid 		= by_count[i].second.first;
+		export_cross_free.alloc_tid = by_count[i].second.second.first;
+		export_cross_free.free_tid 	= by_count[i].second.second.second;
+		export_cross_free.count 	= cross_free->count;
+		export_cross_free.bytes 	= cross_free->bytes;
+		snapshot.cross_frees.push_back(export_cross_free);
+	}
+	printf("\n\n");
 }
 
-uint32_t get_max_bin_num(uint32_t *age_array)
+uint64_t get_max_bin_num(void)
 {
-	uint32_t max_num = 0;
+	uint64_t max_num = 0;
 	for (int i = 0; i < NUM_SIZE_BINS; i++) {
-		if (max_num < size_array[i]) {
-			max_num = size_array[i];
+		if (max_num < size_array[i] + counter_size_array[i]) {
+			max_num = size_array[i] + counter_size_array[i];
 		}
 	}
 
@@ -319,15 +2651,15 @@ uint32_t get_max_bin_num(uint32_t *age_array)
 	return max_num;
 }
 
-void print_size_symbol(uint32_t bin, uint32_t symbol_size)
+void print_size_symbol(uint32_t bin, uint64_t symbol_size)
 {
-    uint32_t num;
+    uint64_t num;
 
     if (bin >= NUM_SIZE_BINS) {
         return;
     }
 
-    num = size_array[bin];
+    num = size_array[bin] + counter_size_array[bin];
 
 	// normalize per symbol size
 	num /= symbol_size;
@@ -337,9 +2669,9 @@ void print_size_symbol(uint32_t bin, uint32_t symbol_size)
     }
 }
 
-void print_age_symbol(uint32_t *age_array, uint32_t bin, uint32_t symbol_size)
+void print_age_symbol(uint32_t bin, uint64_t symbol_size)
 {
-    uint32_t num;
+    uint64_t num;
 
     if (bin >= NUM_AGE_BINS) {
         return;
@@ -354,3 +2686,31 @@ void print_age_symbol(uint32_t *age_array, uint32_t bin, uint32_t symbol_size)
         num--;
     }
 }
+
+// aligned allocations are a subset of the size bins, same scale
+void print_align_stats(uint64_t symbol_size)
+{
+	const char *align_labels[NUM_ALIGN_BINS] = {
+		"", "<= 16 bytes", "32 bytes", "64 bytes", "128 bytes", "256 bytes",
+		"512 bytes", "1024 bytes", "2048 bytes", "4096+ bytes",
+	};
+	uint64_t num_aligned = 0;
+
+	for (uint32_t bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+		num_aligned += align_array[bin];
+	}
+	if (num_aligned == 0) {
+		return;
+	}
+
+	printf("Current aligned allocations by alignment: "
+		   "(# - %lu current allocations)\n", (unsigned long)symbol_size);
+	for (uint32_t bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+		printf("%s: ", align_labels[bin]);
+		for (uint64_t num = align_array[bin] / symbol_size; num; num--) {
+			printf("#");
+		}
+		printf("\n");
+	}
+	printf("\n\n");
+}
@@ -11,34 +11,351 @@
 #ifndef STAT_SERVER_H_INCLUDED
 #define STAT_SERVER_H_INCLUDED
 
-#include <sys/ipc.h> // msgQ/shared memory
-#include <sys/shm.h> // shared memory
+#include <stdint.h>
+#include <stddef.h> // size_t
+#include <unistd.h> // syscall
+#include <sys/syscall.h> // SYS_gettid
+#include <math.h> // expm1
+#include <time.h> // EVENT_CLOCK
+#include <sys/ipc.h> // msgQ
 #include <sys/msg.h> // msgQ
 
 
 #define MSG_KEY_STRING			"verkada_msg"
 #define	MSG_KEY_INT	   			2019
 
-#define SHM_KEY_STRING			"verkada_shm"
-#define	SHM_KEY_INT	   			2019
-
 #define MSG_TYPE_VERKADA		1
+#define MSG_TYPE_RING_ATTACH	2 // announces the ring segment of msg_data.pid
+#define MSG_TYPE_HEAP_INFO		3 // a heap_info_t, see STAT_MALLOC_HEAP_INFO_MS
 #define MSG_PERMISSIONS			(0666)
 
-#define SHM_SIZE				64
-#define SHM_PERMISSIONS			(0666)
 
+#define MSG_OP_ALLOC			1
+#define MSG_OP_FREE				2
+
+// hooked call behind an event. a moved realloc() sends its free and then
+// its allocation, both as MSG_CALL_REALLOC. operator new and delete count
+// as malloc and free, their aligned forms as MSG_CALL_MEMALIGN
+#define MSG_CALL_MALLOC			0
+#define MSG_CALL_FREE			0
+#define MSG_CALL_CALLOC			1
+#define MSG_CALL_REALLOC		2
+#define MSG_CALL_MEMALIGN		3	// posix_memalign, aligned_alloc, valloc...
+
+/*
+ * one allocation event. pid and gen identify the process image: gen
+ * changes when a process execs or a pid gets reused, so stat_server can
+ * tell stale state from a new process. with sample_interval set, only
+ * sampled allocations and their frees are sent and stat_server scales them
+ * back up. time_ns is taken by the client when the call happened, with
+ * the same clock stat_server reads, so queueing does not age allocations.
+ * seq orders events in the order they happened to the heap: each thread
+ * batches its own, so stat_server can receive a free after the allocation
+ * that reused its address, and tells from seq which is newer. it is the
+ * low 32 bits of EVENT_SEQ_CLOCK in ns, so it wraps every 4s and only
+ * orders events less than 2s apart.
+ */
+#define EVENT_CLOCK				CLOCK_MONOTONIC_COARSE	// vDSO, no syscall
+#define EVENT_SEQ_CLOCK			CLOCK_MONOTONIC			// vDSO too, to the ns
 
 typedef struct {
-	void 	*ptr;
-	size_t 	size;
+	void 		*ptr;
+	size_t 		size;
+	const void	*caller;	// return address of the hooked call
+	uint64_t	time_ns;	// EVENT_CLOCK
+	uint32_t	pid;
+	uint32_t	gen;
+	uint32_t	tid;		// calling thread
+	uint32_t	sample_interval;	// mean bytes between samples, 0 if all
+	uint8_t		op;			// MSG_OP_*
+	uint8_t		call;		// MSG_CALL_*
+	uint8_t		align_shift;	// log2 of the requested alignment, MSG_CALL_MEMALIGN
+	uint8_t		pad;
+	uint32_t	seq;		// wraps, compare with seq_before()
 } msg_data_t;
 
-// message from shared_client to stat_server
+// whether event seq a happened before b, allowing for wrap around
+static inline int seq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+// uniform in [0, 1), xorshift64* with a state per thread seeded from the
+// tid and the clock, so callers on several threads neither share nor touch
+// libc's rand() state
+static inline double sample_random(void)
+{
+	static __thread uint64_t state;
+	struct timespec now;
+
+	if (state == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		state = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^
+			((uint64_t)syscall(SYS_gettid) << 32);
+		state |= 1;
+	}
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+
+	return (double)((state * 0x2545F4914F6CDD1DULL) >> 11) / (1ULL << 53);
+}
+
+/*
+ * number of allocations a sampled one of this size stands for. the client
+ * samples an allocation with probability 1 - exp(-size / sample_interval),
+ * the inverse is rounded up or down at random so that sums stay unbiased.
+ */
+static inline uint32_t sample_weight(size_t size, uint32_t sample_interval)
+{
+	double weight;
+
+	if (sample_interval == 0) {
+		return 1;
+	}
+
+	weight = 1.0 / -expm1(-(double)size / sample_interval);
+	if (weight >= UINT32_MAX) {
+		return UINT32_MAX;
+	}
+
+	return (uint32_t)weight +
+		(sample_random() < weight - (uint32_t)weight);
+}
+
+// linux default MSGMAX, largest message msgsnd() accepts
+#define MSG_MAX_BYTES			8192
+#define MSG_MAX_EVENTS			(MSG_MAX_BYTES / sizeof(msg_data_t))
+
+/*
+ * message from shared_client to stat_server. carries 1 to MSG_MAX_EVENTS
+ * events, only the used part is sent, so the receiver derives the count
+ * from the size msgrcv() returns.
+ */
 typedef struct {
 	long		type;
-	msg_data_t	msg_data;
+	msg_data_t	msg_data[MSG_MAX_EVENTS];
 } msg_t;
 
 
+/*
+ * malloc's own view of a client's heap, from mallinfo2(). sent over the
+ * msgQ, never waiting on it, at most every STAT_MALLOC_HEAP_INFO_MS by
+ * clients that set it, so stat_server can tell what is lost to chunk
+ * overhead from free memory malloc holds on to.
+ */
+typedef struct {
+	uint32_t	pid;
+	uint32_t	gen;
+	uint64_t	time_ns;		// EVENT_CLOCK
+	uint64_t	arena;			// from sbrk() and arena mmaps
+	uint64_t	in_use;			// in allocated chunks, headers included
+	uint64_t	free;			// in free chunks
+	uint64_t	fastbin_free;	// of free, in fastbins
+	uint64_t	mmapped;		// in chunks mmapped on their own, all in use
+	uint64_t	releasable;		// of free, the top of the main arena, trimmed first
+} heap_info_t;
+
+typedef struct {
+	long		type;			// MSG_TYPE_HEAP_INFO
+	heap_info_t	info;
+} heap_info_msg_t;
+
+
+#define CACHE_LINE_SIZE			64
+
+/*
+ * Server presence
+ *
+ * stat_server announces itself in one POSIX shared memory segment,
+ * SERVER_SEG_NAME, that whichever of it and the clients comes first
+ * creates and that is never unlinked, so clients keep watching the same
+ * page across server restarts. Clients only send events while active is
+ * set and the heartbeat is recent, so they cost next to nothing without
+ * a server and never wait on the queue of one that died. Each server
+ * start bumps epoch, which has clients look up its new msgQ.
+ */
+#define SERVER_SEG_NAME			"/stat_malloc_server"
+#define SERVER_SEG_PERMISSIONS	(0666)
+#define SERVER_HEARTBEAT_NS		(10 * 1000000000ULL)	// gone when older
+
+typedef struct {
+	// read on every event
+	uint32_t	active;			// set while a server runs
+	uint8_t		pad0[CACHE_LINE_SIZE - 4];
+
+	// written once a second
+	uint64_t	heartbeat_ns;	// EVENT_CLOCK
+	uint32_t	epoch;			// server starts so far
+	uint32_t	server_pid;
+	uint8_t		pad1[CACHE_LINE_SIZE - 16];
+} server_seg_t;
+
+/*
+ * Ring transport (STAT_MALLOC_TRANSPORT=ring)
+ *
+ * Each client process creates one POSIX shared memory segment named
+ * RING_SEG_NAME_FORMAT holding RING_SLOTS single-producer/single-consumer
+ * rings. A client thread claims a free slot on its first event and releases
+ * it at thread exit. The producer only writes head, stat_server only writes
+ * tail, so events are published with plain stores and a release fence.
+ */
+#define RING_SEG_NAME_FORMAT	"/stat_malloc.%d"	// for shm_open()
+#define RING_SEG_NAME_PREFIX	"stat_malloc."		// as listed in RING_SEG_DIR
+#define RING_SEG_DIR			"/dev/shm"
+#define RING_SEG_MAGIC			0x53544d52			// "STMR"
+#define RING_SEG_PERMISSIONS	(0666)
+
+#define RING_SLOTS				64		// max concurrently tracked threads
+#define RING_EVENTS				4096	// per ring, must be power of two
+
+#define RING_FREE				0		// slot unclaimed
+#define RING_OWNED				1		// producer thread is alive
+#define RING_CLOSED				2		// producer exited, drain then free
+
+typedef struct {
+	// written by producer
+	uint32_t	state;
+	uint32_t	tid;
+	uint64_t	head;
+	uint64_t	tail_cache;		// producer's last view of tail
+	uint8_t		pad0[CACHE_LINE_SIZE - 24];
+
+	// written by stat_server
+	uint64_t	tail;
+	uint8_t		pad1[CACHE_LINE_SIZE - 8];
+
+	msg_data_t	events[RING_EVENTS];
+} ring_t;
+
+typedef struct {
+	uint32_t	magic;			// set last, once the segment is usable
+	uint32_t	pid;
+	uint32_t	num_slots_used;	// high water mark of claimed slots
+	uint8_t		pad[CACHE_LINE_SIZE - 12];
+	ring_t		rings[RING_SLOTS];
+} ring_seg_t;
+
+
+/*
+ * Counters transport (STAT_MALLOC_TRANSPORT=counters)
+ *
+ * No events at all: each client process creates one POSIX shared memory
+ * segment named COUNTER_SEG_NAME_FORMAT and each thread adds its
+ * allocations and frees to its own slab of counters with relaxed atomics.
+ * stat_server only sums the slabs when it prints. Slab 0 is shared, with
+ * atomic adds, by threads that find no free slab.
+ *
+ * Clients of the event transports with a full queue policy other than
+ * block (STAT_MALLOC_ON_FULL), or with the small object cache, create the
+ * same segment in COUNTER_SEG_EVENTS mode, only to count the events they
+ * drop and their cache hits. Degrading to counters switches it to
+ * COUNTER_SEG_DEGRADED for good.
+ */
+#define COUNTER_SEG_NAME_FORMAT	"/stat_malloc_cnt.%d"
+#define COUNTER_SEG_NAME_PREFIX	"stat_malloc_cnt."
+#define COUNTER_SEG_MAGIC		0x53544d43			// "STMC"
+
+#define COUNTER_SLABS			64
+
+#define COUNTER_SEG_COUNTING	0		// counters transport, slabs in use
+#define COUNTER_SEG_EVENTS		1		// event transport, drop counts only
+#define COUNTER_SEG_DEGRADED	2		// was COUNTER_SEG_EVENTS, now counting
+
+#define COUNTER_SLAB_FREE		0
+#define COUNTER_SLAB_OWNED		1
+
+/*
+ * size histogram: log-linear size classes, 2^SIZE_CLASS_SUB_BITS bins per
+ * power of two. sizes below 2^SIZE_CLASS_SUB_BITS get a bin each, sizes
+ * of 2^SIZE_CLASS_MAX_BITS and up share the last bin. the default of 4
+ * bins per power of two up to 1GiB has the spacing of jemalloc's size
+ * classes. both can be set at build time, e.g. -DSIZE_CLASS_SUB_BITS=3,
+ * the client and stat_server have to agree on them for counters mode.
+ */
+#ifndef SIZE_CLASS_SUB_BITS
+#define SIZE_CLASS_SUB_BITS		2
+#endif
+#ifndef SIZE_CLASS_MAX_BITS
+#define SIZE_CLASS_MAX_BITS		30		// 1GiB
+#endif
+#define NUM_SIZE_BINS			(((SIZE_CLASS_MAX_BITS - SIZE_CLASS_SUB_BITS + 1) \
+								  << SIZE_CLASS_SUB_BITS) + 1)
+
+static inline uint32_t size_to_bin(size_t size)
+{
+	// sizes below 2^SIZE_CLASS_SUB_BITS come out with shift 0, no branch
+	uint32_t shift = 63 - __builtin_clzll(size | (1 << SIZE_CLASS_SUB_BITS)) -
+		SIZE_CLASS_SUB_BITS;
+	uint64_t bin = ((uint64_t)shift << SIZE_CLASS_SUB_BITS) + (size >> shift);
+
+	return (bin < NUM_SIZE_BINS - 1) ? bin : NUM_SIZE_BINS - 1;
+}
+
+// smallest size counted in a bin
+static inline size_t size_bin_min(uint32_t bin)
+{
+	uint32_t group = bin >> SIZE_CLASS_SUB_BITS;
+
+	if (group == 0) {
+		return bin;
+	}
+	return (size_t)((1 << SIZE_CLASS_SUB_BITS) |
+					(bin & ((1 << SIZE_CLASS_SUB_BITS) - 1))) << (group - 1);
+}
+
+// alignment histogram of MSG_CALL_MEMALIGN allocations: 16 bytes or less,
+// then a bin per power of two up to 4096+. bin 0 is everything else
+#define NUM_ALIGN_BINS			10
+#define ALIGN_BIN_NONE			0
+
+static inline uint32_t align_to_bin(uint32_t align_shift)
+{
+	if (align_shift <= 4) {
+		return 1;
+	}
+	return (align_shift - 3 < NUM_ALIGN_BINS - 1) ? align_shift - 3 :
+		NUM_ALIGN_BINS - 1;
+}
+
+/*
+ * small object cache (STAT_MALLOC_CACHE): the client serves sizes below
+ * 2^CACHE_MAX_BITS from per-thread free lists, one per size bin, and
+ * counts in its counter slab whether each allocation was a hit, served by
+ * the thread's cache alone, or a miss.
+ */
+#define CACHE_MAX_BITS			10		// 1KiB
+#define NUM_CACHE_BINS			((CACHE_MAX_BITS - SIZE_CLASS_SUB_BITS + 1) \
+								 << SIZE_CLASS_SUB_BITS)
+
+typedef struct {
+	uint32_t	state;
+	uint32_t	tid;
+	uint64_t	allocations;
+	uint64_t	frees;
+	uint64_t	allocated_bytes;
+	uint64_t	freed_bytes;
+	uint64_t	bin_allocations[NUM_SIZE_BINS];
+	uint64_t	bin_frees[NUM_SIZE_BINS];
+	uint64_t	cache_hits[NUM_CACHE_BINS];		// any transport
+	uint64_t	cache_misses[NUM_CACHE_BINS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) counter_slab_t;
+
+typedef struct {
+	uint32_t		magic;			// set last, once the segment is usable
+	uint32_t		pid;
+	uint32_t		gen;
+	uint32_t		num_slabs_used;	// high water mark of claimed slabs
+	uint32_t		mode;			// COUNTER_SEG_*
+	uint32_t		pad0;
+	uint64_t		dropped_allocations;	// events lost to a full queue
+	uint64_t		dropped_frees;
+	uint64_t		dropped_bytes;	// requested by the dropped allocations
+	uint64_t		dropped_samples;	// sampled allocations lost to a
+	uint64_t		dropped_sample_bytes;	// full sample set, never sent
+	uint8_t			pad[2 * CACHE_LINE_SIZE - 64];
+	counter_slab_t	slabs[COUNTER_SLABS];
+} counter_seg_t;
+
+
 #endif // STAT_SERVER_H_INCLUDE
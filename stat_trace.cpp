@@ -0,0 +1,444 @@
+/*******************************************************************************
+ * Filename: stat_trace.cpp
+ *
+ * Purpose: offline analyzer for traces recorded with stat_server -t.
+ *
+ * Replays a trace up to a point in time and prints the same size and age
+ * histograms stat_server would have printed then, when live bytes peaked,
+ * and how long the allocations freed so far lived.
+ *
+ * usage: stat_trace [-t seconds] [-p pid] trace_file
+ *
+ ******************************************************************************/
+
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // getopt
+#include "stat_server.h"
+#include "size_label.h"
+#include "ptr_table.h"
+#include "age_hist.h"
+#include "lifetime_hist.h"
+#include "trace.h"
+
+
+using namespace std;
+
+// live state of one process image
+typedef struct {
+	uint32_t	gen;
+	ptr_table	map_data;
+	unordered_map<uint64_t, trace_event_t> recent_frees;	// latest by ptr
+} process_t;
+
+map<pid_t, process_t *> processes;
+
+uint64_t overall_allocations = 0;
+uint64_t total_current_size  = 0;
+uint64_t current_allocations = 0;
+uint64_t peak_size 			 = 0;
+uint64_t peak_time_us 		 = 0;
+uint64_t size_array[NUM_SIZE_BINS] = {0};
+uint64_t align_array[NUM_ALIGN_BINS] = {0};
+lifetime_hist lifetime_array[NUM_SIZE_BINS];
+
+void usage(const char *name);
+process_t *find_process(const trace_event_t &event);
+bool event_before(const trace_event_t &event, const ptr_entry_t *entry);
+void insert_allocation(process_t *proc, const trace_event_t &event);
+void remove_allocation(process_t *proc, const trace_event_t &event);
+void reclaim_process(pid_t pid);
+string size_string(double size);
+string time_string(uint64_t time_us, uint64_t start_realtime_us);
+string duration_string(uint64_t time_us);
+void print_bars(const char *label, uint64_t num, uint64_t symbol_size);
+void print_report(uint64_t now_us, uint64_t start_realtime_us,
+				  uint64_t num_events);
+
+int main(int argc, char *argv[])
+{
+	trace_reader  reader;
+	trace_event_t event;
+	uint64_t 	  end_us = UINT64_MAX;
+	uint64_t 	  now_us = 0;
+	uint64_t 	  num_events = 0;
+	pid_t 		  only_pid = 0;
+	process_t 	  *proc;
+	int 		  opt;
+
+	while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			end_us = strtod(optarg, NULL) * 1000000;
+			break;
+		case 'p':
+			only_pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!reader.open(argv[optind])) {
+		cerr << argv[optind] << ": not a readable stat_malloc trace" << endl;
+		return 1;
+	}
+
+	while (reader.next(&event)) {
+		if (event.time_us > end_us) {
+			break;
+		}
+		now_us = max(now_us, event.time_us);
+		num_events++;
+
+		if (only_pid && (event.pid != (uint32_t)only_pid)) {
+			continue;
+		}
+		if (event.op == TRACE_OP_EXIT) {
+			if (processes.count(event.pid) &&
+				(processes[event.pid]->gen == event.gen)) {
+				reclaim_process(event.pid);
+			}
+			continue;
+		}
+		if ((proc = find_process(event)) == NULL) {
+			continue;
+		}
+		if (event.op == MSG_OP_ALLOC) {
+			insert_allocation(proc, event);
+		} else if (event.op == MSG_OP_FREE) {
+			remove_allocation(proc, event);
+		}
+	}
+	if (end_us != UINT64_MAX) {
+		now_us = end_us;
+	}
+
+	print_report(now_us, reader.start_realtime_us(), num_events);
+
+	return 0;
+}
+
+void usage(const char *name)
+{
+	cerr << "usage: " << name << " [-t seconds] [-p pid] trace_file" << endl;
+	cerr << "  -t  stop at this many seconds into the trace, default the end"
+		 << endl;
+	cerr << "  -p  only this process" << endl;
+}
+
+// same rules as stat_server: only an allocation starts a new image
+process_t *find_process(const trace_event_t &event)
+{
+	map<pid_t, process_t *>::iterator it;
+	process_t *proc;
+
+	if ((it = processes.find(event.pid)) != processes.end()) {
+		if (it->second->gen == event.gen) {
+			return it->second;
+		}
+		if (event.op != MSG_OP_ALLOC) {
+			return NULL;
+		}
+		reclaim_process(event.pid);
+	} else if (event.op != MSG_OP_ALLOC) {
+		return NULL;
+	}
+
+	proc = new process_t();
+	proc->gen = event.gen;
+	processes[event.pid] = proc;
+
+	return proc;
+}
+
+// whether event happened before the allocation in entry
+bool event_before(const trace_event_t &event, const ptr_entry_t *entry)
+{
+	return trace_event_ns(event.time_us, event.seq) <
+		trace_event_ns(entry->time_us, entry->seq);
+}
+
+/*
+ * paired with frees the way stat_server's shards do: records of different
+ * threads are in the order received, so an allocation can come after its
+ * own free, or after the free of a later allocation at its address
+ */
+void insert_allocation(process_t *proc, const trace_event_t &event)
+{
+	unordered_map<uint64_t, trace_event_t>::iterator it;
+	ptr_entry_t *entry;
+	bool 		existed;
+
+	if ((event.ptr == 0) || (event.size == 0)) {
+		return;
+	}
+
+	entry = proc->map_data.find((void *)event.ptr);
+	if ((entry != NULL) && event_before(event, entry)) {
+		// the allocation it was replaced by came first, so it is freed
+		return;
+	}
+
+	entry = proc->map_data.insert((void *)event.ptr, &existed);
+	if (existed) {
+		total_current_size  -= entry->size * entry->weight;
+		current_allocations -= entry->weight;
+		size_array[entry->size_bin] -= entry->weight;
+		align_array[entry->align_bin] -= entry->weight;
+	}
+
+	entry->size 	= min(event.size, (uint64_t)PTR_ENTRY_MAX_SIZE);
+	entry->size_bin = size_to_bin(event.size);
+	entry->align_bin = (event.call == MSG_CALL_MEMALIGN) ?
+		align_to_bin(event.align_shift) : ALIGN_BIN_NONE;
+	entry->time_us 	= event.time_us;
+	entry->seq 		= event.seq;
+	entry->weight 	= sample_weight(event.size, event.sample_interval);
+
+	overall_allocations += entry->weight;
+	current_allocations += entry->weight;
+	total_current_size  += entry->size * entry->weight;
+	size_array[entry->size_bin] += entry->weight;
+	align_array[entry->align_bin] += entry->weight;
+
+	if (total_current_size > peak_size) {
+		peak_size 	 = total_current_size;
+		peak_time_us = event.time_us;
+	}
+
+	if ((it = proc->recent_frees.find(event.ptr)) != proc->recent_frees.end()) {
+		if (event_before(it->second, entry)) {
+			// a free of an earlier allocation here, no longer needed
+			proc->recent_frees.erase(it);
+		} else {
+			// its free, or a later one at this address, came in first
+			remove_allocation(proc, trace_event_t(it->second));
+		}
+	}
+}
+
+void remove_allocation(process_t *proc, const trace_event_t &event)
+{
+	unordered_map<uint64_t, trace_event_t>::iterator it;
+	ptr_entry_t *entry;
+	uint64_t 	lifetime_us;
+
+	entry = proc->map_data.find((void *)event.ptr);
+	if ((entry != NULL) && event_before(event, entry)) {
+		// a late free of the allocation this one replaced
+		return;
+	}
+
+	it = proc->recent_frees.find(event.ptr);
+	if ((it == proc->recent_frees.end()) ||
+		(trace_event_ns(it->second.time_us, it->second.seq) <
+		 trace_event_ns(event.time_us, event.seq))) {
+		proc->recent_frees[event.ptr] = event;
+	}
+
+	if (entry == NULL) {
+		// allocated before the trace started, or its allocation is still
+		// to come
+		return;
+	}
+
+	lifetime_us = (event.time_us > entry->time_us) ?
+		event.time_us - entry->time_us : 0;
+	lifetime_array[entry->size_bin].add(lifetime_us, entry->weight);
+
+	total_current_size  -= entry->size * entry->weight;
+	current_allocations -= entry->weight;
+	size_array[entry->size_bin] -= entry->weight;
+	align_array[entry->align_bin] -= entry->weight;
+	proc->map_data.erase(entry);
+}
+
+// the process exited, exec'd or its pid was reused, its memory is gone
+void reclaim_process(pid_t pid)
+{
+	map<pid_t, process_t *>::iterator it;
+
+	if ((it = processes.find(pid)) == processes.end()) {
+		return;
+	}
+
+	it->second->map_data.for_each([&](const ptr_entry_t &entry) {
+		total_current_size  -= entry.size * entry.weight;
+		current_allocations -= entry.weight;
+		size_array[entry.size_bin] -= entry.weight;
+		align_array[entry.align_bin] -= entry.weight;
+	});
+
+	delete it->second;
+	processes.erase(it);
+}
+
+// size in appropriate units
+string size_string(double size)
+{
+	const char *size_units[] = { "", "KiB", "MiB", "GiB", "TiB" };
+	uint32_t 	size_unit_index = 0;
+	char 		buf[32];
+
+	while ((size > 1024) &&
+		   (size_unit_index < (sizeof(size_units) / sizeof(size_units[0]) - 1))) {
+		size /= 1024;
+		size_unit_index++;
+	}
+	snprintf(buf, sizeof(buf), "%.1f%s", size, size_units[size_unit_index]);
+
+	return buf;
+}
+
+// "+12.345s (2019-09-03 10:11:12)"
+string time_string(uint64_t time_us, uint64_t start_realtime_us)
+{
+	time_t 	  t = (start_realtime_us + time_us) / 1000000;
+	struct tm tam = *localtime(&t);
+	char 	  buf[64];
+
+	snprintf(buf, sizeof(buf), "+%.3fs (%d-%02d-%02d %02d:%02d:%02d)",
+			 time_us / 1000000.0, tam.tm_year + 1900, tam.tm_mon + 1,
+			 tam.tm_mday, tam.tm_hour, tam.tm_min, tam.tm_sec);
+
+	return buf;
+}
+
+// duration in appropriate units
+string duration_string(uint64_t time_us)
+{
+	char buf[32];
+
+	if (time_us < 1000) {
+		snprintf(buf, sizeof(buf), "%luus", (unsigned long)time_us);
+	} else if (time_us < 1000000) {
+		snprintf(buf, sizeof(buf), "%.1fms", time_us / 1000.0);
+	} else {
+		snprintf(buf, sizeof(buf), "%.1fs", time_us / 1000000.0);
+	}
+
+	return buf;
+}
+
+void print_bars(const char *label, uint64_t num, uint64_t symbol_size)
+{
+	printf("%s: ", label);
+	for (num /= symbol_size; num; num--) {
+		printf("#");
+	}
+	printf("\n");
+}
+
+void print_report(uint64_t now_us, uint64_t start_realtime_us,
+				  uint64_t num_events)
+{
+	const char *align_labels[NUM_ALIGN_BINS] = {
+		"", "<= 16 bytes", "32 bytes", "64 bytes", "128 bytes", "256 bytes",
+		"512 bytes", "1024 bytes", "2048 bytes", "4096+ bytes",
+	};
+	const char *age_labels[NUM_AGE_BINS] = {
+		"< 1 sec", "< 10 sec", "< 100 sec", "< 1000 sec", ">= 1000 sec",
+	};
+	uint64_t 	age_array[NUM_AGE_BINS] = {0};
+	uint64_t 	max_bin_num = 0, symbol_size = 1;
+	uint64_t 	age, num_aligned = 0;
+	uint32_t 	bin;
+	lifetime_hist *hist;
+	map<pid_t, process_t *>::iterator it;
+
+	// ages straight from the live entries, no need for a timing wheel here
+	for (it = processes.begin(); it != processes.end(); it++) {
+		it->second->map_data.for_each([&](const ptr_entry_t &entry) {
+			age = (now_us > entry.time_us) ?
+				(now_us - entry.time_us) / AGE_TICK_US : 0;
+			for (bin = 0; bin < NUM_AGE_BINS - 1; bin++) {
+				if (age < age_bin_limit[bin]) {
+					break;
+				}
+			}
+			age_array[bin] += entry.weight;
+		});
+	}
+
+	printf("Trace at %s, %lu events\n",
+		   time_string(now_us, start_realtime_us).c_str(),
+		   (unsigned long)num_events);
+	printf("%lu Overall allocations since start\n",
+		   (unsigned long)overall_allocations);
+	printf("%s Current total allocated size\n",
+		   size_string(total_current_size).c_str());
+	printf("%lu Current allocations in %lu processes\n",
+		   (unsigned long)current_allocations, (unsigned long)processes.size());
+	printf("%s Peak total allocated size at %s\n",
+		   size_string(peak_size).c_str(),
+		   time_string(peak_time_us, start_realtime_us).c_str());
+	printf("\n\n");
+
+	for (bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		max_bin_num = max(max_bin_num, size_array[bin]);
+	}
+	for (bin = 0; bin < NUM_AGE_BINS; bin++) {
+		max_bin_num = max(max_bin_num, age_array[bin]);
+	}
+	while (max_bin_num > 40) {
+		max_bin_num >>= 1;
+		symbol_size <<= 1;
+	}
+
+	printf("Current allocations by size: (# - %lu current allocations)\n",
+		   (unsigned long)symbol_size);
+	// only the bins in use, there are many fine grained ones
+	for (bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		if (size_array[bin]) {
+			print_bars(size_bin_string(bin).c_str(), size_array[bin],
+					   symbol_size);
+		}
+	}
+	printf("\n\n");
+
+	for (bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+		num_aligned += align_array[bin];
+	}
+	if (num_aligned) {
+		printf("Current aligned allocations by alignment: "
+			   "(# - %lu current allocations)\n", (unsigned long)symbol_size);
+		for (bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+			print_bars(align_labels[bin], align_array[bin], symbol_size);
+		}
+		printf("\n\n");
+	}
+
+	printf("Current allocations by age: (# - %lu current allocations)\n",
+		   (unsigned long)symbol_size);
+	for (bin = 0; bin < NUM_AGE_BINS; bin++) {
+		print_bars(age_labels[bin], age_array[bin], symbol_size);
+	}
+	printf("\n\n");
+
+	// same log-linear histograms and percentiles as stat_server
+	printf("Lifetimes of freed allocations by size:\n");
+	for (bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		hist = &lifetime_array[bin];
+		if (hist->count == 0) {
+			continue;
+		}
+		printf("%s: %lu freed, p50 <= %s, p99 <= %s, max %s\n",
+			   size_bin_string(bin).c_str(), (unsigned long)hist->count,
+			   duration_string(hist->percentile(0.5)).c_str(),
+			   duration_string(hist->percentile(0.99)).c_str(),
+			   duration_string(hist->max_us).c_str());
+	}
+}
@@ -0,0 +1,687 @@
+/*******************************************************************************
+ * Filename: stats_export.cpp
+ *
+ * Purpose: writes stat_server's stats_snapshot_t as Prometheus text or
+ * JSON, see stats_export.h.
+ *
+ * The whole file is formatted into a string first and written to a
+ * temporary file next to the export file, which is then renamed over it,
+ * so a scraper never reads half of an interval.
+ *
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h> // open
+#include "stats_export.h"
+
+
+using namespace std;
+
+static string prometheus_text(const stats_snapshot_t &snapshot);
+static string json_text(const stats_snapshot_t &snapshot);
+static void add_metric(string &out, const char *name, const char *type,
+					   const char *help);
+static void add_sample(string &out, const char *name, const string &labels,
+					   double value);
+static string label(const char *name, const string &value);
+static string pool_candidate_labels(const export_pool_candidate_t &candidate);
+static string thread_labels(const export_thread_t &thread);
+static string cross_free_labels(const export_cross_free_t &cross_free);
+static string escape(const string &value);
+
+bool stats_export_write(const char *path, const stats_snapshot_t &snapshot)
+{
+	string 		text;
+	string 		tmp_path = string(path) + ".tmp";
+	const char 	*p;
+	size_t 		left;
+	ssize_t 	written;
+	size_t 		len = strlen(path);
+	int 		fd;
+
+	if ((len > 5) && (strcmp(path + len - 5, ".json") == 0)) {
+		text = json_text(snapshot);
+	} else {
+		text = prometheus_text(snapshot);
+	}
+
+	fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+	p 	 = text.data();
+	left = text.size();
+	while (left > 0) {
+		if ((written = write(fd, p, left)) <= 0) {
+			close(fd);
+			unlink(tmp_path.c_str());
+			return false;
+		}
+		p 	 += written;
+		left -= written;
+	}
+	close(fd);
+
+	if (rename(tmp_path.c_str(), path) == -1) {
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+string prometheus_text(const stats_snapshot_t &snapshot)
+{
+	string out;
+	char   buf[32];
+
+	out.reserve(4096);
+
+	add_metric(out, "stat_malloc_allocations_total", "counter",
+			   "Allocations since stat_server started");
+	add_sample(out, "stat_malloc_allocations_total", "",
+			   snapshot.overall_allocations);
+	add_metric(out, "stat_malloc_live_bytes", "gauge",
+			   "Bytes currently allocated");
+	add_sample(out, "stat_malloc_live_bytes", "", snapshot.current_size);
+	add_metric(out, "stat_malloc_live_allocations", "gauge",
+			   "Allocations currently live");
+	add_sample(out, "stat_malloc_live_allocations", "",
+			   snapshot.current_allocations);
+	add_metric(out, "stat_malloc_processes", "gauge", "Processes tracked");
+	add_sample(out, "stat_malloc_processes", "", snapshot.processes.size());
+	add_metric(out, "stat_malloc_table_bytes", "gauge",
+			   "Memory used by stat_server's allocation tables");
+	add_sample(out, "stat_malloc_table_bytes", "", snapshot.table_size);
+
+	add_metric(out, "stat_malloc_dropped_events_total", "counter",
+			   "Events clients dropped on a full queue, their stats are "
+			   "incomplete");
+	add_sample(out, "stat_malloc_dropped_events_total", label("op", "alloc"),
+			   snapshot.dropped_allocations);
+	add_sample(out, "stat_malloc_dropped_events_total", label("op", "free"),
+			   snapshot.dropped_frees);
+	add_metric(out, "stat_malloc_dropped_bytes_total", "counter",
+			   "Bytes requested by dropped allocations");
+	add_sample(out, "stat_malloc_dropped_bytes_total", "",
+			   snapshot.dropped_bytes);
+	add_metric(out, "stat_malloc_dropped_samples_total", "counter",
+			   "Sampled allocations clients dropped on a full sample set");
+	add_sample(out, "stat_malloc_dropped_samples_total", "",
+			   snapshot.dropped_samples);
+	add_metric(out, "stat_malloc_dropped_sample_bytes_total", "counter",
+			   "Bytes requested by dropped sampled allocations");
+	add_sample(out, "stat_malloc_dropped_sample_bytes_total", "",
+			   snapshot.dropped_sample_bytes);
+
+	add_metric(out, "stat_malloc_live_allocations_by_size", "gauge",
+			   "Live allocations by size bin, min_bytes is the bin's lower bound");
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		snprintf(buf, sizeof(buf), "%lu", (unsigned long)size_bin_min(bin));
+		add_sample(out, "stat_malloc_live_allocations_by_size",
+				   label("min_bytes", buf), snapshot.size_array[bin]);
+	}
+
+	add_metric(out, "stat_malloc_live_allocations_by_alignment", "gauge",
+			   "Live aligned allocations by requested alignment, the last bin "
+			   "and up");
+	for (uint32_t bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+		snprintf(buf, sizeof(buf), "%lu", 1UL << (bin + 3));
+		add_sample(out, "stat_malloc_live_allocations_by_alignment",
+				   label("alignment", buf), snapshot.align_array[bin]);
+	}
+
+	add_metric(out, "stat_malloc_live_allocations_by_age", "gauge",
+			   "Live allocations by age bin, below max_seconds, not including "
+			   "counters mode processes");
+	for (uint32_t bin = 0; bin < NUM_AGE_BINS; bin++) {
+		if (bin < NUM_AGE_BINS - 1) {
+			snprintf(buf, sizeof(buf), "%lu",
+					 (unsigned long)(age_bin_limit[bin] / AGE_TICKS_PER_SEC));
+		} else {
+			snprintf(buf, sizeof(buf), "+Inf");
+		}
+		add_sample(out, "stat_malloc_live_allocations_by_age",
+				   label("max_seconds", buf), snapshot.age_array[bin]);
+	}
+
+	add_metric(out, "stat_malloc_lifetime_seconds", "summary",
+			   "How long freed allocations lived, by size bin, since start");
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		string size_label;
+
+		if (snapshot.lifetime_count[bin] == 0) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%lu", (unsigned long)size_bin_min(bin));
+		size_label = label("min_bytes", buf);
+		add_sample(out, "stat_malloc_lifetime_seconds",
+				   size_label + "," + label("quantile", "0.5"),
+				   snapshot.lifetime_p50_us[bin] / 1e6);
+		add_sample(out, "stat_malloc_lifetime_seconds",
+				   size_label + "," + label("quantile", "0.99"),
+				   snapshot.lifetime_p99_us[bin] / 1e6);
+		add_sample(out, "stat_malloc_lifetime_seconds",
+				   size_label + "," + label("quantile", "1"),
+				   snapshot.lifetime_max_us[bin] / 1e6);
+		add_sample(out, "stat_malloc_lifetime_seconds_count", size_label,
+				   snapshot.lifetime_count[bin]);
+	}
+
+	add_metric(out, "stat_malloc_queue_latency_seconds", "gauge",
+			   "Delay from the client's call to stat_server handling it, over "
+			   "the last interval");
+	if (snapshot.latency_events) {
+		add_sample(out, "stat_malloc_queue_latency_seconds",
+				   label("quantile", "0.5"), snapshot.latency_p50_us / 1e6);
+		add_sample(out, "stat_malloc_queue_latency_seconds",
+				   label("quantile", "0.99"), snapshot.latency_p99_us / 1e6);
+		add_sample(out, "stat_malloc_queue_latency_seconds",
+				   label("quantile", "1"), snapshot.latency_max_us / 1e6);
+	}
+	add_metric(out, "stat_malloc_queue_latency_events", "gauge",
+			   "Events received over the last interval");
+	add_sample(out, "stat_malloc_queue_latency_events", "",
+			   snapshot.latency_events);
+
+	add_metric(out, "stat_malloc_process_live_bytes", "gauge",
+			   "Bytes currently allocated by a process");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_live_bytes", label("pid", buf),
+				   snapshot.processes[i].current_size);
+	}
+	add_metric(out, "stat_malloc_process_live_allocations", "gauge",
+			   "Allocations currently live in a process");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_live_allocations",
+				   label("pid", buf), snapshot.processes[i].current_allocations);
+	}
+	add_metric(out, "stat_malloc_process_allocations_total", "counter",
+			   "Allocations made by a process");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_allocations_total",
+				   label("pid", buf), snapshot.processes[i].overall_allocations);
+	}
+	add_metric(out, "stat_malloc_process_dropped_events_total", "counter",
+			   "Events a process dropped on a full queue");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (snapshot.processes[i].dropped_events == 0) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_dropped_events_total",
+				   label("pid", buf), snapshot.processes[i].dropped_events);
+	}
+
+	add_metric(out, "stat_malloc_process_rss_bytes", "gauge",
+			   "Resident memory of a process, of any kind");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].mem_read) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_rss_bytes", label("pid", buf),
+				   snapshot.processes[i].rss_bytes);
+	}
+	add_metric(out, "stat_malloc_process_anon_bytes", "gauge",
+			   "Resident anonymous memory of a process, the heap's upper bound");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].mem_read) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_anon_bytes", label("pid", buf),
+				   snapshot.processes[i].anon_bytes);
+	}
+	add_metric(out, "stat_malloc_process_anon_pss_bytes", "gauge",
+			   "Proportional share of a process's resident anonymous memory");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].mem_read) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_anon_pss_bytes", label("pid", buf),
+				   snapshot.processes[i].pss_anon_bytes);
+	}
+	add_metric(out, "stat_malloc_process_swap_bytes", "gauge",
+			   "Anonymous memory of a process swapped out");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].mem_read) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_swap_bytes", label("pid", buf),
+				   snapshot.processes[i].swap_bytes);
+	}
+	add_metric(out, "stat_malloc_process_gap_bytes", "gauge",
+			   "Resident anonymous memory not requested by live allocations: "
+			   "malloc overhead, free memory it retains, and non-heap "
+			   "anonymous memory");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].mem_read) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_gap_bytes", label("pid", buf),
+				   (double)snapshot.processes[i].anon_bytes -
+				   snapshot.processes[i].current_size);
+	}
+	add_metric(out, "stat_malloc_process_malloc_bytes", "gauge",
+			   "malloc's own view of a process's heap, releasable is the free "
+			   "top of the heap, for processes that set "
+			   "STAT_MALLOC_HEAP_INFO_MS");
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		if (!snapshot.processes[i].heap_info) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%d", snapshot.processes[i].pid);
+		add_sample(out, "stat_malloc_process_malloc_bytes",
+				   label("pid", buf) + "," + label("state", "in_use"),
+				   snapshot.processes[i].malloc_in_use_bytes);
+		add_sample(out, "stat_malloc_process_malloc_bytes",
+				   label("pid", buf) + "," + label("state", "free"),
+				   snapshot.processes[i].malloc_free_bytes);
+		add_sample(out, "stat_malloc_process_malloc_bytes",
+				   label("pid", buf) + "," + label("state", "releasable"),
+				   snapshot.processes[i].malloc_releasable_bytes);
+	}
+
+	add_metric(out, "stat_malloc_site_live_bytes", "gauge",
+			   "Bytes currently allocated from a call site, largest sites only");
+	for (size_t i = 0; i < snapshot.sites.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.sites[i].pid);
+		add_sample(out, "stat_malloc_site_live_bytes",
+				   label("pid", buf) + "," +
+				   label("site", snapshot.sites[i].symbol),
+				   snapshot.sites[i].live_bytes);
+	}
+	add_metric(out, "stat_malloc_site_live_allocations", "gauge",
+			   "Allocations currently live from a call site");
+	for (size_t i = 0; i < snapshot.sites.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.sites[i].pid);
+		add_sample(out, "stat_malloc_site_live_allocations",
+				   label("pid", buf) + "," +
+				   label("site", snapshot.sites[i].symbol),
+				   snapshot.sites[i].live_count);
+	}
+	add_metric(out, "stat_malloc_site_allocations_per_second", "gauge",
+			   "Allocation rate of a call site over the last interval");
+	for (size_t i = 0; i < snapshot.sites.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.sites[i].pid);
+		add_sample(out, "stat_malloc_site_allocations_per_second",
+				   label("pid", buf) + "," +
+				   label("site", snapshot.sites[i].symbol),
+				   snapshot.sites[i].allocations_per_sec);
+	}
+	add_metric(out, "stat_malloc_site_frees_per_second", "gauge",
+			   "Free rate of a call site's allocations over the last interval");
+	for (size_t i = 0; i < snapshot.sites.size(); i++) {
+		snprintf(buf, sizeof(buf), "%d", snapshot.sites[i].pid);
+		add_sample(out, "stat_malloc_site_frees_per_second",
+				   label("pid", buf) + "," +
+				   label("site", snapshot.sites[i].symbol),
+				   snapshot.sites[i].frees_per_sec);
+	}
+
+	add_metric(out, "stat_malloc_pool_candidate_short_lived_per_second",
+			   "gauge", "Allocations of a call site and size bin freed within "
+			   "the churn window, per second over the last interval");
+	for (size_t i = 0; i < snapshot.pool_candidates.size(); i++) {
+		add_sample(out, "stat_malloc_pool_candidate_short_lived_per_second",
+				   pool_candidate_labels(snapshot.pool_candidates[i]),
+				   snapshot.pool_candidates[i].short_lived_per_sec);
+	}
+	add_metric(out, "stat_malloc_pool_candidate_allocations_per_second",
+			   "gauge", "Allocations of a pool candidate per second");
+	for (size_t i = 0; i < snapshot.pool_candidates.size(); i++) {
+		add_sample(out, "stat_malloc_pool_candidate_allocations_per_second",
+				   pool_candidate_labels(snapshot.pool_candidates[i]),
+				   snapshot.pool_candidates[i].allocations_per_sec);
+	}
+	add_metric(out, "stat_malloc_pool_candidate_peak_live", "gauge",
+			   "Most allocations of a pool candidate live at once since start, "
+			   "an upper bound");
+	for (size_t i = 0; i < snapshot.pool_candidates.size(); i++) {
+		add_sample(out, "stat_malloc_pool_candidate_peak_live",
+				   pool_candidate_labels(snapshot.pool_candidates[i]),
+				   snapshot.pool_candidates[i].peak_live_count);
+	}
+	add_metric(out, "stat_malloc_pool_candidate_capacity", "gauge",
+			   "Suggested pool capacity for a pool candidate");
+	for (size_t i = 0; i < snapshot.pool_candidates.size(); i++) {
+		add_sample(out, "stat_malloc_pool_candidate_capacity",
+				   pool_candidate_labels(snapshot.pool_candidates[i]),
+				   snapshot.pool_candidates[i].capacity);
+	}
+
+	add_metric(out, "stat_malloc_cache_allocations_total", "counter",
+			   "Allocations of a size bin the small object caches were asked "
+			   "for since start, by whether the thread's cache alone served it");
+	for (size_t i = 0; i < snapshot.cache_bins.size(); i++) {
+		snprintf(buf, sizeof(buf), "%lu",
+				 (unsigned long)snapshot.cache_bins[i].min_bytes);
+		add_sample(out, "stat_malloc_cache_allocations_total",
+				   label("min_bytes", buf) + "," + label("result", "hit"),
+				   snapshot.cache_bins[i].hits);
+		add_sample(out, "stat_malloc_cache_allocations_total",
+				   label("min_bytes", buf) + "," + label("result", "miss"),
+				   snapshot.cache_bins[i].misses);
+	}
+
+	add_metric(out, "stat_malloc_frees_total", "counter",
+			   "Frees of tracked allocations since start, by whether another "
+			   "thread made the allocation");
+	add_sample(out, "stat_malloc_frees_total", label("cross_thread", "false"),
+			   snapshot.overall_frees - snapshot.overall_cross_frees);
+	add_sample(out, "stat_malloc_frees_total", label("cross_thread", "true"),
+			   snapshot.overall_cross_frees);
+
+	add_metric(out, "stat_malloc_thread_live_bytes", "gauge",
+			   "Bytes currently allocated by a thread, largest threads only");
+	for (size_t i = 0; i < snapshot.threads.size(); i++) {
+		add_sample(out, "stat_malloc_thread_live_bytes",
+				   thread_labels(snapshot.threads[i]),
+				   snapshot.threads[i].live_bytes);
+	}
+	add_metric(out, "stat_malloc_thread_live_allocations", "gauge",
+			   "Allocations currently live from a thread");
+	for (size_t i = 0; i < snapshot.threads.size(); i++) {
+		add_sample(out, "stat_malloc_thread_live_allocations",
+				   thread_labels(snapshot.threads[i]),
+				   snapshot.threads[i].live_count);
+	}
+	add_metric(out, "stat_malloc_thread_allocations_per_second", "gauge",
+			   "Allocation rate of a thread over the last interval");
+	for (size_t i = 0; i < snapshot.threads.size(); i++) {
+		add_sample(out, "stat_malloc_thread_allocations_per_second",
+				   thread_labels(snapshot.threads[i]),
+				   snapshot.threads[i].allocations_per_sec);
+	}
+	add_metric(out, "stat_malloc_thread_frees_per_second", "gauge",
+			   "Free rate of a thread over the last interval, whoever allocated");
+	for (size_t i = 0; i < snapshot.threads.size(); i++) {
+		add_sample(out, "stat_malloc_thread_frees_per_second",
+				   thread_labels(snapshot.threads[i]),
+				   snapshot.threads[i].frees_per_sec);
+	}
+
+	add_metric(out, "stat_malloc_cross_thread_frees_total", "counter",
+			   "Frees of one thread's allocations by another, busiest pairs "
+			   "only");
+	for (size_t i = 0; i < snapshot.cross_frees.size(); i++) {
+		add_sample(out, "stat_malloc_cross_thread_frees_total",
+				   cross_free_labels(snapshot.cross_frees[i]),
+				   snapshot.cross_frees[i].count);
+	}
+	add_metric(out, "stat_malloc_cross_thread_freed_bytes_total", "counter",
+			   "Bytes of one thread's allocations freed by another");
+	for (size_t i = 0; i < snapshot.cross_frees.size(); i++) {
+		add_sample(out, "stat_malloc_cross_thread_freed_bytes_total",
+				   cross_free_labels(snapshot.cross_frees[i]),
+				   snapshot.cross_frees[i].bytes);
+	}
+
+	return out;
+}
+
+string json_text(const stats_snapshot_t &snapshot)
+{
+	string out;
+	char   buf[256];
+
+	out.reserve(4096);
+
+	snprintf(buf, sizeof(buf), "{\"time_us\":%lu,\"overall_allocations\":%ld,"
+			 "\"current_size\":%ld,\"current_allocations\":%ld,"
+			 "\"table_size\":%lu,", (unsigned long)snapshot.time_us,
+			 snapshot.overall_allocations, snapshot.current_size,
+			 snapshot.current_allocations, (unsigned long)snapshot.table_size);
+	out += buf;
+	snprintf(buf, sizeof(buf), "\"dropped\":{\"allocations\":%lu,"
+			 "\"frees\":%lu,\"bytes\":%lu,\"samples\":%lu,"
+			 "\"sample_bytes\":%lu},",
+			 (unsigned long)snapshot.dropped_allocations,
+			 (unsigned long)snapshot.dropped_frees,
+			 (unsigned long)snapshot.dropped_bytes,
+			 (unsigned long)snapshot.dropped_samples,
+			 (unsigned long)snapshot.dropped_sample_bytes);
+	out += buf;
+
+	out += "\"size_bins\":[";
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		snprintf(buf, sizeof(buf), "%s{\"min_bytes\":%lu,\"count\":%lu}",
+				 bin ? "," : "", (unsigned long)size_bin_min(bin),
+				 (unsigned long)snapshot.size_array[bin]);
+		out += buf;
+	}
+	out += "],\"align_bins\":[";
+	for (uint32_t bin = ALIGN_BIN_NONE + 1; bin < NUM_ALIGN_BINS; bin++) {
+		snprintf(buf, sizeof(buf), "%s{\"alignment\":%lu,\"count\":%lu}",
+				 (bin > ALIGN_BIN_NONE + 1) ? "," : "", 1UL << (bin + 3),
+				 (unsigned long)snapshot.align_array[bin]);
+		out += buf;
+	}
+	out += "],\"age_bins\":[";
+	for (uint32_t bin = 0; bin < NUM_AGE_BINS; bin++) {
+		if (bin < NUM_AGE_BINS - 1) {
+			snprintf(buf, sizeof(buf), "%s{\"max_seconds\":%lu,\"count\":%lu}",
+					 bin ? "," : "",
+					 (unsigned long)(age_bin_limit[bin] / AGE_TICKS_PER_SEC),
+					 (unsigned long)snapshot.age_array[bin]);
+		} else {
+			snprintf(buf, sizeof(buf), ",{\"max_seconds\":null,\"count\":%lu}",
+					 (unsigned long)snapshot.age_array[bin]);
+		}
+		out += buf;
+	}
+
+	out += "],\"lifetimes\":[";
+	for (uint32_t bin = 0; bin < NUM_SIZE_BINS; bin++) {
+		snprintf(buf, sizeof(buf), "%s{\"min_bytes\":%lu,\"count\":%lu,"
+				 "\"p50_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu}",
+				 bin ? "," : "", (unsigned long)size_bin_min(bin),
+				 (unsigned long)snapshot.lifetime_count[bin],
+				 (unsigned long)snapshot.lifetime_p50_us[bin],
+				 (unsigned long)snapshot.lifetime_p99_us[bin],
+				 (unsigned long)snapshot.lifetime_max_us[bin]);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), "],\"queue_latency\":{\"events\":%lu,"
+			 "\"p50_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu},",
+			 (unsigned long)snapshot.latency_events,
+			 (unsigned long)snapshot.latency_p50_us,
+			 (unsigned long)snapshot.latency_p99_us,
+			 (unsigned long)snapshot.latency_max_us);
+	out += buf;
+
+	out += "\"processes\":[";
+	for (size_t i = 0; i < snapshot.processes.size(); i++) {
+		const export_process_t *proc = &snapshot.processes[i];
+		snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"current_size\":%ld,"
+				 "\"current_allocations\":%ld,\"overall_allocations\":%ld,"
+				 "\"sample_interval\":%u,\"counters\":%s,"
+				 "\"dropped_events\":%lu", i ? "," : "",
+				 proc->pid, proc->current_size, proc->current_allocations,
+				 proc->overall_allocations, proc->sample_interval,
+				 proc->counters ? "true" : "false",
+				 (unsigned long)proc->dropped_events);
+		out += buf;
+		if (proc->mem_read) {
+			snprintf(buf, sizeof(buf), ",\"rss_bytes\":%lu,\"anon_bytes\":%lu,"
+					 "\"pss_anon_bytes\":%lu,\"swap_bytes\":%lu",
+					 (unsigned long)proc->rss_bytes,
+					 (unsigned long)proc->anon_bytes,
+					 (unsigned long)proc->pss_anon_bytes,
+					 (unsigned long)proc->swap_bytes);
+			out += buf;
+		}
+		if (proc->heap_info) {
+			snprintf(buf, sizeof(buf), ",\"malloc\":{\"in_use_bytes\":%lu,"
+					 "\"free_bytes\":%lu,\"releasable_bytes\":%lu}",
+					 (unsigned long)proc->malloc_in_use_bytes,
+					 (unsigned long)proc->malloc_free_bytes,
+					 (unsigned long)proc->malloc_releasable_bytes);
+			out += buf;
+		}
+		out += "}";
+	}
+	out += "],\"sites\":[";
+	for (size_t i = 0; i < snapshot.sites.size(); i++) {
+		const export_site_t *site = &snapshot.sites[i];
+		snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"caller\":%lu,\"symbol\":\"",
+				 i ? "," : "", site->pid, (unsigned long)site->caller);
+		out += buf;
+		out += escape(site->symbol);
+		snprintf(buf, sizeof(buf), "\",\"live_bytes\":%ld,\"live_count\":%ld,"
+				 "\"allocations_per_sec\":%.1f,\"frees_per_sec\":%.1f}",
+				 site->live_bytes, site->live_count, site->allocations_per_sec,
+				 site->frees_per_sec);
+		out += buf;
+	}
+	out += "],\"pool_candidates\":[";
+	for (size_t i = 0; i < snapshot.pool_candidates.size(); i++) {
+		const export_pool_candidate_t *candidate = &snapshot.pool_candidates[i];
+		snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"caller\":%lu,\"symbol\":\"",
+				 i ? "," : "", candidate->pid, (unsigned long)candidate->caller);
+		out += buf;
+		out += escape(candidate->symbol);
+		snprintf(buf, sizeof(buf), "\",\"min_bytes\":%lu,"
+				 "\"short_lived_per_sec\":%.1f,\"allocations_per_sec\":%.1f,"
+				 "\"peak_live_count\":%ld,\"capacity\":%lu}",
+				 (unsigned long)candidate->min_bytes,
+				 candidate->short_lived_per_sec, candidate->allocations_per_sec,
+				 candidate->peak_live_count, (unsigned long)candidate->capacity);
+		out += buf;
+	}
+	out += "],\"cache\":[";
+	for (size_t i = 0; i < snapshot.cache_bins.size(); i++) {
+		snprintf(buf, sizeof(buf), "%s{\"min_bytes\":%lu,\"hits\":%lu,"
+				 "\"misses\":%lu}", i ? "," : "",
+				 (unsigned long)snapshot.cache_bins[i].min_bytes,
+				 (unsigned long)snapshot.cache_bins[i].hits,
+				 (unsigned long)snapshot.cache_bins[i].misses);
+		out += buf;
+	}
+	out += "],\"threads\":[";
+	for (size_t i = 0; i < snapshot.threads.size(); i++) {
+		const export_thread_t *thread = &snapshot.threads[i];
+		snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"tid\":%u,"
+				 "\"live_bytes\":%ld,\"live_count\":%ld,"
+				 "\"allocations_per_sec\":%.1f,\"frees_per_sec\":%.1f}",
+				 i ? "," : "", thread->pid, thread->tid, thread->live_bytes,
+				 thread->live_count, thread->allocations_per_sec,
+				 thread->frees_per_sec);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), "],\"frees\":%ld,\"cross_thread_frees\":%ld,"
+			 "\"cross_thread_pairs\":[", snapshot.overall_frees,
+			 snapshot.overall_cross_frees);
+	out += buf;
+	for (size_t i = 0; i < snapshot.cross_frees.size(); i++) {
+		const export_cross_free_t *cross_free = &snapshot.cross_frees[i];
+		snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"alloc_tid\":%u,"
+				 "\"free_tid\":%u,\"count\":%ld,\"bytes\":%ld}",
+				 i ? "," : "", cross_free->pid, cross_free->alloc_tid,
+				 cross_free->free_tid, cross_free->count, cross_free->bytes);
+		out += buf;
+	}
+	out += "]}\n";
+
+	return out;
+}
+
+void add_metric(string &out, const char *name, const char *type,
+				const char *help)
+{
+	out += "# HELP ";
+	out += name;
+	out += " ";
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += " ";
+	out += type;
+	out += "\n";
+}
+
+void add_sample(string &out, const char *name, const string &labels,
+				double value)
+{
+	char buf[32];
+
+	out += name;
+	if (!labels.empty()) {
+		out += "{" + labels + "}";
+	}
+	snprintf(buf, sizeof(buf), " %.15g\n", value);
+	out += buf;
+}
+
+string label(const char *name, const string &value)
+{
+	return string(name) + "=\"" + escape(value) + "\"";
+}
+
+string pool_candidate_labels(const export_pool_candidate_t &candidate)
+{
+	char pid[16], min_bytes[32];
+
+	snprintf(pid, sizeof(pid), "%d", candidate.pid);
+	snprintf(min_bytes, sizeof(min_bytes), "%lu",
+			 (unsigned long)candidate.min_bytes);
+	return label("pid", pid) + "," + label("site", candidate.symbol) + "," +
+		label("min_bytes", min_bytes);
+}
+
+string thread_labels(const export_thread_t &thread)
+{
+	char pid[16], tid[16];
+
+	snprintf(pid, sizeof(pid), "%d", thread.pid);
+	snprintf(tid, sizeof(tid), "%u", thread.tid);
+	return label("pid", pid) + "," + label("tid", tid);
+}
+
+string cross_free_labels(const export_cross_free_t &cross_free)
+{
+	char pid[16], alloc_tid[16], free_tid[16];
+
+	snprintf(pid, sizeof(pid), "%d", cross_free.pid);
+	snprintf(alloc_tid, sizeof(alloc_tid), "%u", cross_free.alloc_tid);
+	snprintf(free_tid, sizeof(free_tid), "%u", cross_free.free_tid);
+	return label("pid", pid) + "," + label("alloc_tid", alloc_tid) + "," +
+		label("free_tid", free_tid);
+}
+
+// the same three escapes do for label values and JSON strings
+string escape(const string &value)
+{
+	string out;
+
+	for (size_t i = 0; i < value.size(); i++) {
+		switch (value[i]) {
+		case '\\':
+			out += "\\\\";
+			break;
+		case '"':
+			out += "\\\"";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		default:
+			if ((unsigned char)value[i] >= 0x20) {
+				out += value[i];
+			}
+			break;
+		}
+	}
+
+	return out;
+}
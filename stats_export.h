@@ -0,0 +1,126 @@
+/*******************************************************************************
+ * Filename: stats_export.h
+ *
+ * Purpose: machine readable copy of what stat_server prints, for
+ * monitoring to scrape. stat_server fills a stats_snapshot_t from the
+ * totals it has already merged for printing, so exporting never walks the
+ * allocation tables, and stats_export_write() replaces the export file
+ * with it in one rename().
+ *
+ * The file is JSON if its name ends in ".json", Prometheus text exposition
+ * format otherwise, e.g. for node_exporter's textfile collector. Counts
+ * are exact and scaled up for sampled processes as printed.
+ *
+ ******************************************************************************/
+
+#ifndef STATS_EXPORT_H_INCLUDED
+#define STATS_EXPORT_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "stat_server.h"
+#include "age_hist.h"
+
+typedef struct {
+	pid_t		pid;
+	long		current_size;
+	long		current_allocations;
+	long		overall_allocations;
+	uint32_t	sample_interval;		// 0 if not sampled
+	bool		counters;				// counters mode client
+	uint64_t	dropped_events;			// lost to a full queue, see
+										// STAT_MALLOC_ON_FULL
+	bool		mem_read;				// rest of proc_mem_t is set
+	uint64_t	rss_bytes;
+	uint64_t	anon_bytes;				// heap RSS and then some
+	uint64_t	pss_anon_bytes;
+	uint64_t	swap_bytes;
+	bool		heap_info;				// the client sends heap_info_t
+	uint64_t	malloc_in_use_bytes;	// in chunks, mmapped ones included
+	uint64_t	malloc_free_bytes;		// held by malloc, not in use
+	uint64_t	malloc_releasable_bytes;	// of free, at the top of the heap
+	uint64_t	heap_info_age_us;		// since the client sent it
+} export_process_t;
+
+typedef struct {
+	pid_t		pid;
+	uintptr_t	caller;
+	std::string	symbol;
+	long		live_bytes;
+	long		live_count;
+	double		allocations_per_sec;
+	double		frees_per_sec;
+} export_site_t;
+
+typedef struct {
+	pid_t		pid;
+	uintptr_t	caller;
+	std::string	symbol;
+	uint64_t	min_bytes;				// of the size bin
+	double		short_lived_per_sec;	// freed within the churn window
+	double		allocations_per_sec;
+	long		peak_live_count;		// upper bound, since start
+	uint64_t	capacity;				// suggested pool size
+} export_pool_candidate_t;
+
+typedef struct {
+	pid_t		pid;
+	uint32_t	tid;					// 0 for threads past the per process limit
+	long		live_bytes;				// allocated by the thread
+	long		live_count;
+	double		allocations_per_sec;
+	double		frees_per_sec;			// made by the thread
+} export_thread_t;
+
+typedef struct {
+	pid_t		pid;
+	uint32_t	alloc_tid;
+	uint32_t	free_tid;
+	long		count;					// since start
+	long		bytes;
+} export_cross_free_t;
+
+typedef struct {
+	uint64_t	min_bytes;				// of the size bin
+	uint64_t	hits;					// since start, see STAT_MALLOC_CACHE
+	uint64_t	misses;
+} export_cache_bin_t;
+
+typedef struct {
+	uint64_t	time_us;				// realtime
+	long		overall_allocations;
+	long		current_size;
+	long		current_allocations;
+	size_t		table_size;
+	uint64_t	size_array[NUM_SIZE_BINS];
+	uint64_t	align_array[NUM_ALIGN_BINS];
+	uint64_t	age_array[NUM_AGE_BINS];	// without counters mode clients
+	uint64_t	lifetime_count[NUM_SIZE_BINS];	// freed since start
+	uint64_t	lifetime_p50_us[NUM_SIZE_BINS];	// upper bound of the p50 bucket
+	uint64_t	lifetime_p99_us[NUM_SIZE_BINS];
+	uint64_t	lifetime_max_us[NUM_SIZE_BINS];
+	long		overall_frees;			// of known allocations, since start
+	long		overall_cross_frees;	// of those, by another thread
+	uint64_t	dropped_allocations;	// since start, by all processes
+	uint64_t	dropped_frees;
+	uint64_t	dropped_bytes;
+	uint64_t	dropped_samples;		// sampled allocations never sent, the
+	uint64_t	dropped_sample_bytes;	// client's sample set was full
+	uint64_t	latency_events;			// queue latency since the last export
+	uint64_t	latency_p50_us;			// upper bound of the p50 bin
+	uint64_t	latency_p99_us;
+	uint64_t	latency_max_us;
+	std::vector<export_process_t> processes;
+	std::vector<export_site_t> sites;	// the printed, largest ones
+	std::vector<export_pool_candidate_t> pool_candidates;	// the printed ones
+	std::vector<export_cache_bin_t> cache_bins;	// in use, smallest first
+	std::vector<export_thread_t> threads;	// the printed ones
+	std::vector<export_cross_free_t> cross_frees;	// the printed ones
+} stats_snapshot_t;
+
+// false, with errno set, if the file could not be replaced
+bool stats_export_write(const char *path, const stats_snapshot_t &snapshot);
+
+#endif // STATS_EXPORT_H_INCLUDED
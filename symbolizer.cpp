@@ -0,0 +1,286 @@
+/*******************************************************************************
+ * Filename: symbolizer.cpp
+ *
+ * Purpose: resolves client code addresses to symbol names for stat_server.
+ *
+ * A process's executable mappings are read from /proc/<pid>/maps the first
+ * time one of its addresses is looked up. Each mapped ELF file is parsed
+ * once for its function symbols (.symtab, or .dynsym for stripped files)
+ * and the sorted table is shared by every process that maps the file.
+ *
+ ******************************************************************************/
+
+
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h> // open
+#include <elf.h>
+#include <cxxabi.h> // __cxa_demangle
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "symbolizer.h"
+
+
+using namespace std;
+
+typedef struct {
+	uintptr_t	start;
+	uintptr_t	end;
+	uintptr_t	offset;		// file offset of start
+	string		path;
+} mapping_t;
+
+typedef struct {
+	uintptr_t	addr;
+	uint64_t	size;
+	string		name;
+} elf_symbol_t;
+
+typedef struct {
+	vector<elf_symbol_t> symbols;	// sorted by addr
+	vector<Elf64_Phdr> 	 loads;		// PT_LOAD headers, file offset to addr
+} elf_file_t;
+
+static map<pid_t, vector<mapping_t> > process_maps;
+static map<string, elf_file_t> elf_files;
+
+static bool read_maps(pid_t pid, vector<mapping_t> &mappings);
+static const mapping_t *find_mapping(pid_t pid, uintptr_t addr);
+static const elf_file_t &load_elf(const string &path);
+static void read_symbols(const uint8_t *image, size_t image_size,
+						 elf_file_t &elf);
+static string demangle(const string &name);
+
+string symbolize(pid_t pid, uintptr_t addr)
+{
+	const mapping_t 	*mapping;
+	uintptr_t 			file_offset, elf_addr = 0;
+	bool 				found = false;
+	vector<elf_symbol_t>::const_iterator it;
+	char 				buf[64];
+	string 				module;
+
+	snprintf(buf, sizeof(buf), "0x%lx", (unsigned long)addr);
+
+	if ((mapping = find_mapping(pid, addr)) == NULL) {
+		return buf;
+	}
+
+	module = mapping->path.substr(mapping->path.rfind('/') + 1);
+	const elf_file_t &elf = load_elf(mapping->path);
+
+	// mapped address -> file offset -> address the symbol table uses
+	file_offset = addr - mapping->start + mapping->offset;
+	for (size_t i = 0; i < elf.loads.size(); i++) {
+		if ((file_offset >= elf.loads[i].p_offset) &&
+			(file_offset < elf.loads[i].p_offset + elf.loads[i].p_filesz)) {
+			elf_addr = file_offset - elf.loads[i].p_offset +
+				elf.loads[i].p_vaddr;
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		snprintf(buf, sizeof(buf), "+0x%lx", (unsigned long)file_offset);
+		return module + buf;
+	}
+
+	// last symbol starting at or below elf_addr
+	it = upper_bound(elf.symbols.begin(), elf.symbols.end(), elf_addr,
+					 [](uintptr_t a, const elf_symbol_t &sym) {
+						 return a < sym.addr;
+					 });
+	if ((it == elf.symbols.begin()) ||
+		(elf_addr >= (it - 1)->addr + max((it - 1)->size, (uint64_t)1))) {
+		snprintf(buf, sizeof(buf), "+0x%lx", (unsigned long)elf_addr);
+		return module + buf;
+	}
+	it--;
+
+	snprintf(buf, sizeof(buf), "+0x%lx (",
+			 (unsigned long)(elf_addr - it->addr));
+	return demangle(it->name) + buf + module + ")";
+}
+
+void symbolizer_forget(pid_t pid)
+{
+	process_maps.erase(pid);
+}
+
+// executable file backed mappings of a process
+bool read_maps(pid_t pid, vector<mapping_t> &mappings)
+{
+	char 			path[64];
+	char 			line[4096];
+	char 			perms[8], file[4096];
+	unsigned long 	start, end, offset;
+	FILE 			*fp;
+	mapping_t 		mapping;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	if ((fp = fopen(path, "r")) == NULL) {
+		return false;
+	}
+
+	mappings.clear();
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		file[0] = '\0';
+		if ((sscanf(line, "%lx-%lx %7s %lx %*s %*s %4095s", &start, &end,
+					perms, &offset, file) < 4) ||
+			(perms[2] != 'x') || (file[0] != '/')) {
+			continue;
+		}
+		mapping.start  = start;
+		mapping.end    = end;
+		mapping.offset = offset;
+		mapping.path   = file;
+		mappings.push_back(mapping);
+	}
+	fclose(fp);
+
+	return true;
+}
+
+const mapping_t *find_mapping(pid_t pid, uintptr_t addr)
+{
+	map<pid_t, vector<mapping_t> >::iterator it;
+
+	// second pass re-reads maps in case the address is in a new dlopen()
+	for (int pass = 0; pass < 2; pass++) {
+		it = process_maps.find(pid);
+		if ((it == process_maps.end()) || (pass == 1)) {
+			vector<mapping_t> mappings;
+			if (!read_maps(pid, mappings)) {
+				// process already gone
+				return NULL;
+			}
+			process_maps[pid] = mappings;
+			it = process_maps.find(pid);
+		}
+
+		for (size_t i = 0; i < it->second.size(); i++) {
+			if ((addr >= it->second[i].start) && (addr < it->second[i].end)) {
+				return &it->second[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// parsed once per path, a file that can't be read gets an empty table
+const elf_file_t &load_elf(const string &path)
+{
+	map<string, elf_file_t>::iterator it;
+	struct stat st;
+	void 		*image;
+	int 		fd;
+
+	if ((it = elf_files.find(path)) != elf_files.end()) {
+		return it->second;
+	}
+	it = elf_files.insert(make_pair(path, elf_file_t())).first;
+
+	if ((fd = open(path.c_str(), O_RDONLY)) == -1) {
+		return it->second;
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(Elf64_Ehdr))) {
+		close(fd);
+		return it->second;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		return it->second;
+	}
+
+	read_symbols((const uint8_t *)image, st.st_size, it->second);
+	munmap(image, st.st_size);
+
+	return it->second;
+}
+
+void read_symbols(const uint8_t *image, size_t image_size, elf_file_t &elf)
+{
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+	const Elf64_Phdr *phdr;
+	const Elf64_Shdr *shdr, *symtab = NULL, *strtab;
+	const Elf64_Sym  *sym;
+	const char 		 *names;
+	elf_symbol_t 	 symbol;
+
+	if ((memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) ||
+		(ehdr->e_ident[EI_CLASS] != ELFCLASS64) ||
+		(ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr) >
+		 image_size) ||
+		(ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) >
+		 image_size)) {
+		return;
+	}
+
+	phdr = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+	for (int i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD) {
+			elf.loads.push_back(phdr[i]);
+		}
+	}
+
+	// full symbol table if not stripped, else the dynamic one
+	shdr = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+	for (int i = 0; i < ehdr->e_shnum; i++) {
+		if ((shdr[i].sh_type == SHT_SYMTAB) ||
+			((shdr[i].sh_type == SHT_DYNSYM) && (symtab == NULL))) {
+			symtab = &shdr[i];
+		}
+	}
+	if ((symtab == NULL) || (symtab->sh_link >= ehdr->e_shnum) ||
+		(symtab->sh_offset + symtab->sh_size > image_size)) {
+		return;
+	}
+	strtab = &shdr[symtab->sh_link];
+	if (strtab->sh_offset + strtab->sh_size > image_size) {
+		return;
+	}
+
+	sym   = (const Elf64_Sym *)(image + symtab->sh_offset);
+	names = (const char *)(image + strtab->sh_offset);
+	for (size_t i = 0; i < symtab->sh_size / sizeof(Elf64_Sym); i++) {
+		if ((ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC) ||
+			(sym[i].st_value == 0) || (sym[i].st_name >= strtab->sh_size)) {
+			continue;
+		}
+		symbol.addr = sym[i].st_value;
+		symbol.size = sym[i].st_size;
+		symbol.name = string(names + sym[i].st_name,
+							 strnlen(names + sym[i].st_name,
+									 strtab->sh_size - sym[i].st_name));
+		elf.symbols.push_back(symbol);
+	}
+
+	sort(elf.symbols.begin(), elf.symbols.end(),
+		 [](const elf_symbol_t &a, const elf_symbol_t &b) {
+			 return a.addr < b.addr;
+		 });
+}
+
+string demangle(const string &name)
+{
+	char 	*demangled;
+	int 	status;
+	string 	result;
+
+	demangled = abi::__cxa_demangle(name.c_str(), NULL, NULL, &status);
+	if ((status != 0) || (demangled == NULL)) {
+		return name;
+	}
+	result = demangled;
+	free(demangled);
+
+	return result;
+}
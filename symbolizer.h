@@ -0,0 +1,23 @@
+/*******************************************************************************
+ * Filename: symbolizer.h
+ *
+ * Purpose: turns code addresses of client processes into symbol names for
+ * stat_server, using /proc/<pid>/maps and the ELF symbol tables of the
+ * mapped files. Lookups are done on demand and cached.
+ *
+ ******************************************************************************/
+
+#ifndef SYMBOLIZER_H_INCLUDED
+#define SYMBOLIZER_H_INCLUDED
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+// "function+0x1f (module)", or the raw address if it can't be resolved
+std::string symbolize(pid_t pid, uintptr_t addr);
+
+// drop the cached memory map of a process that exited
+void symbolizer_forget(pid_t pid);
+
+#endif // SYMBOLIZER_H_INCLUDED
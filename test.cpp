@@ -13,7 +13,9 @@
 #include <iostream>
 #include <thread> // threads
 #include <stdlib.h>
-#include <unistd.h> // sleep
+#include <unistd.h> // sleep, fork
+#include <pthread.h> // pthread_exit
+#include <sys/wait.h> // waitpid
 
 using namespace std;
 
@@ -24,6 +26,8 @@ using namespace std;
 
 void recurssive_test(uint32_t num_malloc, size_t size);
 void multithreaded_test(size_t size);
+void fork_thread(void);
+void fork_test(void);
 
 
 void recurssive_test(uint32_t num_malloc, size_t size)
@@ -64,6 +68,34 @@ void multithreaded_test(size_t size)
 	th11.join();
 }
 
+// a thread that allocated forks, and its copy in the child exits as a
+// thread, which runs the shared library's thread exit handlers there
+void fork_thread(void)
+{
+	pid_t pid;
+	int   status;
+
+	free(malloc(32));
+
+	pid = fork();
+	if (pid == 0) {
+		free(malloc(32));
+		pthread_exit(NULL);
+	}
+	if ((pid == -1) || (waitpid(pid, &status, 0) != pid) ||
+		!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		cerr << "Test app: fork child failed" << endl;
+		exit(1);
+	}
+}
+
+void fork_test(void)
+{
+	thread th(fork_thread);
+
+	th.join();
+}
+
 
 int main()
 {
@@ -74,6 +106,10 @@ int main()
     // TEST MULTIPLE THREADS - no crashes or deadlocks
 	multithreaded_test(4);
 
+    // TEST FORK - the child's thread exit handlers don't touch the parent's
+    // shared memory
+	fork_test();
+
     void *alloc_ptr, *calloc_ptr;
     size_t size = 8;
 
@@ -0,0 +1,376 @@
+/*******************************************************************************
+ * Filename: trace.cpp
+ *
+ * Purpose: writes and reads the binary allocation traces described in
+ * trace.h.
+ *
+ * The writer encodes records into a block in memory, appends finished
+ * blocks to a large buffer and hands the buffer to write() once it fills
+ * up, so recording costs no syscall per event. The reader maps the whole
+ * file and decodes it in place.
+ *
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "stat_server.h"
+#include "trace.h"
+
+
+using namespace std;
+
+static void put_varint(vector<uint8_t> &out, uint64_t value);
+static void put_zigzag(vector<uint8_t> &out, int64_t value);
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value);
+static bool get_zigzag(const uint8_t **p, const uint8_t *end, int64_t *value);
+
+trace_writer::trace_writer() : fd(-1), num_events(0), block_time_us(0)
+{
+	memset(&last, 0, sizeof(last));
+}
+
+trace_writer::~trace_writer()
+{
+	close();
+}
+
+bool trace_writer::open(const char *path, uint64_t start_realtime_us)
+{
+	trace_header_t header;
+
+	fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version 			 = TRACE_VERSION;
+	header.header_size 		 = sizeof(header);
+	header.start_realtime_us = start_realtime_us;
+
+	buffer.reserve(TRACE_BUFFER_BYTES + TRACE_BLOCK_BYTES +
+				   sizeof(trace_block_t) + TRACE_MAX_RECORD_BYTES);
+	payload.reserve(TRACE_BLOCK_BYTES + TRACE_MAX_RECORD_BYTES);
+	buffer.insert(buffer.end(), (uint8_t *)&header,
+				  (uint8_t *)&header + sizeof(header));
+
+	return true;
+}
+
+void trace_writer::add(const trace_event_t &event)
+{
+	uint8_t flags = (event.op & TRACE_OP_MASK) |
+		((event.call << TRACE_CALL_SHIFT) & TRACE_CALL_MASK);
+
+	if (num_events == 0) {
+		// blocks decode on their own, so the first record carries it all
+		memset(&last, 0, sizeof(last));
+		last.time_us  = event.time_us;
+		block_time_us = event.time_us;
+		flags |= TRACE_NEW_PROCESS | TRACE_NEW_THREAD;
+	}
+	if ((event.pid != last.pid) || (event.gen != last.gen) ||
+		(event.sample_interval != last.sample_interval)) {
+		flags |= TRACE_NEW_PROCESS;
+	}
+	if (event.tid != last.tid) {
+		flags |= TRACE_NEW_THREAD;
+	}
+
+	payload.push_back(flags);
+	if (flags & TRACE_NEW_PROCESS) {
+		put_varint(payload, event.pid);
+		put_varint(payload, event.gen);
+		put_varint(payload, event.sample_interval);
+	}
+	if (flags & TRACE_NEW_THREAD) {
+		put_varint(payload, event.tid);
+	}
+	put_zigzag(payload, event.time_us - last.time_us);
+	put_zigzag(payload, (int32_t)(event.seq - last.seq));
+	put_zigzag(payload, event.ptr - last.ptr);
+	if (event.op == MSG_OP_ALLOC) {
+		put_varint(payload, event.size);
+		if (event.call == MSG_CALL_MEMALIGN) {
+			put_varint(payload, event.align_shift);
+		}
+	}
+	put_zigzag(payload, event.caller - last.caller);
+
+	last = event;
+	num_events++;
+
+	if (payload.size() >= TRACE_BLOCK_BYTES) {
+		end_block();
+	}
+}
+
+void trace_writer::flush(void)
+{
+	const uint8_t *p;
+	size_t 		  left;
+	ssize_t 	  written;
+
+	if (fd == -1) {
+		return;
+	}
+
+	end_block();
+
+	p 	 = buffer.data();
+	left = buffer.size();
+	while (left > 0) {
+		if ((written = write(fd, p, left)) <= 0) {
+			perror("trace write");
+			break;
+		}
+		p 	 += written;
+		left -= written;
+	}
+	buffer.clear();
+}
+
+void trace_writer::close(void)
+{
+	if (fd == -1) {
+		return;
+	}
+	flush();
+	::close(fd);
+	fd = -1;
+}
+
+void trace_writer::end_block(void)
+{
+	trace_block_t block;
+
+	if (num_events == 0) {
+		return;
+	}
+
+	memset(&block, 0, sizeof(block));
+	block.magic 		= TRACE_BLOCK_MAGIC;
+	block.num_events 	= num_events;
+	block.payload_size 	= payload.size();
+	block.first_time_us = block_time_us;
+
+	buffer.insert(buffer.end(), (uint8_t *)&block,
+				  (uint8_t *)&block + sizeof(block));
+	buffer.insert(buffer.end(), payload.begin(), payload.end());
+	payload.clear();
+	num_events = 0;
+
+	if (buffer.size() >= TRACE_BUFFER_BYTES) {
+		flush();
+	}
+}
+
+trace_reader::trace_reader() : image(NULL), image_size(0), offset(0),
+	cursor(NULL), block_end(NULL), events_left(0), version(0)
+{
+	memset(&last, 0, sizeof(last));
+}
+
+trace_reader::~trace_reader()
+{
+	close();
+}
+
+bool trace_reader::open(const char *path)
+{
+	const trace_header_t *header;
+	struct stat st;
+	void 		*map;
+	int 		fd;
+
+	if ((fd = ::open(path, O_RDONLY)) == -1) {
+		return false;
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(trace_header_t))) {
+		::close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	header = (const trace_header_t *)map;
+	if ((memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+		(header->version == 0) || (header->version > TRACE_VERSION) ||
+		(header->header_size < sizeof(trace_header_t)) ||
+		(header->header_size > (uint64_t)st.st_size)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	image 		= (const uint8_t *)map;
+	image_size 	= st.st_size;
+	offset 		= header->header_size;
+	events_left = 0;
+	version 	= header->version;
+
+	return true;
+}
+
+void trace_reader::close(void)
+{
+	if (image != NULL) {
+		munmap((void *)image, image_size);
+		image = NULL;
+	}
+}
+
+uint64_t trace_reader::start_realtime_us(void) const
+{
+	return ((const trace_header_t *)image)->start_realtime_us;
+}
+
+bool trace_reader::next(trace_event_t *event)
+{
+	const trace_block_t *block;
+	uint64_t 			value;
+	int64_t 			delta;
+	uint8_t 			flags;
+
+	if (image == NULL) {
+		return false;
+	}
+
+	if (events_left == 0) {
+		// a trace cut short by a crash ends at its last complete block
+		if (offset + sizeof(trace_block_t) > image_size) {
+			return false;
+		}
+		block = (const trace_block_t *)(image + offset);
+		if ((block->magic != TRACE_BLOCK_MAGIC) || (block->num_events == 0) ||
+			(offset + sizeof(trace_block_t) + block->payload_size >
+			 image_size)) {
+			return false;
+		}
+		cursor 		= image + offset + sizeof(trace_block_t);
+		block_end 	= cursor + block->payload_size;
+		events_left = block->num_events;
+		offset 	   += sizeof(trace_block_t) + block->payload_size;
+
+		memset(&last, 0, sizeof(last));
+		last.time_us = block->first_time_us;
+	}
+
+	if (cursor >= block_end) {
+		return false;
+	}
+	flags = *cursor++;
+	last.op   = flags & TRACE_OP_MASK;
+	last.call = (flags & TRACE_CALL_MASK) >> TRACE_CALL_SHIFT;
+
+	if (flags & TRACE_NEW_PROCESS) {
+		if (!get_varint(&cursor, block_end, &value)) {
+			return false;
+		}
+		last.pid = value;
+		if (!get_varint(&cursor, block_end, &value)) {
+			return false;
+		}
+		last.gen = value;
+		if (!get_varint(&cursor, block_end, &value)) {
+			return false;
+		}
+		last.sample_interval = value;
+	}
+	if (flags & TRACE_NEW_THREAD) {
+		if (!get_varint(&cursor, block_end, &value)) {
+			return false;
+		}
+		last.tid = value;
+	}
+	if (!get_zigzag(&cursor, block_end, &delta)) {
+		return false;
+	}
+	last.time_us += delta;
+	if (version >= 3) {
+		if (!get_zigzag(&cursor, block_end, &delta)) {
+			return false;
+		}
+		last.seq += (uint32_t)delta;
+	} else {
+		// recorded in the order received, as good as it gets
+		last.seq = (uint32_t)(last.time_us * 1000);
+	}
+	if (!get_zigzag(&cursor, block_end, &delta)) {
+		return false;
+	}
+	last.ptr += delta;
+	last.size 		 = 0;
+	last.align_shift = 0;
+	if (last.op == MSG_OP_ALLOC) {
+		if (!get_varint(&cursor, block_end, &value)) {
+			return false;
+		}
+		last.size = value;
+		if (last.call == MSG_CALL_MEMALIGN) {
+			if (!get_varint(&cursor, block_end, &value)) {
+				return false;
+			}
+			last.align_shift = value;
+		}
+	}
+	if (!get_zigzag(&cursor, block_end, &delta)) {
+		return false;
+	}
+	last.caller += delta;
+
+	events_left--;
+	*event = last;
+	return true;
+}
+
+// LEB128, 7 bits per byte, low bits first
+void put_varint(vector<uint8_t> &out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back((uint8_t)value | 0x80);
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+// small negative deltas stay small
+void put_zigzag(vector<uint8_t> &out, int64_t value)
+{
+	put_varint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+	uint32_t shift = 0;
+
+	*value = 0;
+	while ((*p < end) && (shift < 64)) {
+		*value |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			return true;
+		}
+		shift += 7;
+	}
+	return false;
+}
+
+bool get_zigzag(const uint8_t **p, const uint8_t *end, int64_t *value)
+{
+	uint64_t raw;
+
+	if (!get_varint(p, end, &raw)) {
+		return false;
+	}
+	*value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+	return true;
+}
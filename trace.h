@@ -0,0 +1,143 @@
+/*******************************************************************************
+ * Filename: trace.h
+ *
+ * Purpose: binary trace of allocation events, written by stat_server -t and
+ * read back by the offline tools.
+ *
+ * A trace is a trace_header_t followed by independently decodable blocks.
+ * Each block is a trace_block_t and a payload of variable length records,
+ * delta encoded against the previous record of the same block:
+ *
+ *   flags byte		TRACE_OP_MASK op, TRACE_NEW_PROCESS, TRACE_NEW_THREAD,
+ *					TRACE_CALL_MASK call
+ *   [pid gen sample_interval]	varints, if TRACE_NEW_PROCESS
+ *   [tid]			varint, if TRACE_NEW_THREAD
+ *   time delta		zigzag varint, microseconds
+ *   seq delta		zigzag varint, 32 bits (version 3)
+ *   ptr delta		zigzag varint
+ *   [size]			varint, allocations only
+ *   [align_shift]	varint, MSG_CALL_MEMALIGN allocations only (version 2)
+ *   caller delta	zigzag varint
+ *
+ * A typical record takes 8 to 12 bytes against 56 for a msg_data_t.
+ *
+ * Records keep the order stat_server received them in, which across
+ * threads need not be the order they happened in, see msg_data_t. Readers
+ * that pair allocations with frees order them by trace_event_ns().
+ *
+ ******************************************************************************/
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TRACE_MAGIC				"STMTRACE"
+#define TRACE_VERSION			3				// readers also take 1 and 2
+#define TRACE_BLOCK_MAGIC		0x53544d42			// "STMB"
+
+#define TRACE_BLOCK_BYTES		(64 * 1024)			// payload, before flushing
+#define TRACE_BUFFER_BYTES		(1024 * 1024)		// per write()
+#define TRACE_MAX_RECORD_BYTES	64
+
+#define TRACE_OP_MASK			0x03				// MSG_OP_* or TRACE_OP_EXIT
+#define TRACE_OP_EXIT			3					// stat_server saw pid gen exit
+#define TRACE_NEW_PROCESS		0x04
+#define TRACE_NEW_THREAD		0x08
+#define TRACE_CALL_MASK			0x30				// MSG_CALL_* << TRACE_CALL_SHIFT
+#define TRACE_CALL_SHIFT		4
+
+typedef struct {
+	char		magic[8];			// TRACE_MAGIC, not terminated
+	uint32_t	version;
+	uint32_t	header_size;
+	uint64_t	start_realtime_us;	// wall clock at time_us 0
+} trace_header_t;
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	num_events;
+	uint32_t	payload_size;
+	uint32_t	pad;
+	uint64_t	first_time_us;		// records are deltas from here
+} trace_block_t;
+
+// one decoded record
+typedef struct {
+	uint64_t	time_us;			// since the trace started
+	uint64_t	ptr;
+	uint64_t	size;				// allocations only
+	uint64_t	caller;
+	uint32_t	pid;
+	uint32_t	gen;
+	uint32_t	tid;
+	uint32_t	sample_interval;
+	uint32_t	seq;				// msg_data_t seq less the trace's start
+	uint8_t		op;					// MSG_OP_* or TRACE_OP_EXIT
+	uint8_t		call;				// MSG_CALL_*
+	uint8_t		align_shift;		// see msg_data_t
+} trace_event_t;
+
+/*
+ * when the event happened in ns since the trace started, from time_us and
+ * the seq bits, which agree to well within the 2s seq tells apart. only
+ * to the us for traces before version 3, their seq is filled in from
+ * time_us. negative for an event from before the trace started.
+ */
+static inline int64_t trace_event_ns(uint64_t time_us, uint32_t seq)
+{
+	uint64_t time_ns = time_us * 1000;
+
+	return (int64_t)time_ns + (int32_t)(seq - (uint32_t)time_ns);
+}
+
+class trace_writer {
+public:
+	trace_writer();
+	~trace_writer();
+
+	bool open(const char *path, uint64_t start_realtime_us);
+	bool is_open(void) const { return fd != -1; }
+	void add(const trace_event_t &event);
+
+	// end the current block and write out everything buffered
+	void flush(void);
+	void close(void);
+
+private:
+	int 		fd;
+	std::vector<uint8_t> buffer;	// whole blocks waiting for write()
+	std::vector<uint8_t> payload;	// records of the current block
+	uint32_t 	num_events;
+	uint64_t 	block_time_us;		// first_time_us of the current block
+	trace_event_t last;				// previous record of the current block
+
+	void end_block(void);
+};
+
+class trace_reader {
+public:
+	trace_reader();
+	~trace_reader();
+
+	bool open(const char *path);
+	void close(void);
+	uint64_t start_realtime_us(void) const;
+
+	// returns false at the end of the trace or at a damaged block
+	bool next(trace_event_t *event);
+
+private:
+	const uint8_t *image;
+	size_t 		image_size;
+	size_t 		offset;				// of the next block
+	const uint8_t *cursor;			// next record in the current block
+	const uint8_t *block_end;
+	uint32_t 	events_left;		// in the current block
+	uint32_t 	version;
+	trace_event_t last;
+};
+
+#endif // TRACE_H_INCLUDED